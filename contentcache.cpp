@@ -0,0 +1,176 @@
+/*
+ *  Local copies of recently downloaded objects
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "contentcache.h"
+#include "tracer.h"
+
+#include <KDebug>
+#include <KStandardDirs>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QtAlgorithms>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+#define KIO_MTP                     7000
+
+#define CONTENTCACHE_SHARE          4       // the largest object is a quarter of the limit
+#define CONTENTCACHE_STALE_PART     86400   // sec, partial files of slaves that died
+
+static bool lessRecentlyUsed ( const QFileInfo &a, const QFileInfo &b )
+{
+    return a.lastModified() < b.lastModified();
+}
+
+static QString contentFile ( uint32_t handle, uint64_t size, qint64 modified )
+{
+    return QString::fromLatin1 ( "%1-%2-%3" ).arg ( handle ).arg ( size ).arg ( modified );
+}
+
+static QString baseDirectory()
+{
+    return KStandardDirs::locateLocal ( "cache", QLatin1String ( "kio_mtp/content/" ), true );
+}
+
+ContentCache::ContentCache()
+    : limit ( 0 )
+{
+}
+
+void ContentCache::setLimit ( quint64 limit )
+{
+    this->limit = limit;
+}
+
+bool ContentCache::accepts ( uint64_t size ) const
+{
+    return size > 0 && size <= limit / CONTENTCACHE_SHARE;
+}
+
+QString ContentCache::directory ( const QString &device ) const
+{
+    // device keys contain serial numbers with arbitrary characters
+    const QByteArray hash = QCryptographicHash::hash ( device.toUtf8(), QCryptographicHash::Md5 ).toHex();
+
+    return baseDirectory() + QString::fromLatin1 ( hash ) + QLatin1Char ( '/' );
+}
+
+QString ContentCache::lookup ( const QString &device, uint32_t handle, uint64_t size, qint64 modified )
+{
+    if ( limit == 0 )
+        return QString();
+
+    const QString path = directory ( device ) + contentFile ( handle, size, modified );
+    const QByteArray encoded = QFile::encodeName ( path );
+
+    // the modification time orders the files for eviction
+    if ( utime ( encoded.constData(), 0 ) != 0 )
+        return QString();
+
+    return path;
+}
+
+QString ContentCache::temporaryPath ( const QString &device, uint32_t handle ) const
+{
+    const QString path = directory ( device );
+    QDir().mkpath ( path );
+
+    // several slaves may download the same object at once
+    return path + QString::fromLatin1 ( "%1.%2.part" ).arg ( handle ).arg ( getpid() );
+}
+
+void ContentCache::insert ( const QString &device, uint32_t handle, uint64_t size, qint64 modified, const QString &path )
+{
+    TraceSpan span ( "ContentCache::insert", "cache" );
+
+    remove ( device, handle );
+
+    // the device may send less than it announced
+    if ( ( uint64_t ) QFileInfo ( path ).size() != size || !QDir().rename ( path, directory ( device ) + contentFile ( handle, size, modified ) ) )
+    {
+        kDebug ( KIO_MTP ) << "Could not cache" << path;
+        QFile::remove ( path );
+        return;
+    }
+
+    evict();
+}
+
+void ContentCache::remove ( const QString &device, uint32_t handle )
+{
+    const QDir dir ( directory ( device ) );
+
+    foreach ( const QString &name, dir.entryList ( QStringList ( QString::fromLatin1 ( "%1-*" ).arg ( handle ) ), QDir::Files ) )
+    {
+        dir.remove ( name );
+    }
+}
+
+bool ContentCache::contains ( const QString &device ) const
+{
+    return !QDir ( directory ( device ) ).entryList ( QDir::Files ).isEmpty();
+}
+
+void ContentCache::evict()
+{
+    TraceSpan span ( "ContentCache::evict", "cache" );
+
+    const QDateTime stale = QDateTime::currentDateTime().addSecs ( -CONTENTCACHE_STALE_PART );
+
+    QFileInfoList files;
+    quint64 total = 0;
+
+    const QDir base ( baseDirectory() );
+    foreach ( const QString &device, base.entryList ( QDir::Dirs | QDir::NoDotAndDotDot ) )
+    {
+        foreach ( const QFileInfo &info, QDir ( base.filePath ( device ) ).entryInfoList ( QDir::Files ) )
+        {
+            // leave the downloads of other slaves alone
+            if ( info.fileName().endsWith ( QLatin1String ( ".part" ) ) && info.lastModified() > stale )
+                continue;
+
+            files.append ( info );
+            total += info.size();
+        }
+    }
+
+    if ( total <= limit )
+        return;
+
+    qSort ( files.begin(), files.end(), lessRecentlyUsed );
+
+    int evicted = 0;
+    for ( int i = 0; i < files.size() && total > limit; i++ )
+    {
+        // readers that still have the file open keep their copy
+        if ( QFile::remove ( files.at ( i ).filePath() ) )
+        {
+            total -= files.at ( i ).size();
+            evicted++;
+        }
+    }
+
+    kDebug ( KIO_MTP ) << "Evicted" << evicted << "files from the content cache," << total << "bytes left";
+}
@@ -0,0 +1,91 @@
+/*
+ *  Local copies of recently downloaded objects
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef CONTENTCACHE_H
+#define CONTENTCACHE_H
+
+#include <QString>
+
+#include <stdint.h>
+
+/**
+ * @class ContentCache Keeps the content of recently downloaded objects on disk, so reading them
+ * again doesn't go over USB.
+ *
+ * Like the HashIndex, content is keyed by device and handle and only found while the object
+ * still has the size and modification time it had when it was downloaded, so objects changed
+ * by the device itself are never served stale. Every device has a folder in the cache directory
+ * of the user, shared by all slaves. Files are only renamed into place once complete, and the
+ * least recently used ones are deleted when the cache grows beyond its limit.
+ */
+class ContentCache
+{
+public:
+    ContentCache();
+
+    /**
+     * @param limit The most bytes to keep, 0 disables the cache
+     */
+    void setLimit ( quint64 limit );
+
+    /**
+     * Whether an object of this size is worth keeping, large objects would push out everything
+     * else.
+     */
+    bool accepts ( uint64_t size ) const;
+
+    /**
+     * @param device Identifies the device, see DeviceProfile::key()
+     * @return The file with the content of this state of the object or an empty string
+     */
+    QString lookup ( const QString &device, uint32_t handle, uint64_t size, qint64 modified );
+
+    /**
+     * Where to write the content of an object before passing it to insert().
+     */
+    QString temporaryPath ( const QString &device, uint32_t handle ) const;
+
+    /**
+     * Takes over the complete content of an object written to @p path.
+     */
+    void insert ( const QString &device, uint32_t handle, uint64_t size, qint64 modified, const QString &path );
+
+    /**
+     * Drops the content of every state of an object, after it was written to or deleted.
+     */
+    void remove ( const QString &device, uint32_t handle );
+
+    /**
+     * Whether the content of any object on the device is cached.
+     */
+    bool contains ( const QString &device ) const;
+
+private:
+    QString directory ( const QString &device ) const;
+
+    /**
+     * Deletes the least recently used files until the cache fits its limit.
+     */
+    void evict();
+
+    quint64 limit;
+};
+
+#endif // CONTENTCACHE_H
@@ -0,0 +1,158 @@
+/*
+ *  Content hashes for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "contenthash.h"
+
+#include <string.h>
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl ( uint64_t x, int r )
+{
+    return ( x << r ) | ( x >> ( 64 - r ) );
+}
+
+static inline uint64_t read64 ( const unsigned char *p )
+{
+    return ( uint64_t ) p[0] | ( ( uint64_t ) p[1] << 8 ) | ( ( uint64_t ) p[2] << 16 ) | ( ( uint64_t ) p[3] << 24 )
+           | ( ( uint64_t ) p[4] << 32 ) | ( ( uint64_t ) p[5] << 40 ) | ( ( uint64_t ) p[6] << 48 ) | ( ( uint64_t ) p[7] << 56 );
+}
+
+static inline uint32_t read32 ( const unsigned char *p )
+{
+    return ( uint32_t ) p[0] | ( ( uint32_t ) p[1] << 8 ) | ( ( uint32_t ) p[2] << 16 ) | ( ( uint32_t ) p[3] << 24 );
+}
+
+static inline uint64_t accumulate ( uint64_t acc, uint64_t input )
+{
+    acc += input * PRIME64_2;
+    acc = rotl ( acc, 31 );
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t mergeRound ( uint64_t acc, uint64_t value )
+{
+    acc ^= accumulate ( 0, value );
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+ContentHash::ContentHash()
+    : v1 ( PRIME64_1 + PRIME64_2 ), v2 ( PRIME64_2 ), v3 ( 0 ), v4 ( -PRIME64_1 ), total ( 0 ), buffered ( 0 )
+{
+}
+
+void ContentHash::update ( const void *data, uint64_t length )
+{
+    const unsigned char *p = ( const unsigned char* ) data;
+    const unsigned char *end = p + length;
+
+    total += length;
+
+    // not even one stripe yet, keep it for later
+    if ( buffered + length < 32 )
+    {
+        memcpy ( buffer + buffered, p, length );
+        buffered += length;
+        return;
+    }
+
+    if ( buffered > 0 )
+    {
+        memcpy ( buffer + buffered, p, 32 - buffered );
+        p += 32 - buffered;
+
+        v1 = accumulate ( v1, read64 ( buffer ) );
+        v2 = accumulate ( v2, read64 ( buffer + 8 ) );
+        v3 = accumulate ( v3, read64 ( buffer + 16 ) );
+        v4 = accumulate ( v4, read64 ( buffer + 24 ) );
+
+        buffered = 0;
+    }
+
+    for ( ; p + 32 <= end; p += 32 )
+    {
+        v1 = accumulate ( v1, read64 ( p ) );
+        v2 = accumulate ( v2, read64 ( p + 8 ) );
+        v3 = accumulate ( v3, read64 ( p + 16 ) );
+        v4 = accumulate ( v4, read64 ( p + 24 ) );
+    }
+
+    buffered = end - p;
+    memcpy ( buffer, p, buffered );
+}
+
+uint64_t ContentHash::result() const
+{
+    uint64_t h;
+
+    if ( total >= 32 )
+    {
+        h = rotl ( v1, 1 ) + rotl ( v2, 7 ) + rotl ( v3, 12 ) + rotl ( v4, 18 );
+        h = mergeRound ( h, v1 );
+        h = mergeRound ( h, v2 );
+        h = mergeRound ( h, v3 );
+        h = mergeRound ( h, v4 );
+    }
+    else
+    {
+        h = PRIME64_5;
+    }
+
+    h += total;
+
+    const unsigned char *p = buffer;
+    const unsigned char *end = buffer + buffered;
+
+    for ( ; p + 8 <= end; p += 8 )
+    {
+        h ^= accumulate ( 0, read64 ( p ) );
+        h = rotl ( h, 27 ) * PRIME64_1 + PRIME64_4;
+    }
+
+    if ( p + 4 <= end )
+    {
+        h ^= ( uint64_t ) read32 ( p ) * PRIME64_1;
+        h = rotl ( h, 23 ) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    for ( ; p < end; p++ )
+    {
+        h ^= ( *p ) * PRIME64_5;
+        h = rotl ( h, 11 ) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+QString ContentHash::toString ( uint64_t hash )
+{
+    return QString::fromLatin1 ( "xxh64:%1" ).arg ( ( qulonglong ) hash, 16, 16, QLatin1Char ( '0' ) );
+}
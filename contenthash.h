@@ -0,0 +1,58 @@
+/*
+ *  Content hashes for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#ifndef CONTENTHASH_H
+#define CONTENTHASH_H
+
+#include <QString>
+
+#include <stdint.h>
+
+/**
+ * @class ContentHash Computes the XXH64 hash of a stream of data, fast enough to be fed every
+ * chunk of a transfer without slowing it down.
+ */
+class ContentHash
+{
+public:
+    ContentHash();
+
+    void update ( const void *data, uint64_t length );
+
+    /**
+     * The hash of all data so far, more data may still follow.
+     */
+    uint64_t result() const;
+
+    /**
+     * The hash as it is reported to clients, i.e. "xxh64:ef46db3751d8e999".
+     */
+    static QString toString ( uint64_t hash );
+
+private:
+    uint64_t v1, v2, v3, v4;
+    uint64_t total;
+
+    unsigned char buffer[32];
+    uint32_t buffered;
+};
+
+#endif // CONTENTHASH_H
@@ -0,0 +1,349 @@
+/*
+ *  Arbitration of a device between several slaves
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "devicearbiter.h"
+#include "tracer.h"
+
+#include <KDebug>
+
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QtAlgorithms>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#define KIO_MTP                     7000
+
+#define ARBITER_MAX_WAITERS         16
+#define ARBITER_NAME_SIZE           256
+#define ARBITER_POLL_INTERVAL       20000   // usec
+#define ARBITER_REGISTER_TIMEOUT    5000    // msec to wait for a free waiter slot
+#define ARBITER_LATENCY_SAMPLES     256
+#define ARBITER_MAX_RESERVATIONS    16
+
+struct DeviceArbiter::State
+{
+    qint32 owner;
+    qint32 waiterPids[ARBITER_MAX_WAITERS];
+    qint32 waiterPriorities[ARBITER_MAX_WAITERS];
+    char name[ARBITER_NAME_SIZE];
+
+    qint32 reservationPids[ARBITER_MAX_RESERVATIONS];
+    quint32 reservationStorages[ARBITER_MAX_RESERVATIONS];
+    quint64 reservationBytes[ARBITER_MAX_RESERVATIONS];
+    /// The free space when the reservation was made, to estimate what was sent since
+    quint64 reservationFree[ARBITER_MAX_RESERVATIONS];
+};
+
+static bool isAlive ( qint32 pid )
+{
+    return pid > 0 && ( kill ( pid, 0 ) == 0 || errno == EPERM );
+}
+
+DeviceArbiter::DeviceArbiter ( const QString &udi )
+    : attached ( false ), owner ( false ), latencyCount ( 0 )
+{
+    // keys end up in file names, keep them short and free of slashes
+    const QByteArray hash = QCryptographicHash::hash ( udi.toUtf8(), QCryptographicHash::Md5 ).toHex();
+    memory.setKey ( QLatin1String ( "kio_mtp-" ) + QString::fromLatin1 ( hash ) );
+
+    if ( memory.create ( sizeof ( State ) ) )
+    {
+        memory.lock();
+        memset ( memory.data(), 0, sizeof ( State ) );
+        memory.unlock();
+        attached = true;
+    }
+    else if ( memory.error() == QSharedMemory::AlreadyExists )
+    {
+        attached = memory.attach();
+    }
+
+    if ( !attached )
+    {
+        kWarning ( KIO_MTP ) << "No arbitration for" << udi << ":" << memory.errorString();
+    }
+
+    latencies.resize ( ARBITER_LATENCY_SAMPLES );
+}
+
+DeviceArbiter::~DeviceArbiter()
+{
+    if ( owner )
+        release();
+
+    if ( latencyCount > 0 )
+    {
+        QVector<qint64> sorted = latencies;
+        sorted.resize ( qMin ( latencyCount, ( int ) ARBITER_LATENCY_SAMPLES ) );
+        qSort ( sorted );
+
+        kDebug ( KIO_MTP ) << "Interactive wait for the device over" << sorted.size() << "requests: p50"
+                           << sorted.at ( sorted.size() / 2 ) << "ms, p99" << sorted.at ( ( sorted.size() * 99 ) / 100 ) << "ms";
+    }
+}
+
+DeviceArbiter::State* DeviceArbiter::state()
+{
+    return ( State* ) memory.data();
+}
+
+bool DeviceArbiter::tryAcquire()
+{
+    return acquire ( Interactive, false );
+}
+
+bool DeviceArbiter::acquire ( Priority priority )
+{
+    return acquire ( priority, true );
+}
+
+bool DeviceArbiter::acquire ( Priority priority, bool wait )
+{
+    if ( owner )
+        return true;
+
+    if ( !attached )
+    {
+        owner = true;
+        return true;
+    }
+
+    TraceSpan span ( "DeviceArbiter::acquire", "scheduler" );
+
+    const qint32 pid = getpid();
+    int slot = -1;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    forever
+    {
+        memory.lock();
+        State *s = state();
+
+        bool interactiveWaiting = false;
+        for ( int i = 0; i < ARBITER_MAX_WAITERS; i++ )
+        {
+            // forget about slaves that died while waiting
+            if ( s->waiterPids[i] != 0 && !isAlive ( s->waiterPids[i] ) )
+                s->waiterPids[i] = 0;
+
+            if ( s->waiterPids[i] != 0 && s->waiterPids[i] != pid && s->waiterPriorities[i] == Interactive )
+                interactiveWaiting = true;
+        }
+
+        const bool available = s->owner == 0 || s->owner == pid || !isAlive ( s->owner );
+
+        if ( available && ( priority == Interactive || !interactiveWaiting ) )
+        {
+            s->owner = pid;
+            if ( slot >= 0 )
+                s->waiterPids[slot] = 0;
+
+            memory.unlock();
+            owner = true;
+            break;
+        }
+
+        if ( !wait )
+        {
+            memory.unlock();
+            return false;
+        }
+
+        if ( slot < 0 )
+        {
+            for ( int i = 0; i < ARBITER_MAX_WAITERS && slot < 0; i++ )
+            {
+                if ( s->waiterPids[i] == 0 )
+                {
+                    s->waiterPids[i] = pid;
+                    s->waiterPriorities[i] = priority;
+                    slot = i;
+                }
+            }
+        }
+
+        // the owner never learns about a waiter without a slot and would keep the device
+        if ( slot < 0 && timer.elapsed() > ARBITER_REGISTER_TIMEOUT )
+        {
+            memory.unlock();
+
+            kWarning ( KIO_MTP ) << "Too many slaves waiting for the device, giving up";
+            return false;
+        }
+
+        memory.unlock();
+        usleep ( ARBITER_POLL_INTERVAL );
+    }
+
+    if ( priority == Interactive )
+        recordLatency ( timer.elapsed() );
+
+    return true;
+}
+
+void DeviceArbiter::release()
+{
+    owner = false;
+
+    if ( !attached )
+        return;
+
+    memory.lock();
+    if ( state()->owner == getpid() )
+        state()->owner = 0;
+    memory.unlock();
+}
+
+int DeviceArbiter::waiting ( Priority priority )
+{
+    if ( !attached )
+        return 0;
+
+    const qint32 pid = getpid();
+    int count = 0;
+
+    memory.lock();
+    State *s = state();
+    for ( int i = 0; i < ARBITER_MAX_WAITERS; i++ )
+    {
+        if ( s->waiterPids[i] != 0 && s->waiterPids[i] != pid && s->waiterPriorities[i] == priority
+             && isAlive ( s->waiterPids[i] ) )
+        {
+            count++;
+        }
+    }
+    memory.unlock();
+
+    return count;
+}
+
+void DeviceArbiter::publishName ( const QString &name )
+{
+    if ( !attached )
+        return;
+
+    const QByteArray utf8 = name.toUtf8().left ( ARBITER_NAME_SIZE - 1 );
+
+    memory.lock();
+    memset ( state()->name, 0, ARBITER_NAME_SIZE );
+    memcpy ( state()->name, utf8.constData(), utf8.size() );
+    memory.unlock();
+}
+
+QString DeviceArbiter::publishedName()
+{
+    if ( !attached )
+        return QString();
+
+    memory.lock();
+    const QString name = QString::fromUtf8 ( state()->name );
+    memory.unlock();
+
+    return name;
+}
+
+bool DeviceArbiter::reserve ( uint32_t storageId, quint64 bytes, quint64 free )
+{
+    if ( !attached )
+        return bytes <= free;
+
+    const qint32 pid = getpid();
+    int slot = -1, freeSlot = -1;
+    quint64 reserved = 0;
+
+    memory.lock();
+    State *s = state();
+    for ( int i = 0; i < ARBITER_MAX_RESERVATIONS; i++ )
+    {
+        if ( s->reservationPids[i] != 0 && !isAlive ( s->reservationPids[i] ) )
+            s->reservationPids[i] = 0;
+
+        if ( s->reservationPids[i] == 0 )
+        {
+            if ( freeSlot < 0 )
+                freeSlot = i;
+            continue;
+        }
+
+        // our own reservation on the storage is replaced, not counted
+        if ( s->reservationPids[i] == pid )
+        {
+            if ( s->reservationStorages[i] == storageId )
+                slot = i;
+            continue;
+        }
+
+        if ( s->reservationStorages[i] != storageId )
+            continue;
+
+        // whatever the device lost since was most likely sent by that upload
+        const quint64 sent = s->reservationFree[i] > free ? s->reservationFree[i] - free : 0;
+        if ( s->reservationBytes[i] > sent )
+            reserved += s->reservationBytes[i] - sent;
+    }
+
+    const bool fits = reserved + bytes <= free;
+
+    if ( slot < 0 )
+        slot = freeSlot;
+
+    if ( fits && slot >= 0 )
+    {
+        s->reservationPids[slot] = pid;
+        s->reservationStorages[slot] = storageId;
+        s->reservationBytes[slot] = bytes;
+        s->reservationFree[slot] = free;
+    }
+    memory.unlock();
+
+    if ( !fits )
+    {
+        kDebug ( KIO_MTP ) << "Upload of" << bytes << "bytes doesn't fit," << free << "bytes free," << reserved << "reserved";
+    }
+
+    return fits;
+}
+
+void DeviceArbiter::unreserve()
+{
+    if ( !attached )
+        return;
+
+    const qint32 pid = getpid();
+
+    memory.lock();
+    for ( int i = 0; i < ARBITER_MAX_RESERVATIONS; i++ )
+    {
+        if ( state()->reservationPids[i] == pid )
+            state()->reservationPids[i] = 0;
+    }
+    memory.unlock();
+}
+
+void DeviceArbiter::recordLatency ( qint64 msecs )
+{
+    latencies[latencyCount % ARBITER_LATENCY_SAMPLES] = msecs;
+    latencyCount++;
+}
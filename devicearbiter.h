@@ -0,0 +1,117 @@
+/*
+ *  Arbitration of a device between several slaves
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef DEVICEARBITER_H
+#define DEVICEARBITER_H
+
+#include <QSharedMemory>
+#include <QString>
+#include <QVector>
+
+#include <stdint.h>
+
+/**
+ * @class DeviceArbiter Decides which slave process may hold the USB session of a device.
+ *
+ * Only one process can claim the interface of a device, so a slave blocked in a bulk transfer
+ * would lock out a second slave serving the user's browsing. The arbiter keeps the owner and the
+ * waiting slaves in shared memory: interactive requests are always served before bulk requests,
+ * and an owner in a bulk transfer releases the session between chunks while interactive requests
+ * are waiting.
+ *
+ * Ownership is only advisory, the owner has to close its session before calling release().
+ */
+class DeviceArbiter
+{
+public:
+    enum Priority
+    {
+        Interactive = 0,
+        Bulk = 1
+    };
+
+    explicit DeviceArbiter ( const QString &udi );
+    ~DeviceArbiter();
+
+    /**
+     * Takes the device if nobody holds it and no interactive request is waiting.
+     */
+    bool tryAcquire();
+
+    /**
+     * Waits until the device can be taken with the given priority.
+     *
+     * @return false if too many other slaves are waiting already
+     */
+    bool acquire ( Priority priority );
+
+    /**
+     * Gives the device up, the session must already be closed.
+     */
+    void release();
+
+    bool isOwner() const
+    {
+        return owner;
+    }
+
+    /**
+     * Number of other slaves waiting for the device with the given priority.
+     */
+    int waiting ( Priority priority );
+
+    /**
+     * Shares the name of the device with slaves that can't open it themselves.
+     */
+    void publishName ( const QString &name );
+    QString publishedName();
+
+    /**
+     * Reserves space for an upload, taking the uploads of other slaves to the same storage into
+     * account. Replaces an earlier reservation of this slave on the storage.
+     *
+     * @param bytes The bytes still to be sent
+     * @param free The free space the device reports right now
+     * @return false if the upload doesn't fit
+     */
+    bool reserve ( uint32_t storageId, quint64 bytes, quint64 free );
+
+    /**
+     * Drops all reservations of this slave.
+     */
+    void unreserve();
+
+private:
+    struct State;
+
+    State* state();
+    bool acquire ( Priority priority, bool wait );
+    void recordLatency ( qint64 msecs );
+
+    QSharedMemory memory;
+    bool attached;
+    bool owner;
+
+    /// Ring of the latest waiting times of interactive requests in ms
+    QVector<qint64> latencies;
+    int latencyCount;
+};
+
+#endif // DEVICEARBITER_H
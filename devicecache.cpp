@@ -19,14 +19,60 @@
 
 #include "devicecache.h"
 #include "kio_mtp_helpers.h"
+#include "mtpcalls.h"
+#include "mtpobjects.h"
+#include "sessionrecorder.h"
+#include "tracer.h"
 
-// #include <libudev.h>
-// #include <fcntl.h>
+#ifdef HAVE_UDEV
+#include "udevmonitor.h"
+#endif
 
 #include <Solid/Device>
 #include <Solid/GenericInterface>
 #include <Solid/DeviceNotifier>
 
+#include <string.h>
+#include <unistd.h>
+
+#define SESSION_RECOVERY_DELAY      500000  // usec to let the device settle before reopening
+
+// PTP errors of the transport rather than the device, see ptp.h
+#define PTP_ERROR_TIMEOUT           0x02FA
+#define PTP_ERROR_RESP_EXPECTED     0x02FD
+#define PTP_ERROR_DATA_EXPECTED     0x02FE
+#define PTP_ERROR_IO                0x02FF
+
+/**
+ * Whether the errors on the stack of a device mean the session is broken.
+ */
+static bool isSessionError ( LIBMTP_mtpdevice_t *device )
+{
+    for ( LIBMTP_error_t *error = LIBMTP_Get_Errorstack ( device ); error != NULL; error = error->next )
+    {
+        if ( error->errornumber == LIBMTP_ERROR_USB_LAYER )
+            return true;
+
+        if ( error->errornumber != LIBMTP_ERROR_PTP_LAYER || !error->error_text )
+            continue;
+
+        // libmtp only passes the code on in the text, "PTP Layer error 02ff: ..."
+        const QByteArray text ( error->error_text );
+        const QByteArray prefix ( "PTP Layer error " );
+
+        bool ok = false;
+        const uint code = text.startsWith ( prefix ) ? text.mid ( prefix.size(), 4 ).toUInt ( &ok, 16 ) : 0;
+
+        if ( ok && ( code == PTP_ERROR_TIMEOUT || code == PTP_ERROR_RESP_EXPECTED || code == PTP_ERROR_DATA_EXPECTED
+                     || code == PTP_ERROR_IO ) )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /**
  * Creates a Cached Device that has a predefined lifetime (default: 10000 msec)s
  * The lifetime is reset every time the device is accessed. After it expires it
@@ -35,41 +81,274 @@
  * @param device The LIBMTP_mtpdevice_t pointer to cache
  * @param udi The UDI of the new device to cache
  */
-CachedDevice::CachedDevice ( LIBMTP_mtpdevice_t* device, LIBMTP_raw_device_t* rawdevice, const QString udi, qint32 timeout )
+CachedDevice::CachedDevice ( LIBMTP_mtpdevice_t* device, LIBMTP_raw_device_t* rawdevice, const QString udi, qint32 timeout, DeviceArbiter *arbiter )
 {
     this->timeout = timeout;
-    this->mtpdevice = device;
+    this->mtpdevice.reset ( device );
     this->rawdevice = *rawdevice;
+    this->arbiter.reset ( arbiter );
     this->udi = udi;
+    this->spaceReserved = false;
 
-    char *deviceName = LIBMTP_Get_Friendlyname ( device );
-    char *deviceModel = LIBMTP_Get_Modelname ( device );
+    lastUse.start();
 
-    // prefer friendly devicename over model
-    if ( !deviceName )
-        name = QString::fromUtf8 ( deviceModel );
-    else
-        name = QString::fromUtf8 ( deviceName );
+    if ( device )
+    {
+        profile = DeviceProfile::load ( device, *rawdevice );
+        name = profile.name();
+
+        if ( arbiter )
+            arbiter->publishName ( name );
+    }
+    // another slave holds the device, use the name it found
+    else if ( arbiter )
+    {
+        name = arbiter->publishedName();
+    }
+
+    if ( name.isEmpty() )
+        name = QString::fromUtf8 ( rawdevice->device_entry.product );
 
     kDebug ( KIO_MTP ) << "Created device " << name << "  with udi=" << udi << " and timeout " << timeout;
 }
 
 CachedDevice::~CachedDevice()
 {
-    LIBMTP_Release_Device ( mtpdevice );
 }
 
-LIBMTP_mtpdevice_t* CachedDevice::getDevice()
+bool CachedDevice::openSession()
+{
+    kDebug ( KIO_MTP ) << "opening session for" << udi;
+
+    mtpdevice.reset ( mtpOpenRawDevice ( &rawdevice, udi ) );
+    if ( !mtpdevice )
+    {
+        if ( arbiter )
+            arbiter->release();
+        return false;
+    }
+
+    // only compares the firmware version if the device is known
+    profile = DeviceProfile::load ( mtpdevice.data(), rawdevice );
+
+    return true;
+}
+
+void CachedDevice::closeSession()
+{
+    kDebug ( KIO_MTP ) << "releasing session for" << udi;
+
+    mtpdevice.reset();
+
+    if ( arbiter )
+        arbiter->release();
+}
+
+LIBMTP_mtpdevice_t* CachedDevice::getDevice ( DeviceArbiter::Priority priority )
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    lastUse.restart();
+
+    if ( arbiter && !arbiter->isOwner() && !arbiter->acquire ( priority ) )
+    {
+        return 0;
+    }
+
+    if ( !mtpdevice )
+    {
+        if ( !openSession() )
+            return 0;
+    }
+    else if ( !mtpdevice->storage )
+    {
+        // a locked phone hides its storages until it is unlocked, ask again
+        kDebug ( KIO_MTP ) << "refreshing storages of" << udi;
+
+        mtpGetStorage ( mtpdevice.data(), LIBMTP_STORAGE_SORTBY_NOTSORTED );
+    }
+
+    return mtpdevice.data();
+}
+
+void CachedDevice::ref()
+{
+    users.ref();
+}
+
+void CachedDevice::deref()
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    users.deref();
+    lastUse.restart();
+}
+
+void CachedDevice::warmUp()
+{
+    if ( !isOpen() )
+        QMetaObject::invokeMethod ( this, "reopen", Qt::QueuedConnection );
+}
+
+void CachedDevice::reopen()
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    // don't wait for other slaves in the background
+    if ( mtpdevice || ( arbiter && !arbiter->tryAcquire() ) )
+        return;
+
+    kDebug ( KIO_MTP ) << "warm reopen";
+
+    if ( openSession() )
+        lastUse.restart();
+}
+
+bool CachedDevice::isOpen()
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    return !mtpdevice.isNull();
+}
+
+bool CachedDevice::isInUse()
+{
+    return users > 0;
+}
+
+bool CachedDevice::isRequested ( DeviceArbiter::Priority priority )
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    return arbiter && arbiter->isOwner() && arbiter->waiting ( priority ) > 0;
+}
+
+bool CachedDevice::isHeld()
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    return arbiter && arbiter->isOwner();
+}
+
+void CachedDevice::releaseSession()
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    closeSession();
+}
+
+bool CachedDevice::recover ( LIBMTP_mtpdevice_t *&device )
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    if ( !mtpdevice || !isSessionError ( mtpdevice.data() ) )
+    {
+        device = mtpdevice.data();
+        return false;
+    }
+
+    TraceSpan span ( "CachedDevice::recover", "scheduler" );
+
+    kDebug ( KIO_MTP ) << "session of" << udi << "is broken, reopening it";
+
+    LIBMTP_Dump_Errorstack ( mtpdevice.data() );
+
+    // keep the arbiter, other slaves would only run into the same device. The interface has
+    // to be released before it can be claimed by a new session.
+    mtpdevice.reset();
+    device = 0;
+
+    usleep ( SESSION_RECOVERY_DELAY );
+
+    if ( !openSession() )
+    {
+        kDebug ( KIO_MTP ) << "could not reopen" << udi;
+        return false;
+    }
+
+    lastUse.restart();
+    device = mtpdevice.data();
+
+    return true;
+}
+
+bool CachedDevice::releaseIfIdle()
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    if ( !mtpdevice || users > 0 || lastUse.elapsed() < timeout )
+        return false;
+
+    kDebug ( KIO_MTP ) << "idle for" << lastUse.elapsed() << "ms";
+
+    closeSession();
+
+    return true;
+}
+
+bool CachedDevice::reserveSpace ( uint32_t storageId, quint64 bytes, quint32 objects )
 {
-    LIBMTP_mtpdevice_t* device = mtpdevice;
-    if (!device->storage)
+    // only uploads reserve space, they shouldn't get ahead of browsing
+    LIBMTP_mtpdevice_t *device = getDevice ( DeviceArbiter::Bulk );
+
+    // let the upload itself report the error
+    if ( !device )
+        return true;
+
+    QMutexLocker locker ( &sessionMutex );
+
+    // the free space changes with every upload, other programs' included
+    mtpGetStorage ( device, LIBMTP_STORAGE_SORTBY_NOTSORTED );
+
+    for ( LIBMTP_devicestorage_t *storage = device->storage; storage != NULL; storage = storage->next )
     {
-        kDebug ( KIO_MTP ) << "reopen mtpdevice if we have no storage found";
-        LIBMTP_Release_Device ( mtpdevice );
-        mtpdevice = LIBMTP_Open_Raw_Device_Uncached ( &rawdevice );
+        if ( storage->id != storageId )
+            continue;
+
+        // 0xFFFFFFFF means the storage has no limit, some devices report 0 instead
+        if ( storage->FreeSpaceInObjects != 0 && storage->FreeSpaceInObjects != 0xFFFFFFFF
+             && storage->FreeSpaceInObjects < objects )
+        {
+            kDebug ( KIO_MTP ) << "Storage" << storageId << "takes only" << storage->FreeSpaceInObjects << "more objects";
+            return false;
+        }
+
+        if ( !arbiter )
+            return bytes <= storage->FreeSpaceInBytes;
+
+        if ( !arbiter->reserve ( storageId, bytes, storage->FreeSpaceInBytes ) )
+            return false;
+
+        spaceReserved = true;
+        return true;
     }
 
-    return mtpdevice;
+    return true;
+}
+
+void CachedDevice::releaseSpace()
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    if ( spaceReserved && arbiter )
+        arbiter->unreserve();
+
+    spaceReserved = false;
+}
+
+DeviceProfile CachedDevice::getProfile()
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    return profile;
+}
+
+void CachedDevice::setFriendlyName ( const QString& name )
+{
+    QMutexLocker locker ( &sessionMutex );
+
+    if ( profile.isValid() )
+        profile.setName ( name );
 }
 
 const QString CachedDevice::getName()
@@ -82,18 +361,58 @@ const QString CachedDevice::getUdi()
 }
 
 
-DeviceCache::DeviceCache ( qint32 timeout, QObject* parent ) : QEventLoop ( parent )
+DeviceCache::DeviceCache ( qint32 timeout, QObject* parent ) : QThread ( parent )
 {
     this->timeout = timeout;
-    
-    notifier = Solid::DeviceNotifier::instance();
-    
+
+    table = new DeviceTable;
+
+    // A replayed session brings its own devices, don't touch the real ones
+    if ( SessionRecorder::instance()->isReplaying() )
+    {
+        foreach ( const QString &udi, SessionRecorder::instance()->recordedDevices() )
+        {
+            replayDevice( udi );
+        }
+        return;
+    }
+
+    // wait for the devices already connected, the first listing should show them
+    start();
+    ready.acquire();
+}
+
+void DeviceCache::run()
+{
+#ifdef HAVE_UDEV
+    UDevMonitor monitor ( this );
+    if ( monitor.isValid() )
+    {
+        ready.release();
+
+        exec();
+        return;
+    }
+#endif
+
+    // Solid keeps its notifier per thread, so it has to be created here
+    DeviceWatcher watcher ( this );
+
+    ready.release();
+
+    exec();
+}
+
+DeviceWatcher::DeviceWatcher ( DeviceCache *cache ) : cache ( cache )
+{
+    Solid::DeviceNotifier *notifier = Solid::DeviceNotifier::instance();
+
     connect( notifier, SIGNAL( deviceAdded( QString ) ), this, SLOT( deviceAdded( QString ) ) );
     connect( notifier, SIGNAL( deviceRemoved(QString) ), this, SLOT( deviceRemoved(QString) ) );
-    
+
     foreach ( Solid::Device solidDevice, Solid::Device::listFromType ( Solid::DeviceInterface::PortableMediaPlayer, QString() ) )
     {
-        checkDevice( solidDevice );
+        cache->checkDevice( solidDevice );
     }
 }
 
@@ -107,7 +426,15 @@ void DeviceCache::checkDevice ( Solid::Device solidDevice )
 
     int isMtpDevice = LIBMTP_Check_Specific_Device( solidBusNum, solidDevNum );
 
-    if ( isMtpDevice == 1 && !udiCache.contains( solidDevice.udi() ) )
+    if ( isMtpDevice == 1 )
+    {
+        checkDevice( solidDevice.udi(), solidBusNum, solidDevNum );
+    }
+}
+
+void DeviceCache::checkDevice ( const QString& udi, int busNum, int devNum )
+{
+    if ( !table->udiCache.contains( udi ) )
     {
         kDebug ( KIO_MTP ) << "new device, getting raw devices";
 
@@ -136,17 +463,24 @@ void DeviceCache::checkDevice ( Solid::Device solidDevice )
                     uint32_t rawBusNum = rawDevice->bus_location;
                     uint32_t rawDevNum = rawDevice->devnum;
 
-                    if ( rawBusNum == solidBusNum && rawDevNum == solidDevNum )
+                    if ( rawBusNum == busNum && rawDevNum == devNum )
                     {
-                        kDebug( KIO_MTP ) << "Found device matching the Solid description";
+                        kDebug( KIO_MTP ) << "Found device matching the bus location";
 
-                        LIBMTP_mtpdevice_t *mtpDevice = LIBMTP_Open_Raw_Device_Uncached ( rawDevice );
-                        
-                        if ( udiCache.find( solidDevice.udi() ) == udiCache.end() )
+                        if ( !table->udiCache.contains( udi ) )
                         {
-                            CachedDevice *cDev = new CachedDevice( mtpDevice, rawDevice, solidDevice.udi(), timeout );
-                            udiCache.insert( solidDevice.udi(), cDev );
-                            nameCache.insert( cDev->getName(), cDev );
+                            // Only open the device if no other slave holds it
+                            DeviceArbiter *arbiter = new DeviceArbiter( udi );
+                            LIBMTP_mtpdevice_t *mtpDevice = 0;
+
+                            if ( arbiter->tryAcquire() )
+                            {
+                                mtpDevice = mtpOpenRawDevice ( rawDevice, udi );
+                                if ( !mtpDevice )
+                                    arbiter->release();
+                            }
+
+                            addDevice( new CachedDevice( mtpDevice, rawDevice, udi, timeout, arbiter ) );
                         }
                     }
                 }
@@ -161,8 +495,84 @@ void DeviceCache::checkDevice ( Solid::Device solidDevice )
     }
 }
 
-void DeviceCache::deviceAdded ( const QString& udi )
+void DeviceCache::replayDevice ( const QString& udi )
 {
+    LIBMTP_raw_device_t rawDevice;
+    memset( &rawDevice, 0, sizeof( LIBMTP_raw_device_t ) );
+
+    LIBMTP_mtpdevice_t *mtpDevice = mtpOpenRawDevice ( &rawDevice, udi );
+    if ( mtpDevice )
+    {
+        kDebug( KIO_MTP ) << "Replaying device with udi=" << udi;
+
+        addDevice( new CachedDevice( mtpDevice, &rawDevice, udi, timeout ) );
+    }
+}
+
+void DeviceCache::addDevice ( CachedDevice* device )
+{
+    const DeviceTable *current = table;
+
+    DeviceTable *next = new DeviceTable ( *current );
+    next->udiCache.insert( device->getUdi(), device );
+    next->nameCache.insert( device->getName(), device );
+
+    publish( next );
+}
+
+void DeviceCache::removeDevice ( const QString& udi )
+{
+    const DeviceTable *current = table;
+
+    CachedDevice *cDev = current->udiCache.value( udi );
+    if ( !cDev )
+        return;
+
+    DeviceTable *next = new DeviceTable ( *current );
+    next->udiCache.remove( cDev->getUdi() );
+    next->nameCache.remove( cDev->getName() );
+
+    publish( next, cDev );
+}
+
+void DeviceCache::publish ( DeviceTable* next, CachedDevice* removed )
+{
+    DeviceTable *previous = table.fetchAndStoreOrdered( next );
+
+    QMutexLocker locker( &retiredMutex );
+    retiredTables.append( previous );
+    if ( removed )
+        retiredDevices.append( removed );
+}
+
+void DeviceCache::quiesce()
+{
+    QList<DeviceTable*> tables;
+    QList<CachedDevice*> devices;
+    {
+        QMutexLocker locker( &retiredMutex );
+        tables = retiredTables;
+        devices = retiredDevices;
+        retiredTables.clear();
+        retiredDevices.clear();
+    }
+
+    qDeleteAll( tables );
+
+    // devices live in the hotplug thread, a reopen() may still be queued or running there
+    foreach ( CachedDevice *device, devices )
+    {
+        if ( isRunning() )
+            device->deleteLater();
+        else
+            delete device;
+    }
+}
+
+void DeviceWatcher::deviceAdded ( const QString& udi )
+{
+    TraceSpan span ( "DeviceWatcher::deviceAdded", "cache", udi );
+
     kDebug( KIO_MTP ) << "New device attached with udi=" << udi << ". Checking if PortableMediaPlayer...";
 
     Solid::Device device( udi );
@@ -170,69 +580,63 @@ void DeviceCache::deviceAdded ( const QString& udi )
     {
         kDebug ( KIO_MTP ) << "SOLID: New Device with udi=" << udi << "||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||";
 
-        checkDevice( device );
+        cache->checkDevice( device );
     }
 }
 
-void DeviceCache::deviceRemoved ( const QString& udi )
+void DeviceWatcher::deviceRemoved ( const QString& udi )
 {
-    if ( udiCache.contains( udi ) )
+    TraceSpan span ( "DeviceWatcher::deviceRemoved", "cache", udi );
+
+    if ( cache->contains( udi, true ) )
     {
         kDebug ( KIO_MTP ) << "SOLID: Device with udi=" << udi << " removed. ||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||";
-        
-        CachedDevice *cDev = udiCache.value( udi );
-        
-        udiCache.remove( cDev->getUdi() );
-        nameCache.remove( cDev->getName() );
-        delete cDev;
+
+        cache->removeDevice( udi );
     }
 }
 
 DeviceCache::~DeviceCache()
 {
-    processEvents();
-    
+    quit();
+    wait();
+
     // Release devices
-    foreach ( QString udi, udiCache.keys() )
-    {
-        deviceRemoved( udi );
-    }
+    quiesce();
+    qDeleteAll( table->udiCache );
+    delete table.fetchAndStoreOrdered( 0 );
 }
 
 QHash<QString, CachedDevice*> DeviceCache::getAll()
 {
     kDebug ( KIO_MTP ) << "getAll()";
 
-    processEvents();
-
-    return nameCache;
+    return table->nameCache;
 }
 
 bool DeviceCache::contains ( QString string, bool isUdi )
 {
-    processEvents();
+    const DeviceTable *current = table;
 
     if ( isUdi )
-        return udiCache.find ( string ) != udiCache.end();
+        return current->udiCache.contains ( string );
     else
-        return nameCache.find ( string ) != nameCache.end();
+        return current->nameCache.contains ( string );
 }
 
 CachedDevice* DeviceCache::get ( const QString& string, bool isUdi )
 {
-    processEvents();
+    const DeviceTable *current = table;
 
     if ( isUdi )
-        return udiCache.value ( string );
+        return current->udiCache.value ( string );
     else
-        return nameCache.value ( string );
+        return current->nameCache.value ( string );
 }
 
 int DeviceCache::size()
 {
-    processEvents();
-    
-    return nameCache.size();
+    return table->nameCache.size();
 }
 
 #include "devicecache.moc"
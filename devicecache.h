@@ -22,50 +22,175 @@
 
 #include <QPair>
 #include <QHash>
-#include <QTimer>
+#include <QList>
+#include <QMutex>
+#include <QSemaphore>
+#include <QElapsedTimer>
 #include <QThread>
-#include <QEventLoop>
+#include <QAtomicPointer>
 
 #include <Solid/DeviceNotifier>
 #include <Solid/Device>
 
 #include <libmtp.h>
 
+#include "devicearbiter.h"
+#include "deviceprofile.h"
+#include "mtpobjects.h"
+
 
 class CachedDevice : public QObject
 {
     Q_OBJECT
 
 private:
+    /// Idle time in ms after which the session is closed
     qint32 timeout;
-    QTimer *timer;
-    LIBMTP_mtpdevice_t* mtpdevice;
+    QElapsedTimer lastUse;
+    QAtomicInt users;
+
+    /// Guards the session, it may be reopened by the hotplug thread
+    QMutex sessionMutex;
+    MTPDevicePointer mtpdevice;
     LIBMTP_raw_device_t rawdevice;
+    QScopedPointer<DeviceArbiter> arbiter;
+    DeviceProfile profile;
+    bool spaceReserved;
 
     QString name;
     QString udi;
 
+    bool openSession();
+    void closeSession();
+
+private slots:
+    void reopen();
+
 public:
-    explicit CachedDevice(LIBMTP_mtpdevice_t* device, LIBMTP_raw_device_t* rawdevice, const QString udi, qint32 timeout);
+    /**
+     * @param device The opened device, 0 if another slave holds it
+     * @param arbiter Shares the device with other slaves, 0 to hold it exclusively. Takes ownership.
+     */
+    explicit CachedDevice(LIBMTP_mtpdevice_t* device, LIBMTP_raw_device_t* rawdevice, const QString udi, qint32 timeout, DeviceArbiter *arbiter = 0);
     virtual ~CachedDevice();
 
-    LIBMTP_mtpdevice_t* getDevice();
+    /**
+     * Returns the opened device, waiting for other slaves to hand it over if necessary.
+     *
+     * @return The device or 0 if it could not be opened
+     */
+    LIBMTP_mtpdevice_t* getDevice( DeviceArbiter::Priority priority = DeviceArbiter::Interactive );
+
+    /**
+     * Keeps the session open while a transfer or an opened file uses it, even if it is idle.
+     */
+    void ref();
+    void deref();
+
+    /**
+     * Opens the session in the background if it was closed, call it when the device is likely
+     * to be used soon.
+     */
+    void warmUp();
+
+    bool isOpen();
+
+    /**
+     * Whether a transfer or an opened file holds a reference, see ref().
+     */
+    bool isInUse();
+
+    /**
+     * Closes the session if nobody used it for the configured idle time.
+     *
+     * @return true if the session was closed
+     */
+    bool releaseIfIdle();
+
+    /**
+     * Whether this slave holds the device and another one waits for it with the given priority.
+     */
+    bool isRequested( DeviceArbiter::Priority priority );
+
+    /**
+     * Whether this slave holds a device that is shared with other slaves.
+     */
+    bool isHeld();
+
+    /**
+     * Closes the session and hands the device over to waiting slaves.
+     */
+    void releaseSession();
+
+    /**
+     * Opens a new session if the last failed call broke the current one, i.e. because the device
+     * stopped responding, as opposed to refusing the operation. The device stays claimed.
+     *
+     * The old device, its storages and everything else pointing into it are invalid once the
+     * session was found broken, whether it could be reopened or not.
+     *
+     * @param device The device of the failed call, set to the new device or to 0 if the session
+     * is gone. Check it before touching the device again.
+     * @return true if a new session was opened, the failed call may be repeated then
+     */
+    bool recover ( LIBMTP_mtpdevice_t *&device );
+
+    /**
+     * Checks with fresh storage information whether an upload fits on a storage and reserves the
+     * space against uploads of other slaves until releaseSpace() is called.
+     *
+     * @param bytes The bytes still to be sent
+     * @param objects The number of objects to be created
+     * @return false if the storage is too full
+     */
+    bool reserveSpace ( uint32_t storageId, quint64 bytes, quint32 objects = 1 );
+    void releaseSpace();
+
+    /**
+     * The stored profile, invalid until the device was opened once.
+     */
+    DeviceProfile getProfile();
+
+    /**
+     * Remembers the new friendly name, it is used as the device name from the next start on.
+     */
+    void setFriendlyName ( const QString &name );
+
     const QString getName();
     const QString getUdi();
 };
 
 
-class DeviceCache : public QEventLoop
+/**
+ * Immutable snapshot of the known devices, replaced as a whole whenever a device comes or goes.
+ */
+struct DeviceTable
+{
+    QHash< QString, CachedDevice* > nameCache, udiCache;
+};
+
+/**
+ * @class DeviceCache Keeps track of the connected devices.
+ *
+ * Hotplug events are handled by a UDevMonitor, or a DeviceWatcher if libudev is not available,
+ * in a thread of its own, which opens new devices
+ * right away and publishes a new DeviceTable for every change. Lookups only read the current
+ * table and never block. Tables and devices that were replaced stay alive until the slave calls
+ * quiesce() between two commands.
+ */
+class DeviceCache : public QThread
 {
     Q_OBJECT
 
 private:
-    /**
-     * Fields in order: Devicename (QString), expiration Timer, pointer to device
-     */
-    QHash< QString, CachedDevice* > nameCache, udiCache;
-    
-    Solid::DeviceNotifier *notifier;
+    QAtomicPointer<DeviceTable> table;
+
+    QMutex retiredMutex;
+    QList<DeviceTable*> retiredTables;
+    QList<CachedDevice*> retiredDevices;
+
+    /// Released by the watcher once the devices present at startup are known
+    QSemaphore ready;
 
     qint32 timeout;
 
@@ -73,22 +198,59 @@ public:
     DeviceCache( qint32 timeout, QObject* parent = 0 );
     virtual ~DeviceCache();
 
+protected:
+    virtual void run();
+
     /*
-     * Functions for accessing the device
+     * Functions for changing the table, only called by the DeviceWatcher
      */
 private:
-    void checkDevice ( Solid::Device solidDevice );
-    
-private slots:
+    friend class DeviceWatcher;
+    friend class UDevMonitor;
 
-    void deviceAdded( const QString &udi );
-    void deviceRemoved( const QString &udi );
+    void checkDevice ( Solid::Device solidDevice );
+    /**
+     * Opens the MTP device on the given bus location unless it is known already.
+     */
+    void checkDevice ( const QString &udi, int busNum, int devNum );
+    void replayDevice ( const QString &udi );
+    void addDevice ( CachedDevice *device );
+    void removeDevice ( const QString &udi );
+    void publish ( DeviceTable *next, CachedDevice *removed = 0 );
 
+    /*
+     * Functions for accessing the device
+     */
 public:
     QHash< QString, CachedDevice* > getAll();
     CachedDevice* get ( const QString& string, bool isUdi = false );
     bool contains(QString string, bool isUdi = false);
     int size();
+
+    /**
+     * Frees tables and devices that were replaced since the last call. Must be called by the
+     * slave when it doesn't hold any pointer it got from the cache, i.e. after every command.
+     * Devices are deleted by the hotplug thread once it is done with the calls queued for them.
+     */
+    void quiesce();
+};
+
+/**
+ * @class DeviceWatcher Receives the Solid hotplug signals in the thread of the DeviceCache.
+ */
+class DeviceWatcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DeviceWatcher ( DeviceCache *cache );
+
+private slots:
+    void deviceAdded( const QString &udi );
+    void deviceRemoved( const QString &udi );
+
+private:
+    DeviceCache *cache;
 };
 
 #endif // DEVICECACHE_H
@@ -0,0 +1,198 @@
+/*
+ *  Persistent profiles of known devices
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "deviceprofile.h"
+#include "mtpcalls.h"
+#include "mtpobjects.h"
+#include "sessionrecorder.h"
+
+#include <KConfig>
+#include <KConfigGroup>
+#include <KDebug>
+
+#define KIO_MTP                     7000
+
+// the capabilities known to libmtp 1.1.x
+static const LIBMTP_devicecap_t capabilities[] =
+{
+    LIBMTP_DEVICECAP_GetPartialObject,
+    LIBMTP_DEVICECAP_SendPartialObject,
+    LIBMTP_DEVICECAP_EditObjects,
+    LIBMTP_DEVICECAP_MoveObject,
+    LIBMTP_DEVICECAP_CopyObject
+};
+
+static QString profileFile()
+{
+    return QLatin1String ( "kio_mtprc" );
+}
+
+DeviceProfile::DeviceProfile()
+    : m_capabilities ( 0 )
+{
+}
+
+DeviceProfile DeviceProfile::load ( LIBMTP_mtpdevice_t *device, const LIBMTP_raw_device_t &rawdevice )
+{
+    DeviceProfile profile;
+
+    MTPStringPointer serial ( mtpGetSerialnumber ( device ) );
+    MTPStringPointer version ( mtpGetDeviceversion ( device ) );
+
+    profile.m_key = QString::fromLatin1 ( "Device %1:%2:%3" )
+                    .arg ( rawdevice.device_entry.vendor_id, 4, 16, QLatin1Char ( '0' ) )
+                    .arg ( rawdevice.device_entry.product_id, 4, 16, QLatin1Char ( '0' ) )
+                    .arg ( QString::fromUtf8 ( serial.data() ) );
+    profile.m_version = QString::fromUtf8 ( version.data() );
+
+    // a replayed session must not change the profiles of real devices
+    const bool persistent = !SessionRecorder::instance()->isReplaying();
+
+    if ( persistent )
+    {
+        KConfig config ( profileFile(), KConfig::SimpleConfig );
+        const KConfigGroup group ( &config, profile.m_key );
+
+        if ( group.exists() && group.readEntry ( "Version", QString() ) == profile.m_version )
+        {
+            profile.m_name = group.readEntry ( "Name", QString() );
+            profile.m_capabilities = group.readEntry ( "Capabilities", 0u );
+            foreach ( const QString &id, group.readEntry ( "StorageIds", QStringList() ) )
+            {
+                profile.m_storageIds.append ( id.toUInt() );
+            }
+            profile.m_storages = group.readEntry ( "Storages", QStringList() );
+
+            kDebug ( KIO_MTP ) << "Known device" << profile.m_key << profile.m_name;
+
+            if ( profile.updateStorages ( device ) )
+                profile.save();
+
+            return profile;
+        }
+    }
+
+    profile.probe ( device );
+
+    if ( persistent )
+        profile.save();
+
+    return profile;
+}
+
+void DeviceProfile::probe ( LIBMTP_mtpdevice_t *device )
+{
+    kDebug ( KIO_MTP ) << "Probing device" << m_key;
+
+    MTPStringPointer deviceName ( mtpGetFriendlyname ( device ) );
+    MTPStringPointer deviceModel ( mtpGetModelname ( device ) );
+
+    // prefer friendly devicename over model
+    if ( !deviceName )
+        m_name = QString::fromUtf8 ( deviceModel.data() );
+    else
+        m_name = QString::fromUtf8 ( deviceName.data() );
+
+    m_capabilities = 0;
+    for ( uint i = 0; i < sizeof ( capabilities ) / sizeof ( capabilities[0] ); i++ )
+    {
+        if ( mtpCheckCapability ( device, capabilities[i] ) )
+            m_capabilities |= 1u << capabilities[i];
+    }
+
+    updateStorages ( device );
+}
+
+bool DeviceProfile::updateStorages ( LIBMTP_mtpdevice_t *device )
+{
+    // a locked device shows no storages, keep the ones we know
+    if ( !device->storage )
+        return false;
+
+    QList<quint32> ids;
+    QStringList descriptions;
+    for ( LIBMTP_devicestorage_t *storage = device->storage; storage != NULL; storage = storage->next )
+    {
+        ids.append ( storage->id );
+        descriptions.append ( QString::fromUtf8 ( storage->StorageDescription ) );
+    }
+
+    if ( ids == m_storageIds && descriptions == m_storages )
+        return false;
+
+    m_storageIds = ids;
+    m_storages = descriptions;
+
+    return true;
+}
+
+void DeviceProfile::save() const
+{
+    if ( !isValid() || SessionRecorder::instance()->isReplaying() )
+        return;
+
+    QStringList ids;
+    foreach ( quint32 id, m_storageIds )
+    {
+        ids.append ( QString::number ( id ) );
+    }
+
+    KConfig config ( profileFile(), KConfig::SimpleConfig );
+    KConfigGroup group ( &config, m_key );
+
+    group.writeEntry ( "Version", m_version );
+    group.writeEntry ( "Name", m_name );
+    group.writeEntry ( "Capabilities", m_capabilities );
+    group.writeEntry ( "StorageIds", ids );
+    group.writeEntry ( "Storages", m_storages );
+
+    config.sync();
+}
+
+bool DeviceProfile::isValid() const
+{
+    return !m_key.isEmpty();
+}
+
+QString DeviceProfile::key() const
+{
+    return m_key;
+}
+
+QString DeviceProfile::name() const
+{
+    return m_name;
+}
+
+void DeviceProfile::setName ( const QString &name )
+{
+    m_name = name;
+    save();
+}
+
+bool DeviceProfile::hasCapability ( LIBMTP_devicecap_t capability ) const
+{
+    return m_capabilities & ( 1u << capability );
+}
+
+QStringList DeviceProfile::storages() const
+{
+    return m_storages;
+}
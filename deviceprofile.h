@@ -0,0 +1,84 @@
+/*
+ *  Persistent profiles of known devices
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#ifndef DEVICEPROFILE_H
+#define DEVICEPROFILE_H
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+#include <libmtp.h>
+
+/**
+ * @class DeviceProfile Facts about a device that survive a session: its name, the optional
+ * operations it supports and its storages.
+ *
+ * Profiles are stored in kio_mtprc, keyed by vendor, product and serial number. Once a device is
+ * known, opening it only compares its firmware version, which libmtp already read while opening,
+ * instead of asking the device for its name and capabilities again.
+ */
+class DeviceProfile
+{
+public:
+    DeviceProfile();
+
+    /**
+     * Returns the stored profile of an opened device, probing the device if it is unknown or
+     * its firmware changed.
+     */
+    static DeviceProfile load ( LIBMTP_mtpdevice_t *device, const LIBMTP_raw_device_t &rawdevice );
+
+    bool isValid() const;
+
+    /**
+     * Identifies the device across sessions, i.e. "Device 18d1:4ee2:0123456789ABCDEF".
+     */
+    QString key() const;
+
+    QString name() const;
+
+    /**
+     * Stores the new name, i.e. after the device was renamed.
+     */
+    void setName ( const QString &name );
+
+    bool hasCapability ( LIBMTP_devicecap_t capability ) const;
+
+    /**
+     * Descriptions of the storages found when the device was last opened unlocked.
+     */
+    QStringList storages() const;
+
+private:
+    void probe ( LIBMTP_mtpdevice_t *device );
+    bool updateStorages ( LIBMTP_mtpdevice_t *device );
+    void save() const;
+
+    QString m_key;
+    QString m_name;
+    QString m_version;
+    quint32 m_capabilities;
+    QList<quint32> m_storageIds;
+    QStringList m_storages;
+};
+
+#endif // DEVICEPROFILE_H
@@ -19,6 +19,7 @@
 
 
 #include "filecache.h"
+#include "tracer.h"
 
 #include <KDebug>
 
@@ -30,6 +31,8 @@ FileCache::FileCache ( QObject* parent ) : QObject ( parent )
 
 uint32_t FileCache::queryPath ( const QString& path, int timeToLive )
 {
+    TraceSpan span ( "FileCache::queryPath", "cache", path );
+
     kDebug(KIO_MTP) << "Querying" << path;
 
     QPair< QDateTime, uint32_t > item = cache.value ( path );
@@ -77,4 +80,18 @@ void FileCache::removePath ( const QString& path )
     cache.remove( path );
 }
 
+void FileCache::removeTree ( const QString& path )
+{
+    const QString prefix = path + QLatin1Char ( '/' );
+
+    QHash<QString, QPair<QDateTime, uint32_t> >::iterator it = cache.begin();
+    while ( it != cache.end() )
+    {
+        if ( it.key() == path || it.key().startsWith ( prefix ) )
+            it = cache.erase ( it );
+        else
+            ++it;
+    }
+}
+
 #include "filecache.moc"
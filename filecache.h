@@ -74,6 +74,13 @@ public:
      * @param path The path that should be removed
      */
     void removePath (const QString& path );
+
+    /**
+     * Remove the given path and everything below it, i.e. if a folder got deleted
+     *
+     * @param path The path of the folder
+     */
+    void removeTree ( const QString& path );
 };
 
 #endif // FILECACHE_H
@@ -0,0 +1,182 @@
+/*
+ *  Compact folder listings for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "filelisting.h"
+
+#include <string.h>
+
+/**
+ * FNV-1a, good enough for file names and cheap to compute.
+ */
+static inline quint32 hashName ( const char *name, int length )
+{
+    quint32 hash = 2166136261u;
+    for ( int i = 0; i < length; i++ )
+    {
+        hash ^= ( unsigned char ) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+FileListing::FileListing()
+{
+}
+
+FileListing::FileListing ( const LIBMTP_file_t *files )
+{
+    int count = 0, nameBytes = 0;
+    for ( const LIBMTP_file_t *file = files; file != NULL; file = file->next )
+    {
+        count++;
+        nameBytes += ( file->filename ? strlen ( file->filename ) : 0 ) + 1;
+    }
+
+    itemIds.reserve ( count );
+    parentIds.reserve ( count );
+    storageIds.reserve ( count );
+    fileSizes.reserve ( count );
+    modificationDates.reserve ( count );
+    filetypes.reserve ( count );
+    nameOffsets.reserve ( count + 1 );
+    names.reserve ( nameBytes );
+
+    for ( const LIBMTP_file_t *file = files; file != NULL; file = file->next )
+    {
+        itemIds.append ( file->item_id );
+        parentIds.append ( file->parent_id );
+        storageIds.append ( file->storage_id );
+        fileSizes.append ( file->filesize );
+        modificationDates.append ( file->modificationdate );
+        filetypes.append ( file->filetype );
+
+        nameOffsets.append ( names.size() );
+        if ( file->filename )
+            names.append ( file->filename );
+        names.append ( '\0' );
+    }
+    nameOffsets.append ( names.size() );
+
+    buildIndex();
+}
+
+const char* FileListing::indexedName ( int index, int &length ) const
+{
+    QHash<qint32, QByteArray>::const_iterator decoded = decodedNames.constFind ( index );
+    if ( decoded != decodedNames.constEnd() )
+    {
+        length = decoded.value().size();
+        return decoded.value().constData();
+    }
+
+    length = nameOffsets.at ( index + 1 ) - nameOffsets.at ( index ) - 1;
+    return rawName ( index );
+}
+
+void FileListing::buildIndex()
+{
+    int capacity = 16;
+    while ( capacity < itemIds.size() * 2 )
+        capacity <<= 1;
+
+    buckets.fill ( -1, capacity );
+    decodedNames.clear();
+
+    const quint32 mask = capacity - 1;
+    for ( int i = 0; i < itemIds.size(); i++ )
+    {
+        const char *raw = rawName ( i );
+        const int rawLength = nameOffsets.at ( i + 1 ) - nameOffsets.at ( i ) - 1;
+
+        // KIO asks for the name it was listed with, invalid bytes are replaced in it
+        bool ascii = true;
+        for ( int j = 0; j < rawLength && ascii; j++ )
+            ascii = ( unsigned char ) raw[j] < 0x80;
+
+        if ( !ascii )
+        {
+            const QByteArray decoded = QString::fromUtf8 ( raw, rawLength ).toUtf8();
+            if ( decoded.size() != rawLength || memcmp ( decoded.constData(), raw, rawLength ) != 0 )
+                decodedNames.insert ( i, decoded );
+        }
+
+        int length;
+        const char *name = indexedName ( i, length );
+        quint32 slot = hashName ( name, length ) & mask;
+
+        // the last of several children with the same name wins, like it did in a QMap
+        while ( buckets.at ( slot ) != -1 )
+        {
+            int otherLength;
+            const char *other = indexedName ( buckets.at ( slot ), otherLength );
+            if ( otherLength == length && memcmp ( other, name, length ) == 0 )
+                break;
+
+            slot = ( slot + 1 ) & mask;
+        }
+
+        buckets[slot] = i;
+    }
+}
+
+int FileListing::find ( const char *name, int length ) const
+{
+    if ( buckets.isEmpty() )
+        return -1;
+
+    const quint32 mask = buckets.size() - 1;
+    quint32 slot = hashName ( name, length ) & mask;
+
+    for ( qint32 index = buckets.at ( slot ); index != -1; index = buckets.at ( slot ) )
+    {
+        int entryLength;
+        const char *entry = indexedName ( index, entryLength );
+        if ( entryLength == length && memcmp ( entry, name, length ) == 0 )
+            return index;
+
+        slot = ( slot + 1 ) & mask;
+    }
+
+    return -1;
+}
+
+int FileListing::indexOf ( const QString &name ) const
+{
+    const QByteArray encoded = name.toUtf8();
+    return find ( encoded.constData(), encoded.size() );
+}
+
+QString FileListing::name ( int index ) const
+{
+    const int length = nameOffsets.at ( index + 1 ) - nameOffsets.at ( index ) - 1;
+    return QString::fromUtf8 ( rawName ( index ), length );
+}
+
+LIBMTP_file_t* FileListing::toFile ( int index ) const
+{
+    LIBMTP_file_t *file = LIBMTP_new_file_t();
+    file->item_id = itemIds.at ( index );
+    file->parent_id = parentIds.at ( index );
+    file->storage_id = storageIds.at ( index );
+    file->filename = strdup ( rawName ( index ) );
+    file->filesize = fileSizes.at ( index );
+    file->modificationdate = ( time_t ) modificationDates.at ( index );
+    file->filetype = ( LIBMTP_filetype_t ) filetypes.at ( index );
+    return file;
+}
@@ -0,0 +1,151 @@
+/*
+ *  Compact folder listings for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef FILELISTING_H
+#define FILELISTING_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+#include <libmtp.h>
+
+/**
+ * @class FileListing Holds the children of a folder as parallel arrays, with all names in one
+ * UTF-8 buffer and a hashed index to look them up.
+ *
+ * Names are only decoded when they are asked for, so resolving a single path element in a large
+ * folder never creates a QString per child. Copies are cheap, the data is implicitly shared.
+ */
+class FileListing
+{
+public:
+    FileListing();
+
+    /**
+     * Copies a list returned by libmtp, the list itself is not taken over.
+     */
+    explicit FileListing ( const LIBMTP_file_t *files );
+
+    int size() const
+    {
+        return itemIds.size();
+    }
+
+    bool isEmpty() const
+    {
+        return itemIds.isEmpty();
+    }
+
+    /**
+     * Looks up a child by the name listings show for it, see name(). Of children with the same
+     * name the last one is found.
+     *
+     * @return The index of the child or -1 if there is none with this name
+     */
+    int indexOf ( const QString &name ) const;
+
+    bool contains ( const QString &name ) const
+    {
+        return indexOf ( name ) >= 0;
+    }
+
+    uint32_t itemId ( int index ) const
+    {
+        return itemIds.at ( index );
+    }
+
+    uint32_t parentId ( int index ) const
+    {
+        return parentIds.at ( index );
+    }
+
+    uint32_t storageId ( int index ) const
+    {
+        return storageIds.at ( index );
+    }
+
+    uint64_t fileSize ( int index ) const
+    {
+        return fileSizes.at ( index );
+    }
+
+    time_t modificationDate ( int index ) const
+    {
+        return ( time_t ) modificationDates.at ( index );
+    }
+
+    LIBMTP_filetype_t filetype ( int index ) const
+    {
+        return ( LIBMTP_filetype_t ) filetypes.at ( index );
+    }
+
+    bool isFolder ( int index ) const
+    {
+        return filetypes.at ( index ) == LIBMTP_FILETYPE_FOLDER;
+    }
+
+    /**
+     * Decodes the name of a child.
+     */
+    QString name ( int index ) const;
+
+    /**
+     * The undecoded, zero terminated name of a child.
+     */
+    const char* rawName ( int index ) const
+    {
+        return names.constData() + nameOffsets.at ( index );
+    }
+
+    /**
+     * Creates a libmtp file for a child, the caller takes ownership.
+     */
+    LIBMTP_file_t* toFile ( int index ) const;
+
+private:
+    void buildIndex();
+    int find ( const char *name, int length ) const;
+
+    /**
+     * The name a child is indexed by, the UTF-8 of its decoded name.
+     */
+    const char* indexedName ( int index, int &length ) const;
+
+    QVector<uint32_t> itemIds;
+    QVector<uint32_t> parentIds;
+    QVector<uint32_t> storageIds;
+    QVector<quint64> fileSizes;
+    QVector<qint64> modificationDates;
+    QVector<quint16> filetypes;
+
+    /// offset of every name in names, with one extra element marking the end of the last name
+    QVector<quint32> nameOffsets;
+    QByteArray names;
+
+    /// open addressing table of indices, -1 marks an empty slot
+    QVector<qint32> buckets;
+
+    /// names that aren't valid UTF-8 by index, encoded again after decoding them
+    QHash<qint32, QByteArray> decodedNames;
+};
+
+#endif // FILELISTING_H
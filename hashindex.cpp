@@ -0,0 +1,180 @@
+/*
+ *  Index of known content hashes for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "hashindex.h"
+#include "tracer.h"
+
+#include <KDebug>
+#include <KLockFile>
+#include <KSaveFile>
+#include <KStandardDirs>
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFile>
+
+#define KIO_MTP                     7000
+
+#define HASHINDEX_MAGIC             0x4d545048  // "MTPH"
+#define HASHINDEX_VERSION           1
+
+static QString indexFile ( const QString &device )
+{
+    // device keys contain serial numbers with arbitrary characters
+    const QByteArray hash = QCryptographicHash::hash ( device.toUtf8(), QCryptographicHash::Md5 ).toHex();
+
+    return KStandardDirs::locateLocal ( "data", QLatin1String ( "kio_mtp/hashes/" ), true ) + QString::fromLatin1 ( hash );
+}
+
+QHash<quint32, HashIndex::Record>& HashIndex::records ( const QString &device )
+{
+    if ( devices.contains ( device ) )
+        return devices[device];
+
+    QHash<quint32, Record> &records = devices[device];
+    load ( device, records );
+
+    return records;
+}
+
+void HashIndex::load ( const QString &device, QHash<quint32, Record> &records )
+{
+    TraceSpan span ( "HashIndex::load", "cache" );
+
+    QFile file ( indexFile ( device ) );
+    if ( !file.open ( QIODevice::ReadOnly ) )
+        return;
+
+    QDataStream stream ( &file );
+
+    quint32 magic, version, count;
+    stream >> magic >> version >> count;
+
+    if ( magic != HASHINDEX_MAGIC || version != HASHINDEX_VERSION )
+        return;
+
+    for ( quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++ )
+    {
+        quint32 handle;
+        Record record;
+        stream >> handle >> record.size >> record.modified >> record.hash;
+
+        records.insert ( handle, record );
+    }
+
+    if ( stream.status() != QDataStream::Ok )
+    {
+        kDebug ( KIO_MTP ) << "Broken hash index" << file.fileName();
+        records.clear();
+    }
+}
+
+bool HashIndex::lookup ( const QString &device, uint32_t handle, uint64_t size, qint64 modified, uint64_t &hash )
+{
+    const QHash<quint32, Record> &known = records ( device );
+
+    QHash<quint32, Record>::const_iterator it = known.constFind ( handle );
+    if ( it == known.constEnd() || it.value().size != size || it.value().modified != modified )
+        return false;
+
+    hash = it.value().hash;
+    return true;
+}
+
+void HashIndex::insert ( const QString &device, uint32_t handle, uint64_t size, qint64 modified, uint64_t hash )
+{
+    Record record;
+    record.size = size;
+    record.modified = modified;
+    record.hash = hash;
+
+    records ( device ).insert ( handle, record );
+    inserted[device].insert ( handle, record );
+    removed[device].remove ( handle );
+}
+
+void HashIndex::remove ( const QString &device, uint32_t handle )
+{
+    // another slave may have stored a hash for it since the index was loaded
+    records ( device ).remove ( handle );
+    inserted[device].remove ( handle );
+    removed[device].insert ( handle );
+}
+
+bool HashIndex::contains ( const QString &device )
+{
+    return !records ( device ).isEmpty();
+}
+
+void HashIndex::sync()
+{
+    const QSet<QString> changed = QSet<QString>::fromList ( inserted.keys() ) + QSet<QString>::fromList ( removed.keys() );
+
+    foreach ( const QString &device, changed )
+    {
+        TraceSpan span ( "HashIndex::sync", "cache" );
+
+        // other slaves store their hashes in the same index, merge ours into theirs
+        KLockFile lock ( indexFile ( device ) + QLatin1String ( ".lock" ) );
+        if ( lock.lock() != KLockFile::LockOK )
+        {
+            kWarning ( KIO_MTP ) << "Can't lock hash index of" << device;
+            continue;
+        }
+
+        QHash<quint32, Record> known;
+        load ( device, known );
+
+        foreach ( quint32 handle, removed.value ( device ) )
+        {
+            known.remove ( handle );
+        }
+
+        const QHash<quint32, Record> ours = inserted.value ( device );
+        for ( QHash<quint32, Record>::const_iterator it = ours.constBegin(); it != ours.constEnd(); ++it )
+        {
+            known.insert ( it.key(), it.value() );
+        }
+
+        inserted.remove ( device );
+        removed.remove ( device );
+        devices[device] = known;
+
+        // other slaves may read the index at any time
+        KSaveFile file ( indexFile ( device ) );
+        if ( !file.open() )
+        {
+            kWarning ( KIO_MTP ) << "Can't store hash index" << file.fileName();
+            lock.unlock();
+            continue;
+        }
+
+        QDataStream stream ( &file );
+        stream << ( quint32 ) HASHINDEX_MAGIC << ( quint32 ) HASHINDEX_VERSION << ( quint32 ) known.size();
+
+        for ( QHash<quint32, Record>::const_iterator it = known.constBegin(); it != known.constEnd(); ++it )
+        {
+            stream << it.key() << it.value().size << it.value().modified << it.value().hash;
+        }
+
+        file.finalize();
+        lock.unlock();
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ *  Index of known content hashes for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#ifndef HASHINDEX_H
+#define HASHINDEX_H
+
+#include <QHash>
+#include <QSet>
+#include <QString>
+
+#include <stdint.h>
+
+/**
+ * @class HashIndex Remembers the content hashes computed during transfers, so verifying or
+ * deduplicating files doesn't need to read them from the device again.
+ *
+ * Hashes are keyed by device and handle and only returned while the object still has the size
+ * and modification time it had when it was hashed. The index of every device is a file in the
+ * data directory of the user, loaded on first use. sync() merges the changes of this slave into
+ * what other slaves stored meanwhile and writes the file.
+ */
+class HashIndex
+{
+public:
+    /**
+     * @param device Identifies the device, see DeviceProfile::key()
+     * @return Whether a hash is known for this state of the object
+     */
+    bool lookup ( const QString &device, uint32_t handle, uint64_t size, qint64 modified, uint64_t &hash );
+
+    void insert ( const QString &device, uint32_t handle, uint64_t size, qint64 modified, uint64_t hash );
+    void remove ( const QString &device, uint32_t handle );
+
+    /**
+     * Whether any hash of an object on the device is known.
+     */
+    bool contains ( const QString &device );
+
+    /**
+     * Writes the indexes that changed since they were loaded.
+     */
+    void sync();
+
+private:
+    struct Record
+    {
+        quint64 size;
+        qint64 modified;
+        quint64 hash;
+    };
+
+    QHash<quint32, Record>& records ( const QString &device );
+    static void load ( const QString &device, QHash<quint32, Record> &records );
+
+    QHash<QString, QHash<quint32, Record> > devices;
+
+    /// Changes since the last sync() by device
+    QHash<QString, QHash<quint32, Record> > inserted;
+    QHash<QString, QSet<quint32> > removed;
+};
+
+#endif // HASHINDEX_H
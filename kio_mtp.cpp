@@ -19,17 +19,30 @@
 
 #include "kio_mtp.h"
 #include "kio_mtp_helpers.h"
+#include "localfile.h"
+#include "mtpcalls.h"
+#include "mtpobjects.h"
+#include "tracer.h"
+#include "transferscheduler.h"
 
 #include <KComponentData>
+#include <KConfig>
+#include <KConfigGroup>
+#include <KMimeType>
 #include <KTemporaryFile>
+#include <QFile>
+#include <QDir>
+#include <QDirIterator>
 #include <QFileInfo>
 #include <QDateTime>
 #include <QCoreApplication>
+#include <QDataStream>
+#include <QSet>
 #include <QTimer>
 
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <utime.h>
+#include <unistd.h>
 
 #include <solid/device.h>
 #include <solid/genericinterface.h>
@@ -70,7 +83,17 @@ MTPSlave::MTPSlave ( const QByteArray& pool, const QByteArray& app )
 
     kDebug ( KIO_MTP ) << "Slave started";
     
-    deviceCache = new DeviceCache( 60000 );
+    KConfig config ( QLatin1String ( "kio_mtprc" ), KConfig::SimpleConfig );
+    const int idleTimeout = KConfigGroup ( &config, "General" ).readEntry ( "IdleTimeout", 60 );
+    const int contentCacheSize = KConfigGroup ( &config, "General" ).readEntry ( "ContentCacheSize", 0 );
+
+    // in MB, 0 disables the cache
+    contentCache.setLimit ( ( quint64 ) qMax ( contentCacheSize, 0 ) * 1024 * 1024 );
+
+    deviceCache = new DeviceCache( idleTimeout * 1000 );
+    sniffedMimetypes.setMaxCost ( MIMETYPE_CACHE_SIZE );
+    mediaDetails.setMaxCost ( MEDIADETAILS_CACHE_SIZE );
+    openFile.id = 0;
     fileCache = new FileCache ( this );
     
     kDebug ( KIO_MTP ) << "Caches created";
@@ -78,571 +101,1444 @@ MTPSlave::MTPSlave ( const QByteArray& pool, const QByteArray& app )
 
 MTPSlave::~MTPSlave()
 {
+    delete deviceCache;
+
     kDebug ( KIO_MTP ) << "Slave destroyed";
 }
 
-/**
- * @brief Get's the correct object from the device.
- * @param pathItems A QStringList containing the items of the filepath
- * @return QPair with the object and its device. pair.first is a nullpointer if the object doesn't exist or for root or, depending on the pathItems size device (1), storage (2) or file (>=3)
- */
-QPair<void*, LIBMTP_mtpdevice_t*> MTPSlave::getPath ( const QString& path )
+void MTPSlave::commandFinished()
 {
-    QStringList pathItems = path.split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+    objectPool.clear();
+    hashIndex.sync();
 
-    kDebug ( KIO_MTP ) << path << pathItems.size();
+    // nothing from the device table is in use anymore
+    deviceCache->quiesce();
 
-    QPair<void*, LIBMTP_mtpdevice_t*> ret;
+    foreach ( CachedDevice *cachedDevice, deviceCache->getAll().values() )
+    {
+        cachedDevice->releaseSpace();
 
-    // Don' handle the root directory
-    if ( pathItems.size() <= 0 )
+        // another slave is waiting, close the session so it can take the device, unless an
+        // opened file is being edited in it. After an aborted transfer the next command starts
+        // with a fresh session, in case the device didn't take the cancellation well.
+        if ( ( cachedDevice->isRequested ( DeviceArbiter::Interactive ) || cachedDevice->isRequested ( DeviceArbiter::Bulk )
+               || cancellation.isValid() ) && !cachedDevice->isInUse() )
+        {
+            cachedDevice->releaseSession();
+        }
+        else
+        {
+            cachedDevice->releaseIfIdle();
+        }
+    }
+
+    if ( cancellation.isValid() )
     {
-        return ret;
+        kDebug ( KIO_MTP ) << "Idle" << cancellation.elapsed() << "ms after the job was killed";
+        cancellation.invalidate();
     }
 
-    if ( deviceCache->contains( pathItems.at ( 0 ) ) )
+    // keep looking for waiting slaves and idle sessions while idle, sessions may also be
+    // opened by the hotplug thread at any time
+    if ( deviceCache->size() > 0 )
     {
-        LIBMTP_mtpdevice_t *device = deviceCache->get ( pathItems.at ( 0 ) )->getDevice();
+        QByteArray data;
+        QDataStream stream ( &data, QIODevice::WriteOnly );
+        stream << ( qint32 ) PollDeviceRequests;
 
-        // return specific device
-        if ( pathItems.size() == 1 )
-        {
-            ret.first = device;
-            ret.second = device;
+        setTimeoutSpecialCommand ( 1, data );
+    }
+}
 
-            kDebug(KIO_MTP) << "returning LIBMTP_mtpdevice_t";
-        }
+void MTPSlave::special ( const QByteArray& data )
+{
+    QDataStream stream ( data );
+    qint32 command;
+    stream >> command;
 
-        if ( pathItems.size() > 2 )
+    switch ( command )
+    {
+        case PollDeviceRequests:
+            commandFinished();
+            break;
+        case UploadFiles:
         {
-            // Query Cache after we have the device
-            uint32_t c_fileID = fileCache->queryPath ( path );
-            if ( c_fileID != 0 )
-            {
-                kDebug() << "Match found in cache, checking device";
+            QStringList sources, destinations;
+            bool overwrite;
+            stream >> sources >> destinations >> overwrite;
 
-                LIBMTP_file_t* file = LIBMTP_Get_Filemetadata ( device, c_fileID );
-                if ( file )
-                {
-                    kDebug ( KIO_MTP ) << "Found file in cache";
-                    ret.first = file;
-                    ret.second = device;
+            uploadFiles ( sources, destinations, overwrite );
+            break;
+        }
+        case MirrorDirectory:
+        {
+            QString source, destination;
+            bool overwrite;
+            stream >> source >> destination >> overwrite;
 
-                    kDebug(KIO_MTP) << "returning LIBMTP_file_t from cache";
+            QStringList sources, destinations;
+            const QDir base ( source );
 
-                    return ret;
-                }
-            }
-            // Query cache for parent
-            else if ( pathItems.size() > 3 )
+            QDirIterator it ( source, QDir::Files | QDir::Hidden | QDir::NoDotAndDotDot, QDirIterator::Subdirectories );
+            while ( it.hasNext() )
             {
-                QString parentPath = convertToPath ( pathItems, pathItems.size() - 1 );
-                uint32_t c_parentID = fileCache->queryPath ( parentPath );
+                it.next();
 
-                kDebug() << "Match for parent found in cache, checking device. Parent id = " << c_parentID;
+                sources.append ( it.filePath() );
+                destinations.append ( destination + QLatin1Char ( '/' ) + base.relativeFilePath ( it.filePath() ) );
+            }
 
-                LIBMTP_file_t* parent = LIBMTP_Get_Filemetadata ( device, c_parentID );
-                if ( parent )
-                {
-                    kDebug ( KIO_MTP ) << "Found parent in cache";
-//                     fileCache->addPath( parentPath, c_parentID );
+            uploadFiles ( sources, destinations, overwrite );
+            break;
+        }
+        case FolderSize:
+        {
+            QString path;
+            stream >> path;
 
-                    QMap<QString, LIBMTP_file_t*> files = getFiles ( device, parent->storage_id, c_parentID );
-                    
-                    for ( QMap<QString, LIBMTP_file_t*>::iterator it = files.begin(); it != files.end(); ++it )
-                    {
-                        QString filePath = parentPath;
-                        filePath.append( QString::fromUtf8("/") ).append( it.key() );
-                        fileCache->addPath( filePath, it.value()->item_id );
-                    }
-                    
-                    if ( files.contains ( pathItems.last() ) )
-                    {
-                        LIBMTP_file_t* file = files.value( pathItems.last() );
+            folderSize ( path );
+            break;
+        }
+        case ListChanges:
+        {
+            QString path, token;
+            stream >> path >> token;
 
-                        ret.first = file;
-                        ret.second = device;
+            listChanges ( path, token );
+            break;
+        }
+        default:
+            error ( ERR_UNSUPPORTED_ACTION, QString::number ( command ) );
+            break;
+    }
+}
 
-                        kDebug(KIO_MTP) << "returning LIBMTP_file_t from cached parent" ;
+int MTPSlave::sendFile ( CachedDevice *cachedDevice, LIBMTP_mtpdevice_t *&device, LIBMTP_file_t *file, bool resumable,
+                         MTPDataGetFunc get, void *priv )
+{
+    if ( !resumable )
+        return mtpSendFileFromHandler ( device, get, priv, file, &dataProgress, this );
 
-                        fileCache->addPath( path, file->item_id );
-                    }
+    const uint64_t size = file->filesize;
 
-                    return ret;
-                }
-            }
-        }
+    file->filesize = 0;
+    int ret = mtpSendFileFromHandler ( device, &dataNone, 0, file, 0, 0 );
+    file->filesize = size;
 
-        QMap<QString, LIBMTP_devicestorage_t*> storages = getDevicestorages ( device );
+    if ( ret != 0 )
+        return ret;
 
-        if ( pathItems.size() > 1 && storages.contains ( pathItems.at ( 1 ) ) )
-        {
-            LIBMTP_devicestorage_t *storage = storages.value ( pathItems.at ( 1 ) );
+    TransferScheduler scheduler ( cachedDevice );
+    ret = scheduler.upload ( file->item_id, 0, size, get, priv, &dataProgress, this );
 
-            if ( pathItems.size() == 2 )
-            {
-                ret.first = storage;
-                ret.second = device;
+    device = cachedDevice->getDevice();
 
-                kDebug(KIO_MTP) << "returning LIBMTP_devicestorage_t";
+    return ret;
+}
 
-                return ret;
-            }
+bool MTPSlave::finishPartial ( LIBMTP_mtpdevice_t *device, uint32_t id, const LIBMTP_file_t *existing, const KUrl &url )
+{
+    MTPFilePointer uploaded ( mtpGetFilemetadata ( device, id ) );
+    if ( !uploaded || mtpSetFileName ( device, uploaded.data(), url.fileName().toUtf8().data() ) != 0 )
+        return false;
 
-            int currentLevel = 2, currentParent = 0xFFFFFFFF;
+    // only replace the old file once the new one is complete
+    if ( existing && existing->item_id != id )
+        mtpDeleteObject ( device, existing->item_id );
 
-            QMap<QString, LIBMTP_file_t*> files;
+    fileCache->removePath ( url.path() + QLatin1String ( ".part" ) );
+    fileCache->addPath ( url.path(), id );
 
-            // traverse further while depth not reached
-            while ( currentLevel < pathItems.size() )
-            {
-                files = getFiles ( device, storage->id, currentParent );
+    return true;
+}
 
-                if ( files.contains ( pathItems.at ( currentLevel ) ) )
-                {
-                    currentParent = files.value ( pathItems.at ( currentLevel ) )->item_id;
-                }
-                else
-                {
+void MTPSlave::discardUpload ( LIBMTP_mtpdevice_t *device, uint32_t id, const QString &path )
+{
+    if ( !device || id == 0 )
+        return;
 
-                    kDebug(KIO_MTP) << "returning LIBMTP_file_t using tree walk";
+    kDebug ( KIO_MTP ) << "Deleting incomplete upload" << path;
 
-                    return ret;
-                }
-                currentLevel++;
-            }
+    mtpDeleteObject ( device, id );
+    fileCache->removePath ( path );
+}
 
-            ret.first = LIBMTP_Get_Filemetadata ( device, currentParent );
-            ret.second = device;
+bool MTPSlave::isCancelled()
+{
+    if ( !wasKilled() )
+        return false;
 
-            fileCache->addPath ( path, currentParent );
-        }
+    if ( !cancellation.isValid() )
+    {
+        kDebug ( KIO_MTP ) << "Job was killed, aborting the transfer";
+        cancellation.start();
     }
 
-    return ret;
+    return true;
 }
 
-int MTPSlave::checkUrl ( const KUrl& url, bool redirect )
+bool MTPSlave::resolveBatchFolder ( const QString &path, QHash<QString, BatchFolder> &folders, BatchFolder &folder )
 {
-    kDebug ( KIO_MTP ) << url;
+    if ( folders.contains ( path ) )
+    {
+        folder = folders.value ( path );
+        return true;
+    }
 
-    if ( url.path().startsWith ( QLatin1String ( "udi=" ) ) && redirect )
+    QStringList pathItems = path.split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+    // files need a storage
+    if ( pathItems.size() < 2 || !deviceCache->contains ( pathItems.at ( 0 ) ) )
+        return false;
+
+    QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( path );
+    LIBMTP_mtpdevice_t *device = pair.second;
+
+    if ( pathItems.size() == 2 )
     {
-        QString udi = url.path( KUrl::RemoveTrailingSlash ).remove ( 0, 4 );
+        LIBMTP_devicestorage_t *storage = ( LIBMTP_devicestorage_t* ) pair.first;
+        if ( !storage )
+            return false;
 
-        kDebug ( KIO_MTP ) << "udi = " << udi;
+        folder.id = 0xFFFFFFFF;
+        folder.storageId = storage->id;
+    }
+    else if ( pair.first )
+    {
+        LIBMTP_file_t *file = ( LIBMTP_file_t* ) pair.first;
+        if ( file->filetype != LIBMTP_FILETYPE_FOLDER )
+            return false;
 
-        if ( deviceCache->contains( udi, true ) )
-        {
-            KUrl newUrl;
-            newUrl.setProtocol ( QLatin1String ( "mtp" ) );
-            newUrl.setPath ( QLatin1Char ( '/' ) + deviceCache->get( udi, true )->getName() );
-            redirection ( newUrl );
-            
-            return 1;
-        }
-        else
-        {
-            return 2;
-        }
+        folder.id = file->item_id;
+        folder.storageId = file->storage_id;
     }
-    else if ( url.path().startsWith(QLatin1Char ( '/' ) ) )
+    // a new folder has no children to list
+    else
     {
-        return 0;
+        folder.id = makePath ( path, folder.storageId );
+        if ( folder.id == 0 )
+            return false;
+
+        folder.children = FileListing();
+
+        folders.insert ( path, folder );
+        return true;
     }
-    return -1;
+
+    // one listing answers whether any of the files exists
+    folder.children = getFiles ( deviceCache->get ( pathItems.at ( 0 ) ), device, folder.storageId, folder.id );
+    folders.insert ( path, folder );
+
+    return true;
 }
 
-void MTPSlave::listDir ( const KUrl& url )
+void MTPSlave::uploadFiles ( const QStringList &sources, const QStringList &destinations, bool overwrite )
 {
-    kDebug ( KIO_MTP ) << url.path();
+    TraceSpan span ( "uploadFiles", "kio", QString::number ( sources.size() ) );
+    CommandScope commandScope ( this );
+    storageTrees.clear();
 
-    int check = checkUrl( url );
-    switch ( check )
+    if ( sources.size() != destinations.size() )
     {
-        case 0:
-            break;
-        case 1:
-            finished();
-            return;
-        case 2:
-            error( ERR_DOES_NOT_EXIST, url.path() );
+        error ( ERR_UNSUPPORTED_ACTION, i18n ( "Every file needs a destination" ) );
+        return;
+    }
+
+    // files already on the device are skipped, only the rest has to fit
+    const bool skipIdentical = config()->readEntry ( "SkipIdentical", false );
+
+    // bytes and objects per storage, the whole batch has to fit before anything is sent
+    QHash<QString, QPair<quint64, quint32> > plan;
+    KIO::filesize_t total = 0;
+
+    for ( int i = 0; i < sources.size(); i++ )
+    {
+        const quint64 size = QFileInfo ( sources.at ( i ) ).size();
+        const QStringList destItems = destinations.at ( i ).split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+        QPair<quint64, quint32> &storage = plan[convertToPath ( destItems, 2 )];
+        storage.first += size;
+        storage.second++;
+
+        total += size;
+    }
+
+    for ( QHash<QString, QPair<quint64, quint32> >::const_iterator it = plan.constBegin(); it != plan.constEnd(); ++it )
+    {
+        const QStringList storageItems = it.key().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+        if ( storageItems.size() < 2 )
+            continue;
+
+        LIBMTP_devicestorage_t *storage = ( LIBMTP_devicestorage_t* ) getPath ( it.key() ).first;
+        if ( !storage )
+        {
+            error ( ERR_DOES_NOT_EXIST, it.key() );
             return;
-        default:
-            error( ERR_MALFORMED_URL, url.path() );
+        }
+
+        if ( !skipIdentical && !deviceCache->get ( storageItems.at ( 0 ) )->reserveSpace ( storage->id, it.value().first, it.value().second ) )
+        {
+            error ( ERR_DISK_FULL, it.key() );
             return;
+        }
     }
 
-    QStringList pathItems = url.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+    totalSize ( total );
 
-    UDSEntry entry;
+    QHash<QString, BatchFolder> folders;
+    BatchProgress progress ( this );
 
-    // list devices
-    if ( pathItems.size() == 0 )
+    for ( int i = 0; i < sources.size(); i++ )
     {
-        kDebug ( KIO_MTP ) << "Root directory, listing devices";
-        totalSize ( deviceCache->size() );
+        QStringList destItems = destinations.at ( i ).split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+        const QString destination = convertToPath ( destItems, destItems.size() );
 
-        foreach ( CachedDevice* cachedDevice, deviceCache->getAll().values() )
+        // Can't copy to root or device, needs storage
+        if ( destItems.size() < 3 )
         {
-            LIBMTP_mtpdevice_t *device = cachedDevice->getDevice();
+            error ( ERR_UNSUPPORTED_ACTION, destination );
+            return;
+        }
 
-            getEntry ( entry, device );
+        const QString name = destItems.last();
+        const QString directory = convertToPath ( destItems, destItems.size() - 1 );
 
-            listEntry ( entry, false );
-            entry.clear();
+        BatchFolder folder;
+        if ( !resolveBatchFolder ( directory, folders, folder ) )
+        {
+            error ( ERR_COULD_NOT_MKDIR, directory );
+            return;
         }
 
-        listEntry ( entry, true );
-
-        kDebug ( KIO_MTP ) << "[SUCCESS] :: Devices";
-        finished();
-    }
-    // traverse into device
-    else if ( deviceCache->contains ( pathItems.at ( 0 ) ) )
-    {
-        QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.path() );
-        UDSEntry entry;
-        
-        if ( pair.first )
+        LIBMTP_mtpdevice_t *device = deviceCache->get ( destItems.at ( 0 ) )->getDevice ( DeviceArbiter::Bulk );
+        if ( !device )
         {
-            LIBMTP_mtpdevice_t *device = pair.second;
+            error ( ERR_COULD_NOT_CONNECT, destItems.at ( 0 ) );
+            return;
+        }
 
-            // Device, list storages
-            if ( pathItems.size() == 1 )
-            {
-                QMap<QString, LIBMTP_devicestorage_t*> storages = getDevicestorages ( device );
-                
-                kDebug ( KIO_MTP ) << "Listing storages for device " << pathItems.at ( 0 );
-                totalSize ( storages.size() );
+        QFileInfo source ( sources.at ( i ) );
 
-                if ( storages.size() > 0 )
-                {
-                    foreach ( const QString &storageName, storages.keys() )
-                    {
-                        getEntry ( entry, storages.value ( storageName ) );
+        // replaced only once the new file is complete
+        uint32_t replacedId = 0;
 
-                        listEntry ( entry, false );
-                        entry.clear();
-                    }
+        const int index = folder.children.indexOf ( name );
+        if ( index >= 0 )
+        {
+            // the listing of the folder already knows size and date of every file in it
+            if ( skipIdentical && !folder.children.isFolder ( index )
+                 && isIdentical ( destItems.at ( 0 ), folder.children.itemId ( index ), folder.children.fileSize ( index ),
+                                  folder.children.modificationDate ( index ), source ) )
+            {
+                kDebug ( KIO_MTP ) << "Skipping identical" << destination;
 
-                    listEntry ( entry, true );
-                    finished();
-                    kDebug ( KIO_MTP ) << "[SUCCESS] :: Storages";
-                }
-                else
-                {
-                    warning( i18n("No Storages found. Maybe you need to unlock your device?") );
-                }
+                progress.base += source.size();
+                processedSize ( progress.base );
+                continue;
             }
-            // Storage, list files and folders of storage root
-            else
+
+            if ( !overwrite )
             {
-                QMap<QString, LIBMTP_file_t*> files;
-                
-                if ( pathItems.size() == 2 )
-                {
-                    kDebug(KIO_MTP) << "Getting storage root listing";
-                    
-                    LIBMTP_devicestorage_t *storage = (LIBMTP_devicestorage_t*)pair.first;
-                    
-                    kDebug(KIO_MTP) << "We have a storage:" << (storage == NULL);
-                    
-                    files = getFiles( device, storage->id );
-                }
-                else
-                {
-                    LIBMTP_file_t *parent = (LIBMTP_file_t*)pair.first;
-                    
-                    files = getFiles( device, parent->storage_id, parent->item_id );
-                }
-                
-                for ( QMap<QString, LIBMTP_file_t*>::iterator it = files.begin(); it != files.end(); ++it )
-                {
-                    LIBMTP_file_t *file = it.value();
-                    
-                    QString filePath = url.path( KUrl::AddTrailingSlash ).append( it.key() );
-                    fileCache->addPath( filePath, file->item_id );
-                    
-                    getEntry ( entry, file );
-                    
-                    listEntry ( entry, false );
-                    entry.clear();
-                }
-                
-                listEntry ( entry, true );
-                finished();
-                
-                kDebug ( KIO_MTP ) << "[SUCCESS] Files";
+                error ( ERR_FILE_ALREADY_EXIST, destination );
+                return;
             }
+
+            replacedId = folder.children.itemId ( index );
         }
-        else
+
+        if ( skipIdentical && !deviceCache->get ( destItems.at ( 0 ) )->reserveSpace ( folder.storageId, source.size() ) )
         {
-            error ( ERR_CANNOT_ENTER_DIRECTORY, url.path() );
-            kDebug ( KIO_MTP ) << "[ERROR]";
+            error ( ERR_DISK_FULL, destination );
+            return;
         }
-    }
-    else
-    {
-        error ( ERR_CANNOT_ENTER_DIRECTORY, url.path() );
-        kDebug ( KIO_MTP ) << "[ERROR]";
-    }
-}
 
-void MTPSlave::stat ( const KUrl& url )
-{
-    kDebug ( KIO_MTP ) << url.path();
+        MTPFilePointer file ( LIBMTP_new_file_t() );
+        file->parent_id = folder.id;
+        file->filename = strdup ( name.toUtf8().data() );
+        file->filetype = getFiletype ( name );
+        file->filesize = source.size();
+        file->modificationdate = source.lastModified().toTime_t();
+        file->storage_id = folder.storageId;
 
-    int check = checkUrl( url );
-    switch ( check )
-    {
-        case 0:
-            break;
-        case 1:
-            finished();
-            return;
-        case 2:
-            error( ERR_DOES_NOT_EXIST, url.path() );
-            return;
-        default:
-            error( ERR_MALFORMED_URL, url.path() );
+        LocalFile input ( sources.at ( i ) );
+        if ( !input.openForReading() )
+        {
+            error ( KIO::ERR_CANNOT_OPEN_FOR_READING, sources.at ( i ) );
             return;
-    }
-
-    QStringList pathItems = url.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+        }
 
-    QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.path() );
-    UDSEntry entry;
+        HashingData hashing ( &dataRead, &input );
 
-    if ( pair.first )
-    {
-        // Root
-        if ( pathItems.size() < 1 )
-        {
-            entry.insert ( UDSEntry::UDS_NAME, QLatin1String ( "mtp:///" ) );
-            entry.insert ( UDSEntry::UDS_FILE_TYPE, S_IFDIR );
-            entry.insert ( UDSEntry::UDS_ACCESS, S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR | S_IXGRP | S_IXOTH );
-            entry.insert ( UDSEntry::UDS_MIME_TYPE, QLatin1String ( "inode/directory" ) );
-        }
-        // Device
-        else if ( pathItems.size() < 2 )
-        {
-            getEntry ( entry, pair.second );
-        }
-        // Storage
-        else if ( pathItems.size() < 3 )
+        int ret = mtpSendFileFromHandler ( device, &hashData, &hashing, file.data(), &batchProgress, &progress );
+        if ( ret != 0 )
         {
-            getEntry ( entry, ( LIBMTP_devicestorage_t* ) pair.first );
+            error ( KIO::ERR_COULD_NOT_WRITE, destination );
+
+            // clean up in a working session
+            if ( deviceCache->get ( destItems.at ( 0 ) )->recover ( device ) )
+            {
+                device = deviceCache->get ( destItems.at ( 0 ) )->getDevice();
+            }
+            else if ( device )
+            {
+                LIBMTP_Dump_Errorstack ( device );
+                LIBMTP_Clear_Errorstack ( device );
+            }
+
+            discardUpload ( device, file->item_id, destination );
+            return;
         }
-        // Folder/File
-        else
+
+        const QString key = deviceKey ( deviceCache->get ( destItems.at ( 0 ) ) );
+
+        if ( replacedId != 0 )
         {
-            getEntry ( entry, ( LIBMTP_file_t* ) pair.first );
+            mtpDeleteObject ( device, replacedId );
+
+            hashIndex.remove ( key, replacedId );
+            contentCache.remove ( key, replacedId );
         }
+
+        hashIndex.insert ( key, file->item_id, file->filesize, file->modificationdate, hashing.hash.result() );
+
+        fileCache->addPath ( destination, file->item_id );
+
+        progress.base += source.size();
+        processedSize ( progress.base );
     }
-    statEntry ( entry );
+
+    kDebug ( KIO_MTP ) << "Sent" << sources.size() << "files to" << folders.size() << "folders";
+
     finished();
 }
 
-void MTPSlave::mimetype ( const KUrl& url )
+void MTPSlave::folderSize ( const QString &path )
 {
-    int check = checkUrl( url );
-    switch ( check )
+    TraceSpan span ( "folderSize", "kio", path );
+    CommandScope commandScope ( this );
+
+    QStringList pathItems = path.split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+    if ( pathItems.size() < 2 )
     {
-        case 0:
-            break;
-        case 1:
-            finished();
-            return;
-        case 2:
-            error( ERR_DOES_NOT_EXIST, url.path() );
-            return;
-        default:
-            error( ERR_MALFORMED_URL, url.path() );
-            return;
+        error ( ERR_UNSUPPORTED_ACTION, path );
+        return;
     }
 
-    kDebug ( KIO_MTP ) << url.path();
-
-    QStringList pathItems = url.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+    QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( path );
+    if ( !pair.first )
+    {
+        error ( ERR_DOES_NOT_EXIST, path );
+        return;
+    }
 
-    QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.path() );
+    LIBMTP_mtpdevice_t *device = pair.second;
+    uint32_t storageId, folderId;
 
-    if ( pair.first )
+    if ( pathItems.size() == 2 )
     {
-        if ( pathItems.size() > 2 )
-            mimetype ( getMimetype ( ( ( LIBMTP_file_t* ) pair.first )->filetype ) );
-        else
-            mimetype ( QString::fromLatin1 ( "inode/directory" ) );
+        storageId = ( ( LIBMTP_devicestorage_t* ) pair.first )->id;
+        folderId = 0xFFFFFFFF;
     }
     else
     {
-        error ( ERR_DOES_NOT_EXIST, url.path() );
-        return;
+        LIBMTP_file_t *file = ( LIBMTP_file_t* ) pair.first;
+        if ( file->filetype != LIBMTP_FILETYPE_FOLDER )
+        {
+            error ( ERR_IS_FILE, path );
+            return;
+        }
+
+        storageId = file->storage_id;
+        folderId = file->item_id;
     }
-}
 
-void MTPSlave::put ( const KUrl& url, int, JobFlags flags )
-{
-    int check = checkUrl( url );
-    switch ( check )
+    // one listing of the whole device answers every folder until it gets modified
+    StorageTree &tree = storageTrees[pathItems.at ( 0 )];
+    if ( !tree.isValid() )
     {
-        case 0:
-            break;
-        default:
-            error( ERR_MALFORMED_URL, url.path() );
-            return;
+        MTPFileListPointer files ( mtpGetFilelisting ( device ) );
+        tree = StorageTree ( files.data() );
     }
 
-    kDebug ( KIO_MTP ) << url.path();
+    const StorageTree::Totals totals = tree.totals ( storageId, folderId );
 
-    QStringList destItems = url.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+    setMetaData ( QLatin1String ( "folderSize" ), QString::number ( totals.size ) );
+    setMetaData ( QLatin1String ( "fileCount" ), QString::number ( totals.files ) );
+    setMetaData ( QLatin1String ( "folderCount" ), QString::number ( totals.folders ) );
 
-    // Can't copy to root or device, needs storage
-    if ( destItems.size() < 2 )
+    finished();
+}
+
+void MTPSlave::listChanges ( const QString &path, const QString &token )
+{
+    TraceSpan span ( "listChanges", "kio", path );
+    CommandScope commandScope ( this );
+
+    QStringList pathItems = path.split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+    if ( pathItems.size() != 2 )
     {
-        error ( ERR_UNSUPPORTED_ACTION, url.path() );
+        error ( ERR_UNSUPPORTED_ACTION, path );
         return;
     }
 
-    if ( !(flags & KIO::Overwrite) && getPath( url.path() ).first )
+    QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( path );
+    LIBMTP_devicestorage_t *storage = ( LIBMTP_devicestorage_t* ) pair.first;
+    if ( !storage )
     {
-        error( ERR_FILE_ALREADY_EXIST, url.path() );
+        error ( ERR_DOES_NOT_EXIST, path );
         return;
     }
 
-    destItems.takeLast();
+    const uint32_t storageId = storage->id;
 
-    QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.directory() );
+    const QString key = deviceKey ( deviceCache->get ( pathItems.at ( 0 ) ) );
 
-    if ( !pair.first )
-    {
-        error ( ERR_DOES_NOT_EXIST, url.path() );
-        return;
-    }
+    // libmtp can't wait for events without blocking, one bulk listing is the cheapest way to
+    // see everything
+    MTPFileListPointer files ( mtpGetFilelisting ( pair.second ) );
 
-    LIBMTP_mtpdevice_t *device = pair.second;
-    LIBMTP_file_t *parent = ( LIBMTP_file_t* ) pair.first;
-    if ( parent->filetype != LIBMTP_FILETYPE_FOLDER )
-    {
-        error ( ERR_IS_FILE, url.directory() );
-        return;
-    }
+    const StorageSnapshot current ( files.data(), storageId );
+    const StorageSnapshot previous = StorageSnapshot::load ( key, storageId, token );
 
-    // We did get a total size from the application
-    if ( hasMetaData ( QLatin1String ( "sourceSize" ) ) )
-    {
-        kDebug ( KIO_MTP ) << "direct put";
+    // answers folder sizes until the device gets modified
+    storageTrees.insert ( pathItems.at ( 0 ), StorageTree ( files.data() ) );
 
-        LIBMTP_file_t *file = LIBMTP_new_file_t();
-        file->parent_id = parent->item_id;
-        file->filename = strdup ( url.fileName().toUtf8().data() );
-        file->filetype = getFiletype ( url.fileName() );
-        file->filesize = metaData ( QLatin1String ( "sourceSize" ) ).toULongLong();
-        file->modificationdate = QDateTime::currentDateTime().toTime_t();
-        file->storage_id = parent->storage_id;
+    QByteArray changes;
+    QDataStream stream ( &changes, QIODevice::WriteOnly );
+    const quint32 count = current.writeChanges ( previous, stream );
 
-        kDebug ( KIO_MTP ) << "Sending file" << file->filename;
+    kDebug ( KIO_MTP ) << count << "changes since" << token;
 
-        int ret = LIBMTP_Send_File_From_Handler ( device, &dataGet, this, file, &dataProgress, this );
-        if ( ret != 0 )
-        {
-            error ( KIO::ERR_COULD_NOT_WRITE, url.fileName() );
-            LIBMTP_Dump_Errorstack ( device );
-            LIBMTP_Clear_Errorstack ( device );
-            return;
-        }
-    }
-    // We need to get the entire file first, then we can upload
-    else
-    {
-        kDebug ( KIO_MTP ) << "use temp file";
+    setMetaData ( QLatin1String ( "snapshotToken" ), current.save ( key, storageId ) );
+    setMetaData ( QLatin1String ( "changeCount" ), QString::number ( count ) );
 
-        KTemporaryFile temp;
-        QByteArray buffer;
-        int len = 0;
+    data ( changes );
+    data ( QByteArray() );
 
-        do
-        {
-            dataReq();
-            len = readData ( buffer );
-            temp.write ( buffer );
-        }
-        while ( len > 0 );
+    finished();
+}
 
-        QFileInfo info ( temp );
+bool MTPSlave::isIdentical ( const QString &device, uint32_t handle, uint64_t size, qint64 modified, const QFileInfo &local )
+{
+    if ( size != ( uint64_t ) local.size() )
+        return false;
 
-        LIBMTP_file_t *file = LIBMTP_new_file_t();
-        file->parent_id = parent->item_id;
-        file->filename = strdup ( url.fileName().toUtf8().data() );
-        file->filetype = getFiletype ( url.fileName() );
-        file->filesize = info.size();
-        file->modificationdate = QDateTime::currentDateTime().toTime_t();
-        file->storage_id = parent->storage_id;
+    if ( modified == ( qint64 ) local.lastModified().toTime_t() )
+        return true;
 
+    // the date may have been lost on the way, compare the content if it is known
+    uint64_t known;
+    if ( !hashIndex.lookup ( deviceKey ( deviceCache->get ( device ) ), handle, size, modified, known ) )
+        return false;
 
-        int ret = LIBMTP_Send_File_From_File_Descriptor ( device, temp.handle(), file, NULL, NULL );
-        if ( ret != 0 )
+    // reading the local file is much cheaper than sending it
+    uint64_t hash;
+    return hashFile ( local.filePath(), hash ) && hash == known;
+}
+
+void MTPSlave::reportHash ( const QString &device, uint32_t handle, uint64_t size, qint64 modified, uint64_t hash )
+{
+    hashIndex.insert ( device, handle, size, modified, hash );
+
+    setMetaData ( QLatin1String ( "contentHash" ), ContentHash::toString ( hash ) );
+}
+
+QString MTPSlave::sniffMimetype ( CachedDevice *cachedDevice, const LIBMTP_file_t *file )
+{
+    const QString filename = QString::fromUtf8 ( file->filename );
+
+    QString mimetype = getMimetype ( filename, file->filetype );
+    if ( !mimetype.isEmpty() )
+        return mimetype;
+
+    const QString key = objectKey ( cachedDevice, file->item_id, file->filesize, file->modificationdate );
+
+    if ( const QString *cached = sniffedMimetypes.object ( key ) )
+        return *cached;
+
+    TraceSpan span ( "sniffMimetype", "kio", filename );
+
+    mimetype = KMimeType::defaultMimeType();
+
+    // without partial reads there is no way to look at the content short of downloading all of it
+    if ( file->filesize > 0 && cachedDevice->getProfile().hasCapability ( LIBMTP_DEVICECAP_GetPartialObject ) )
+    {
+        LIBMTP_mtpdevice_t *device = cachedDevice->getDevice();
+        unsigned char *buffer = 0;
+        unsigned int length = 0;
+
+        if ( mtpGetPartialObject ( device, file->item_id, 0, qMin<uint64_t> ( file->filesize, MIMETYPE_SNIFF_SIZE ), &buffer, &length ) == 0 )
         {
-            error ( KIO::ERR_COULD_NOT_WRITE, url.fileName() );
-            return;
+            const KMimeType::Ptr byContent = KMimeType::findByNameAndContent ( filename, QByteArray ( ( char* ) buffer, length ) );
+            if ( byContent )
+                mimetype = byContent->name();
         }
-        finished();
+        else
+        {
+            LIBMTP_Dump_Errorstack ( device );
+            LIBMTP_Clear_Errorstack ( device );
+        }
+
+        free ( buffer );
     }
+
+    kDebug ( KIO_MTP ) << "Sniffed" << mimetype << "for" << filename;
+
+    sniffedMimetypes.insert ( key, new QString ( mimetype ) );
+
+    return mimetype;
 }
 
-void MTPSlave::get ( const KUrl& url )
+bool MTPSlave::sendCachedContent ( const QString &path, uint64_t offset )
 {
-    int check = checkUrl( url );
-    switch ( check )
-    {
-        case 0:
-            break;
-        default:
-            error( ERR_MALFORMED_URL, url.path() );
-            return;
-    }
+    TraceSpan span ( "sendCachedContent", "cache", path );
 
-    kDebug ( KIO_MTP ) << url.path();
+    QFile file ( path );
+    if ( !file.open ( QIODevice::ReadOnly ) || ( uint64_t ) file.size() < offset )
+        return false;
 
-    QStringList pathItems = url.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+    kDebug ( KIO_MTP ) << "Sending" << file.size() - offset << "bytes from the content cache";
 
-    // File
-    if ( pathItems.size() > 2 )
+    for ( qint64 position = offset; position < file.size(); position += CONTENTCACHE_CHUNK_SIZE )
     {
-        QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.path() );
+        const qint64 length = qMin<qint64> ( CONTENTCACHE_CHUNK_SIZE, file.size() - position );
 
-        if ( pair.first )
+        uchar *mapped = file.map ( position, length );
+        if ( !mapped )
         {
-            LIBMTP_file_t *file = ( LIBMTP_file_t* ) pair.first;
+            // nothing sent yet, the device can still take over
+            if ( position == ( qint64 ) offset )
+                return false;
 
-            mimeType ( getMimetype ( file->filetype ) );
-            totalSize ( file->filesize );
+            error ( ERR_COULD_NOT_READ, path );
+            return true;
+        }
 
-            LIBMTP_mtpdevice_t *device = pair.second;
+        data ( QByteArray ( ( const char* ) mapped, length ) );
+        file.unmap ( mapped );
 
-            int ret = LIBMTP_Get_File_To_Handler ( device, file->item_id, &dataPut, this, &dataProgress, this );
-            if ( ret != 0 )
-            {
-                error ( ERR_COULD_NOT_READ, url.path() );
-                return;
-            }
-            data ( QByteArray() );
-            finished();
+        processedSize ( position + length );
+
+        if ( isCancelled() )
+        {
+            error ( ERR_USER_CANCELED, path );
+            return true;
         }
-        else
-            error ( ERR_DOES_NOT_EXIST, url.path() );
     }
-    else
-        error ( ERR_UNSUPPORTED_ACTION, url.path() );
+
+    data ( QByteArray() );
+    finished();
+
+    return true;
 }
 
-void MTPSlave::copy ( const KUrl& src, const KUrl& dest, int, JobFlags flags )
+void MTPSlave::addMediaDetails ( UDSEntry &entry, CachedDevice *cachedDevice, uint32_t id, LIBMTP_filetype_t filetype,
+                                 uint64_t size, qint64 modified )
 {
-    kDebug ( KIO_MTP ) << src.path() << dest.path();
+    if ( !LIBMTP_FILETYPE_IS_TRACK ( filetype ) && !LIBMTP_FILETYPE_IS_IMAGE ( filetype ) )
+        return;
 
-    // mtp:/// to mtp:///
-    if ( src.protocol() == QLatin1String ( "mtp" ) && dest.protocol() == QLatin1String ( "mtp" ) )
+    if ( !config()->readEntry ( "MediaDetails", false ) )
+        return;
+
+    const QString key = objectKey ( cachedDevice, id, size, modified );
+
+    MediaDetails *details = mediaDetails.object ( key );
+    if ( !details )
+    {
+        LIBMTP_mtpdevice_t *device = cachedDevice->getDevice();
+        if ( !device )
+            return;
+
+        details = new MediaDetails ( getMediaDetails ( device, id, filetype ) );
+        getEntry ( entry, *details );
+
+        // may delete it right away if the cache can't take it
+        mediaDetails.insert ( key, details );
+        return;
+    }
+
+    getEntry ( entry, *details );
+}
+
+/**
+ * @brief Get's the correct object from the device.
+ * @param pathItems A QStringList containing the items of the filepath
+ * @return QPair with the object and its device. pair.first is a nullpointer if the object doesn't exist or for root or, depending on the pathItems size device (1), storage (2) or file (>=3)
+ */
+QPair<void*, LIBMTP_mtpdevice_t*> MTPSlave::getPath ( const QString& path )
+{
+    TraceSpan span ( "getPath", "kio", path );
+
+    QStringList pathItems = path.split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+    kDebug ( KIO_MTP ) << path << pathItems.size();
+
+    QPair<void*, LIBMTP_mtpdevice_t*> ret;
+
+    // Don' handle the root directory
+    if ( pathItems.size() <= 0 )
+    {
+        return ret;
+    }
+
+    if ( deviceCache->contains( pathItems.at ( 0 ) ) )
+    {
+        CachedDevice *cachedDevice = deviceCache->get ( pathItems.at ( 0 ) );
+        LIBMTP_mtpdevice_t *device = cachedDevice->getDevice();
+        if ( !device )
+        {
+            return ret;
+        }
+
+        // return specific device
+        if ( pathItems.size() == 1 )
+        {
+            ret.first = device;
+            ret.second = device;
+
+            kDebug(KIO_MTP) << "returning LIBMTP_mtpdevice_t";
+        }
+
+        if ( pathItems.size() > 2 )
+        {
+            // Query Cache after we have the device
+            uint32_t c_fileID = fileCache->queryPath ( path );
+            if ( c_fileID != 0 )
+            {
+                kDebug() << "Match found in cache, checking device";
+
+                LIBMTP_file_t* file = objectPool.adopt ( mtpGetFilemetadata ( device, c_fileID ) );
+                if ( file )
+                {
+                    kDebug ( KIO_MTP ) << "Found file in cache";
+                    ret.first = file;
+                    ret.second = device;
+
+                    kDebug(KIO_MTP) << "returning LIBMTP_file_t from cache";
+
+                    return ret;
+                }
+            }
+            // Query cache for parent
+            else if ( pathItems.size() > 3 )
+            {
+                QString parentPath = convertToPath ( pathItems, pathItems.size() - 1 );
+                uint32_t c_parentID = fileCache->queryPath ( parentPath );
+
+                kDebug() << "Match for parent found in cache, checking device. Parent id = " << c_parentID;
+
+                LIBMTP_file_t* parent = objectPool.adopt ( mtpGetFilemetadata ( device, c_parentID ) );
+                if ( parent )
+                {
+                    kDebug ( KIO_MTP ) << "Found parent in cache";
+//                     fileCache->addPath( parentPath, c_parentID );
+
+                    FileListing files = getFiles ( cachedDevice, device, parent->storage_id, c_parentID );
+
+                    int index = files.indexOf ( pathItems.last() );
+                    if ( index >= 0 )
+                    {
+                        ret.first = objectPool.adopt ( files.toFile ( index ) );
+                        ret.second = device;
+
+                        kDebug(KIO_MTP) << "returning LIBMTP_file_t from cached parent" ;
+
+                        fileCache->addPath( path, files.itemId ( index ) );
+                    }
+
+                    return ret;
+                }
+            }
+        }
+
+        QMap<QString, LIBMTP_devicestorage_t*> storages = getDevicestorages ( device );
+
+        if ( pathItems.size() > 1 && storages.contains ( pathItems.at ( 1 ) ) )
+        {
+            LIBMTP_devicestorage_t *storage = storages.value ( pathItems.at ( 1 ) );
+
+            if ( pathItems.size() == 2 )
+            {
+                ret.first = storage;
+                ret.second = device;
+
+                kDebug(KIO_MTP) << "returning LIBMTP_devicestorage_t";
+
+                return ret;
+            }
+
+            // the storage is gone with the session if it has to be reopened
+            const uint32_t storageId = storage->id;
+
+            int currentLevel = 2, currentParent = 0xFFFFFFFF, index = -1;
+
+            FileListing files;
+
+            // traverse further while depth not reached
+            while ( currentLevel < pathItems.size() )
+            {
+                files = getFiles ( cachedDevice, device, storageId, currentParent );
+                index = files.indexOf ( pathItems.at ( currentLevel ) );
+
+                if ( index >= 0 )
+                {
+                    currentParent = files.itemId ( index );
+                }
+                else
+                {
+
+                    kDebug(KIO_MTP) << "returning LIBMTP_file_t using tree walk";
+
+                    return ret;
+                }
+                currentLevel++;
+            }
+
+            // the last listing already holds everything about the item
+            ret.first = objectPool.adopt ( files.toFile ( index ) );
+            ret.second = device;
+
+            fileCache->addPath ( path, currentParent );
+        }
+    }
+
+    return ret;
+}
+
+int MTPSlave::checkUrl ( const KUrl& url, bool redirect )
+{
+    kDebug ( KIO_MTP ) << url;
+
+    if ( url.path().startsWith ( QLatin1String ( "udi=" ) ) && redirect )
+    {
+        QString udi = url.path( KUrl::RemoveTrailingSlash ).remove ( 0, 4 );
+
+        kDebug ( KIO_MTP ) << "udi = " << udi;
+
+        if ( deviceCache->contains( udi, true ) )
+        {
+            KUrl newUrl;
+            newUrl.setProtocol ( QLatin1String ( "mtp" ) );
+            newUrl.setPath ( QLatin1Char ( '/' ) + deviceCache->get( udi, true )->getName() );
+            redirection ( newUrl );
+            
+            return 1;
+        }
+        else
+        {
+            return 2;
+        }
+    }
+    else if ( url.path().startsWith(QLatin1Char ( '/' ) ) )
+    {
+        return 0;
+    }
+    return -1;
+}
+
+void MTPSlave::listDir ( const KUrl& url )
+{
+    TraceSpan span ( "listDir", "kio", url.path() );
+    CommandScope commandScope ( this );
+
+    kDebug ( KIO_MTP ) << url.path();
+
+    int check = checkUrl( url );
+    switch ( check )
+    {
+        case 0:
+            break;
+        case 1:
+            finished();
+            return;
+        case 2:
+            error( ERR_DOES_NOT_EXIST, url.path() );
+            return;
+        default:
+            error( ERR_MALFORMED_URL, url.path() );
+            return;
+    }
+
+    QStringList pathItems = url.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+    UDSEntry entry;
+
+    // list devices
+    if ( pathItems.size() == 0 )
+    {
+        kDebug ( KIO_MTP ) << "Root directory, listing devices";
+        totalSize ( deviceCache->size() );
+
+        foreach ( CachedDevice* cachedDevice, deviceCache->getAll().values() )
+        {
+            // the user is likely to open one of them next
+            cachedDevice->warmUp();
+
+            getEntry ( entry, cachedDevice );
+
+            listEntry ( entry, false );
+            entry.clear();
+        }
+
+        listEntry ( entry, true );
+
+        kDebug ( KIO_MTP ) << "[SUCCESS] :: Devices";
+        finished();
+    }
+    // traverse into device
+    else if ( deviceCache->contains ( pathItems.at ( 0 ) ) )
+    {
+        QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.path() );
+        UDSEntry entry;
+        
+        if ( pair.first )
+        {
+            LIBMTP_mtpdevice_t *device = pair.second;
+
+            // Device, list storages
+            if ( pathItems.size() == 1 )
+            {
+                QMap<QString, LIBMTP_devicestorage_t*> storages = getDevicestorages ( device );
+                
+                kDebug ( KIO_MTP ) << "Listing storages for device " << pathItems.at ( 0 );
+                totalSize ( storages.size() );
+
+                if ( storages.size() > 0 )
+                {
+                    foreach ( const QString &storageName, storages.keys() )
+                    {
+                        getEntry ( entry, storages.value ( storageName ) );
+
+                        listEntry ( entry, false );
+                        entry.clear();
+                    }
+
+                    listEntry ( entry, true );
+                    finished();
+                    kDebug ( KIO_MTP ) << "[SUCCESS] :: Storages";
+                }
+                else
+                {
+                    warning( i18n("No Storages found. Maybe you need to unlock your device?") );
+                }
+            }
+            // Storage, list files and folders of storage root
+            else
+            {
+                FileListing files;
+                
+                if ( pathItems.size() == 2 )
+                {
+                    kDebug(KIO_MTP) << "Getting storage root listing";
+                    
+                    LIBMTP_devicestorage_t *storage = (LIBMTP_devicestorage_t*)pair.first;
+                    
+                    kDebug(KIO_MTP) << "We have a storage:" << (storage == NULL);
+                    
+                    files = getFiles( deviceCache->get ( pathItems.at ( 0 ) ), device, storage->id );
+                }
+                else
+                {
+                    LIBMTP_file_t *parent = (LIBMTP_file_t*)pair.first;
+                    
+                    files = getFiles( deviceCache->get ( pathItems.at ( 0 ) ), device, parent->storage_id, parent->item_id );
+                }
+                
+                totalSize ( files.size() );
+
+                const QString dirPath = url.path( KUrl::AddTrailingSlash );
+                CachedDevice *cachedDevice = deviceCache->get ( pathItems.at ( 0 ) );
+
+                for ( int i = 0; i < files.size(); i++ )
+                {
+                    getEntry ( entry, files, i );
+                    addMediaDetails ( entry, cachedDevice, files.itemId ( i ), files.filetype ( i ), files.fileSize ( i ),
+                                      files.modificationDate ( i ) );
+                    
+                    fileCache->addPath( dirPath + entry.stringValue ( UDSEntry::UDS_NAME ), files.itemId ( i ) );
+                    
+                    listEntry ( entry, false );
+                    entry.clear();
+                }
+                
+                listEntry ( entry, true );
+                finished();
+                
+                kDebug ( KIO_MTP ) << "[SUCCESS] Files";
+            }
+        }
+        else
+        {
+            error ( ERR_CANNOT_ENTER_DIRECTORY, url.path() );
+            kDebug ( KIO_MTP ) << "[ERROR]";
+        }
+    }
+    else
+    {
+        error ( ERR_CANNOT_ENTER_DIRECTORY, url.path() );
+        kDebug ( KIO_MTP ) << "[ERROR]";
+    }
+}
+
+void MTPSlave::stat ( const KUrl& url )
+{
+    TraceSpan span ( "stat", "kio", url.path() );
+    CommandScope commandScope ( this );
+
+    kDebug ( KIO_MTP ) << url.path();
+
+    int check = checkUrl( url );
+    switch ( check )
+    {
+        case 0:
+            break;
+        case 1:
+            finished();
+            return;
+        case 2:
+            error( ERR_DOES_NOT_EXIST, url.path() );
+            return;
+        default:
+            error( ERR_MALFORMED_URL, url.path() );
+            return;
+    }
+
+    QStringList pathItems = url.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+    UDSEntry entry;
+
+    // Device, known without opening it
+    if ( pathItems.size() == 1 && deviceCache->contains ( pathItems.at ( 0 ) ) )
+    {
+        CachedDevice *cachedDevice = deviceCache->get ( pathItems.at ( 0 ) );
+        cachedDevice->warmUp();
+
+        getEntry ( entry, cachedDevice );
+
+        statEntry ( entry );
+        finished();
+        return;
+    }
+
+    QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.path() );
+
+    if ( pair.first )
+    {
+        // Root
+        if ( pathItems.size() < 1 )
+        {
+            entry.insert ( UDSEntry::UDS_NAME, QLatin1String ( "mtp:///" ) );
+            entry.insert ( UDSEntry::UDS_FILE_TYPE, S_IFDIR );
+            entry.insert ( UDSEntry::UDS_ACCESS, S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR | S_IXGRP | S_IXOTH );
+            entry.insert ( UDSEntry::UDS_MIME_TYPE, QLatin1String ( "inode/directory" ) );
+        }
+        // Storage
+        else if ( pathItems.size() < 3 )
+        {
+            getEntry ( entry, ( LIBMTP_devicestorage_t* ) pair.first );
+        }
+        // Folder/File
+        else
+        {
+            const LIBMTP_file_t *file = ( LIBMTP_file_t* ) pair.first;
+
+            getEntry ( entry, file );
+            addMediaDetails ( entry, deviceCache->get ( pathItems.at ( 0 ) ), file->item_id, file->filetype, file->filesize,
+                              file->modificationdate );
+        }
+    }
+    statEntry ( entry );
+    finished();
+}
+
+void MTPSlave::mimetype ( const KUrl& url )
+{
+    TraceSpan span ( "mimetype", "kio", url.path() );
+    CommandScope commandScope ( this );
+
+    int check = checkUrl( url );
+    switch ( check )
+    {
+        case 0:
+            break;
+        case 1:
+            finished();
+            return;
+        case 2:
+            error( ERR_DOES_NOT_EXIST, url.path() );
+            return;
+        default:
+            error( ERR_MALFORMED_URL, url.path() );
+            return;
+    }
+
+    kDebug ( KIO_MTP ) << url.path();
+
+    QStringList pathItems = url.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+    QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.path() );
+
+    if ( pair.first )
+    {
+        if ( pathItems.size() > 2 )
+            mimetype ( sniffMimetype ( deviceCache->get ( pathItems.at ( 0 ) ), ( LIBMTP_file_t* ) pair.first ) );
+        else
+            mimetype ( QString::fromLatin1 ( "inode/directory" ) );
+    }
+    else
+    {
+        error ( ERR_DOES_NOT_EXIST, url.path() );
+        return;
+    }
+}
+
+void MTPSlave::put ( const KUrl& url, int, JobFlags flags )
+{
+    TraceSpan span ( "put", "kio", url.path() );
+    CommandScope commandScope ( this );
+    storageTrees.clear();
+
+    int check = checkUrl( url );
+    switch ( check )
+    {
+        case 0:
+            break;
+        default:
+            error( ERR_MALFORMED_URL, url.path() );
+            return;
+    }
+
+    kDebug ( KIO_MTP ) << url.path();
+
+    QStringList destItems = url.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+    // Can't copy to root or device, needs storage
+    if ( destItems.size() < 2 )
+    {
+        error ( ERR_UNSUPPORTED_ACTION, url.path() );
+        return;
+    }
+
+    LIBMTP_file_t *existing = ( LIBMTP_file_t* ) getPath( url.path() ).first;
+
+    // only size and date can be compared, the data is still with the application
+    if ( existing && existing->filetype != LIBMTP_FILETYPE_FOLDER && config()->readEntry ( "SkipIdentical", false )
+         && hasMetaData ( QLatin1String ( "sourceSize" ) ) && hasMetaData ( QLatin1String ( "modified" ) ) )
+    {
+        const uint64_t size = metaData ( QLatin1String ( "sourceSize" ) ).toULongLong();
+        const QDateTime modified = QDateTime::fromString ( metaData ( QLatin1String ( "modified" ) ), Qt::ISODate );
+
+        if ( existing->filesize == size && modified.isValid() && existing->modificationdate == ( time_t ) modified.toTime_t() )
+        {
+            kDebug ( KIO_MTP ) << "Skipping identical" << url.path();
+
+            processedSize ( size );
+            finished();
+            return;
+        }
+    }
+
+    if ( !(flags & ( KIO::Overwrite | KIO::Resume )) && existing )
+    {
+        error( ERR_FILE_ALREADY_EXIST, url.path() );
+        return;
+    }
+
+    destItems.takeLast();
+
+    QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.directory() );
+
+    uint32_t parent_id = 0xFFFFFFFF, storage_id = 0;
+
+    if ( !pair.first )
+    {
+        // create the missing folders
+        parent_id = makePath ( url.directory(), storage_id );
+        if ( parent_id == 0 )
+        {
+            error ( ERR_COULD_NOT_MKDIR, url.directory() );
+            return;
+        }
+    }
+    else if ( destItems.size() == 2 )
+    {
+        storage_id = ( ( LIBMTP_devicestorage_t* ) pair.first )->id;
+    }
+    else
+    {
+        LIBMTP_file_t *parent = ( LIBMTP_file_t* ) pair.first;
+        if ( parent->filetype != LIBMTP_FILETYPE_FOLDER )
+        {
+            error ( ERR_IS_FILE, url.directory() );
+            return;
+        }
+
+        storage_id = parent->storage_id;
+        parent_id = parent->item_id;
+    }
+
+    CachedDevice *cachedDevice = deviceCache->get ( destItems.at ( 0 ) );
+
+    // upload into name.part unless disabled, an interrupted upload can be continued from there
+    const bool markPartial = config()->readEntry ( "MarkPartial", true );
+    const QString uploadName = markPartial ? url.fileName() + QLatin1String ( ".part" ) : url.fileName();
+
+    LIBMTP_file_t *partial = 0;
+    if ( markPartial )
+        partial = ( LIBMTP_file_t* ) getPath ( url.path() + QLatin1String ( ".part" ) ).first;
+    else if ( flags & KIO::Resume )
+        partial = existing;
+
+    // after the lookups, they may have reopened the session
+    LIBMTP_mtpdevice_t *device = cachedDevice->getDevice();
+
+    const uint64_t sourceSize = metaData ( QLatin1String ( "sourceSize" ) ).toULongLong();
+
+    JobData source ( this );
+    uint32_t uploadedId = 0;
+    int ret = 0;
+
+    // name.part only grows with what the device received, see sendFile()
+    const bool resumable = markPartial && canAppend ( cachedDevice );
+
+    if ( partial && partial->filetype != LIBMTP_FILETYPE_FOLDER && partial->filesize > 0 && partial->filesize < sourceSize
+         && canAppend ( cachedDevice ) && canResume ( partial->filesize ) )
+    {
+        kDebug ( KIO_MTP ) << "Resuming upload at" << partial->filesize;
+
+        if ( !cachedDevice->reserveSpace ( storage_id, sourceSize - partial->filesize, 0 ) )
+        {
+            error ( ERR_DISK_FULL, url.path() );
+            return;
+        }
+
+        uploadedId = partial->item_id;
+
+        TransferScheduler scheduler ( cachedDevice );
+        ret = scheduler.upload ( partial->item_id, partial->filesize, sourceSize, &dataGet, &source, &dataProgress, this );
+
+        device = cachedDevice->getDevice();
+    }
+    else
+    {
+        // a leftover the application can't continue
+        if ( partial && markPartial )
+            mtpDeleteObject ( device, partial->item_id );
+
+        MTPFilePointer file ( LIBMTP_new_file_t() );
+        file->parent_id = parent_id;
+        file->filename = strdup ( uploadName.toUtf8().data() );
+        file->filetype = getFiletype ( url.fileName() );
+        file->modificationdate = QDateTime::currentDateTime().toTime_t();
+        file->storage_id = storage_id;
+
+        // We did get a total size from the application
+        if ( hasMetaData ( QLatin1String ( "sourceSize" ) ) )
+        {
+            kDebug ( KIO_MTP ) << "direct put";
+
+            file->filesize = sourceSize;
+
+            // fail before any data is sent
+            if ( !cachedDevice->reserveSpace ( storage_id, sourceSize ) )
+            {
+                error ( ERR_DISK_FULL, url.path() );
+                return;
+            }
+
+            kDebug ( KIO_MTP ) << "Sending file" << file->filename;
+
+            HashingData hashing ( &dataGet, &source );
+
+            ret = sendFile ( cachedDevice, device, file.data(), resumable, &hashData, &hashing );
+
+            if ( ret == 0 )
+                reportHash ( deviceKey ( cachedDevice ), file->item_id, file->filesize, file->modificationdate, hashing.hash.result() );
+        }
+        // We need to get the entire file first, then we can upload
+        else
+        {
+            kDebug ( KIO_MTP ) << "use temp file";
+
+            KTemporaryFile temp;
+            temp.open();
+
+            QByteArray buffer;
+            ContentHash hash;
+            int len = 0;
+
+            do
+            {
+                TraceSpan span ( "dataReq", "data" );
+
+                dataReq();
+                len = readData ( buffer );
+                temp.write ( buffer );
+                hash.update ( buffer.constData(), buffer.size() );
+            }
+            while ( len > 0 );
+
+            // libmtp reads from the current position of the descriptor
+            temp.flush();
+            lseek ( temp.handle(), 0, SEEK_SET );
+
+            file->filesize = temp.size();
+
+            if ( !cachedDevice->reserveSpace ( storage_id, file->filesize ) )
+            {
+                error ( ERR_DISK_FULL, url.path() );
+                return;
+            }
+
+            if ( resumable )
+            {
+                LocalFile input ( temp.fileName() );
+                ret = input.openForReading() ? sendFile ( cachedDevice, device, file.data(), true, &dataRead, &input ) : -1;
+            }
+            else
+            {
+                ret = mtpSendFileFromFileDescriptor ( device, temp.handle(), file.data(), &dataProgress, this );
+            }
+
+            if ( ret == 0 )
+                reportHash ( deviceKey ( cachedDevice ), file->item_id, file->filesize, file->modificationdate, hash.result() );
+        }
+
+        uploadedId = file->item_id;
+    }
+
+    if ( ret != 0 )
+    {
+        error ( KIO::ERR_COULD_NOT_WRITE, url.fileName() );
+
+        // leave a working session behind, name.part can be resumed in it
+        if ( cachedDevice->recover ( device ) )
+        {
+            device = cachedDevice->getDevice();
+        }
+        else if ( device )
+        {
+            LIBMTP_Dump_Errorstack ( device );
+            LIBMTP_Clear_Errorstack ( device );
+        }
+
+        if ( !markPartial && !( partial && uploadedId == partial->item_id ) )
+            discardUpload ( device, uploadedId, url.path() );
+        return;
+    }
+
+    if ( markPartial && !finishPartial ( device, uploadedId, existing, url ) )
+    {
+        error ( KIO::ERR_CANNOT_RENAME_PARTIAL, url.path() );
+        return;
+    }
+
+    finished();
+}
+
+void MTPSlave::get ( const KUrl& url )
+{
+    TraceSpan span ( "get", "kio", url.path() );
+    CommandScope commandScope ( this );
+
+    int check = checkUrl( url );
+    switch ( check )
+    {
+        case 0:
+            break;
+        default:
+            error( ERR_MALFORMED_URL, url.path() );
+            return;
+    }
+
+    kDebug ( KIO_MTP ) << url.path();
+
+    QStringList pathItems = url.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+    // File
+    if ( pathItems.size() > 2 )
+    {
+        QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.path() );
+
+        if ( pair.first )
+        {
+            LIBMTP_file_t *file = ( LIBMTP_file_t* ) pair.first;
+
+            mimeType ( getMimetype ( QString::fromUtf8 ( file->filename ), file->filetype ) );
+            totalSize ( file->filesize );
+
+            CachedDevice *cachedDevice = deviceCache->get ( pathItems.at ( 0 ) );
+            const QString key = deviceKey ( cachedDevice );
+
+            // the job already has the first bytes, i.e. from an interrupted download
+            uint64_t offset = metaData ( QLatin1String ( "resume" ) ).toULongLong();
+            if ( offset > 0 && offset < file->filesize && cachedDevice->getProfile().hasCapability ( LIBMTP_DEVICECAP_GetPartialObject ) )
+            {
+                kDebug ( KIO_MTP ) << "Resuming download at" << offset;
+
+                canResume();
+            }
+            else
+            {
+                offset = 0;
+            }
+
+            const QString cached = contentCache.lookup ( key, file->item_id, file->filesize, file->modificationdate );
+            if ( !cached.isEmpty() && sendCachedContent ( cached, offset ) )
+                return;
+
+            // hands the device over to browsing slaves between chunks
+            TransferScheduler scheduler ( cachedDevice );
+
+            // keep a copy of complete downloads for the next time
+            LocalFile copy ( contentCache.temporaryPath ( key, file->item_id ) );
+            const bool caching = offset == 0 && contentCache.accepts ( file->filesize ) && copy.openForWriting ( 0, file->filesize );
+
+            TeeData tee ( &dataPut, this, caching ? &copy : 0 );
+            HashingData hashing ( &teeData, &tee );
+
+            int ret = scheduler.download ( file->item_id, offset, file->filesize, &hashData, &hashing, &dataProgress, this );
+
+            if ( caching )
+            {
+                if ( copy.close() && tee.copy && ret == 0 )
+                    contentCache.insert ( key, file->item_id, file->filesize, file->modificationdate, copy.path() );
+                else
+                    QFile::remove ( copy.path() );
+            }
+
+            if ( ret != 0 )
+            {
+                error ( ERR_COULD_NOT_READ, url.path() );
+                return;
+            }
+
+            // a resumed download only saw the rest of the file
+            if ( offset == 0 )
+                reportHash ( key, file->item_id, file->filesize, file->modificationdate, hashing.hash.result() );
+
+            data ( QByteArray() );
+            finished();
+        }
+        else
+            error ( ERR_DOES_NOT_EXIST, url.path() );
+    }
+    else
+        error ( ERR_UNSUPPORTED_ACTION, url.path() );
+}
+
+void MTPSlave::copy ( const KUrl& src, const KUrl& dest, int, JobFlags flags )
+{
+    TraceSpan span ( "copy", "kio", src.url() + QLatin1String ( " -> " ) + dest.url() );
+    CommandScope commandScope ( this );
+
+    kDebug ( KIO_MTP ) << src.path() << dest.path();
+
+    // mtp:/// to mtp:///
+    if ( src.protocol() == QLatin1String ( "mtp" ) && dest.protocol() == QLatin1String ( "mtp" ) )
     {
         kDebug ( KIO_MTP ) << "Copy on device: Not supported";
         // MTP doesn't support moving files directly on the device, so we have to download and then upload...
@@ -652,6 +1548,8 @@ void MTPSlave::copy ( const KUrl& src, const KUrl& dest, int, JobFlags flags )
     // file:/// tp mtp:///
     if ( src.protocol() == QLatin1String ( "file" ) && dest.protocol() == QLatin1String ( "mtp" ) )
     {
+        storageTrees.clear();
+
         int check = checkUrl( dest );
         switch ( check )
         {
@@ -662,153 +1560,556 @@ void MTPSlave::copy ( const KUrl& src, const KUrl& dest, int, JobFlags flags )
                 return;
         }
 
-        QStringList destItems = dest.path().split ( QLatin1Char ( '/') , QString::SkipEmptyParts );
+        QStringList destItems = dest.path().split ( QLatin1Char ( '/') , QString::SkipEmptyParts );
+
+        // Can't copy to root or device, needs storage
+        if ( destItems.size() < 2 )
+        {
+            error ( ERR_UNSUPPORTED_ACTION, dest.path() );
+            return;
+        }
+
+        kDebug ( KIO_MTP ) << "Copy file " << src.fileName() << "from filesystem to device" << src.directory ( KUrl::AppendTrailingSlash ) << dest.directory ( KUrl::AppendTrailingSlash );
+
+        LIBMTP_file_t *existing = ( LIBMTP_file_t* ) getPath( dest.path() ).first;
+
+        if ( existing && existing->filetype != LIBMTP_FILETYPE_FOLDER && config()->readEntry ( "SkipIdentical", false )
+             && isIdentical ( destItems.at ( 0 ), existing->item_id, existing->filesize, existing->modificationdate, QFileInfo ( src.path() ) ) )
+        {
+            kDebug ( KIO_MTP ) << "Skipping identical" << dest.path();
+
+            totalSize ( existing->filesize );
+            processedSize ( existing->filesize );
+            finished();
+            return;
+        }
+
+        if ( !(flags & ( KIO::Overwrite | KIO::Resume )) && existing )
+        {
+            error( ERR_FILE_ALREADY_EXIST, dest.path() );
+            return;
+        }
+
+        destItems.takeLast();
+
+        QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( dest.directory() );
+
+        uint32_t parent_id = 0xFFFFFFFF, storage_id = 0;
+
+        if ( !pair.first )
+        {
+            // create the missing folders
+            parent_id = makePath ( dest.directory(), storage_id );
+            if ( parent_id == 0 )
+            {
+                error ( ERR_COULD_NOT_MKDIR, dest.directory() );
+                return;
+            }
+        }
+        else if ( destItems.size() == 2 )
+        {
+            LIBMTP_devicestorage_t *storage = ( LIBMTP_devicestorage_t*) pair.first;
+
+            storage_id = storage->id;
+        }
+        else
+        {
+            LIBMTP_file_t *parent = ( LIBMTP_file_t* ) pair.first;
+
+            storage_id = parent->storage_id;
+            parent_id = parent->item_id;
+
+            if ( parent->filetype != LIBMTP_FILETYPE_FOLDER )
+            {
+                error ( ERR_IS_FILE, dest.directory() );
+                return;
+            }
+        }
+
+        QFileInfo source ( src.path() );
+
+        totalSize ( source.size() );
+
+        CachedDevice *cachedDevice = deviceCache->get ( destItems.at ( 0 ) );
+
+        // upload into name.part unless disabled, an interrupted upload can be continued from there
+        const bool markPartial = config()->readEntry ( "MarkPartial", true );
+        const QString uploadName = markPartial ? dest.fileName() + QLatin1String ( ".part" ) : dest.fileName();
+
+        LIBMTP_file_t *partial = 0;
+        if ( markPartial )
+            partial = ( LIBMTP_file_t* ) getPath ( dest.path() + QLatin1String ( ".part" ) ).first;
+        else if ( flags & KIO::Resume )
+            partial = existing;
+
+        // after the lookups, they may have reopened the session
+        LIBMTP_mtpdevice_t *device = cachedDevice->getDevice();
+
+        uint32_t uploadedId = 0;
+        int ret = 0;
+
+        // name.part only grows with what the device received, see sendFile()
+        const bool resumable = markPartial && canAppend ( cachedDevice );
+
+        // name.part carries the date of its source, a leftover of another file must not be continued
+        if ( partial && partial->filetype != LIBMTP_FILETYPE_FOLDER && partial->filesize > 0
+             && partial->filesize < ( uint64_t ) source.size() && partial->modificationdate == ( time_t ) source.lastModified().toTime_t()
+             && canAppend ( cachedDevice ) && canResume ( partial->filesize ) )
+        {
+            kDebug ( KIO_MTP ) << "Resuming upload at" << partial->filesize;
+
+            LocalFile input ( src.path() );
+            if ( !input.openForReading ( partial->filesize ) )
+            {
+                error ( KIO::ERR_CANNOT_OPEN_FOR_READING, src.path() );
+                return;
+            }
+
+            if ( !cachedDevice->reserveSpace ( storage_id, source.size() - partial->filesize, 0 ) )
+            {
+                error ( ERR_DISK_FULL, dest.path() );
+                return;
+            }
+
+            processedSize ( partial->filesize );
+
+            uploadedId = partial->item_id;
+
+            TransferScheduler scheduler ( cachedDevice );
+            ret = scheduler.upload ( partial->item_id, partial->filesize, source.size(), &dataRead, &input, ( LIBMTP_progressfunc_t ) &dataProgress, this );
+
+            device = cachedDevice->getDevice();
+        }
+        else
+        {
+            // a leftover we can't continue
+            if ( partial && markPartial )
+                mtpDeleteObject ( device, partial->item_id );
+
+            MTPFilePointer file ( LIBMTP_new_file_t() );
+            file->parent_id = parent_id;
+            file->filename = strdup ( uploadName.toUtf8().data() );
+            file->filetype = getFiletype ( dest.fileName() );
+            file->filesize = source.size();
+            file->modificationdate = source.lastModified().toTime_t();
+            file->storage_id = storage_id;
+
+            // fail before any data is sent
+            if ( !cachedDevice->reserveSpace ( storage_id, file->filesize ) )
+            {
+                error ( ERR_DISK_FULL, dest.path() );
+                return;
+            }
+
+            kDebug ( KIO_MTP ) << "Sending file" << file->filename << "with size" << file->filesize;
+
+            // read it ourselves to hash it on the way
+            LocalFile input ( src.path() );
+            if ( !input.openForReading() )
+            {
+                error ( KIO::ERR_CANNOT_OPEN_FOR_READING, src.path() );
+                return;
+            }
+
+            HashingData hashing ( &dataRead, &input );
+
+            ret = sendFile ( cachedDevice, device, file.data(), resumable, &hashData, &hashing );
+
+            uploadedId = file->item_id;
+
+            if ( ret == 0 )
+                reportHash ( deviceKey ( cachedDevice ), uploadedId, file->filesize, file->modificationdate, hashing.hash.result() );
+        }
+
+        if ( ret != 0 )
+        {
+            error ( KIO::ERR_COULD_NOT_WRITE, dest.fileName() );
+
+            // leave a working session behind, name.part can be resumed in it
+            if ( cachedDevice->recover ( device ) )
+            {
+                device = cachedDevice->getDevice();
+            }
+            else if ( device )
+            {
+                LIBMTP_Dump_Errorstack ( device );
+                LIBMTP_Clear_Errorstack ( device );
+            }
+
+            if ( !markPartial && !( partial && uploadedId == partial->item_id ) )
+                discardUpload ( device, uploadedId, dest.path() );
+            return;
+        }
+
+        if ( markPartial && !finishPartial ( device, uploadedId, existing, dest ) )
+        {
+            error ( KIO::ERR_CANNOT_RENAME_PARTIAL, dest.path() );
+            return;
+        }
+
+        kDebug ( KIO_MTP ) << "Sent file";
+    }
+    // mtp:/// to file:///
+    if ( src.protocol() == QLatin1String ( "mtp" ) && dest.protocol() == QLatin1String ( "file" ) )
+    {
+        int check = checkUrl( src );
+        switch ( check )
+        {
+            case 0:
+                break;
+            default:
+                error( ERR_MALFORMED_URL, src.path() );
+                return;
+        }
+
+        kDebug ( KIO_MTP ) << "Copy file " << src.fileName() << "from device to filesystem" << dest.directory ( KUrl::AppendTrailingSlash ) << dest.directory ( KUrl::AppendTrailingSlash );
+
+        QFileInfo destination ( dest.path() );
+
+        if ( !(flags & ( KIO::Overwrite | KIO::Resume )) && destination.exists() )
+        {
+            error( ERR_FILE_ALREADY_EXIST, dest.path() );
+            return;
+        }
+
+        QStringList srcItems = src.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+        // Can't copy to root or device, needs storage
+        if ( srcItems.size() < 2 )
+        {
+            error ( ERR_UNSUPPORTED_ACTION, src.path() );
+            return;
+        }
+
+        QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( src.path() );
+
+        LIBMTP_file_t *source = ( LIBMTP_file_t* ) pair.first;
+        if ( !source )
+        {
+            error ( ERR_DOES_NOT_EXIST, src.path() );
+            return;
+        }
+        if ( source->filetype == LIBMTP_FILETYPE_FOLDER )
+        {
+            error ( ERR_IS_DIRECTORY, src.directory() );
+            return;
+        }
+
+        kDebug ( KIO_MTP ) << "Getting file" << source->filename << dest.fileName() << source->filesize;
+
+        totalSize ( source->filesize );
+
+        CachedDevice *cachedDevice = deviceCache->get ( srcItems.at ( 0 ) );
+
+        // download into name.part unless disabled, like kio_file does
+        const bool markPartial = config()->readEntry ( "MarkPartial", true );
+        const QString partPath = markPartial ? dest.path() + QLatin1String ( ".part" ) : dest.path();
+
+        uint64_t offset = 0;
+
+        QFileInfo partial ( partPath );
+        if ( partial.exists() && ( markPartial || ( flags & KIO::Resume ) ) && ( uint64_t ) partial.size() < source->filesize
+             && cachedDevice->getProfile().hasCapability ( LIBMTP_DEVICECAP_GetPartialObject ) )
+        {
+            // interrupted downloads carry the modification date of their object
+            if ( ( flags & KIO::Resume ) || partial.lastModified().toTime_t() == ( uint ) source->modificationdate )
+            {
+                offset = partial.size();
+
+                kDebug ( KIO_MTP ) << "Resuming download at" << offset;
+            }
+        }
+
+        LocalFile output ( partPath );
+        if ( !output.openForWriting ( offset, source->filesize ) )
+        {
+            error ( errno == ENOSPC ? KIO::ERR_DISK_FULL : KIO::ERR_CANNOT_OPEN_FOR_WRITING, partPath );
+            return;
+        }
+
+        processedSize ( offset );
+
+        TransferScheduler scheduler ( cachedDevice );
+
+        HashingData hashing ( &dataWrite, &output );
+
+        int ret = scheduler.download ( source->item_id, offset, source->filesize, &hashData, &hashing, ( LIBMTP_progressfunc_t ) &dataProgress, this );
+
+        // a failed download into name.part is marked as resumable this way
+        if ( ret == 0 || markPartial )
+            output.setModificationTime ( source->modificationdate );
+
+        if ( !output.close() && ret == 0 )
+            ret = -1;
+
+        if ( ret != 0 )
+        {
+            error ( KIO::ERR_COULD_NOT_WRITE, dest.fileName() );
+            return;
+        }
+
+        if ( markPartial )
+        {
+            if ( destination.exists() )
+                QFile::remove ( dest.path() );
+
+            if ( !QFile::rename ( partPath, dest.path() ) )
+            {
+                error ( KIO::ERR_CANNOT_RENAME_PARTIAL, dest.path() );
+                return;
+            }
+        }
+
+        if ( offset == 0 )
+            reportHash ( deviceKey ( cachedDevice ), source->item_id, source->filesize, source->modificationdate, hashing.hash.result() );
+
+        kDebug ( KIO_MTP ) << "Sent file";
+
+    }
+    finished();
+}
+
+LIBMTP_mtpdevice_t* MTPSlave::openFileDevice ( bool edit )
+{
+    CachedDevice *cachedDevice = deviceCache->get ( openFile.device );
+    if ( !cachedDevice )
+        return 0;
+
+    LIBMTP_mtpdevice_t *device = cachedDevice->getDevice();
+    if ( !device )
+        return 0;
+
+    if ( edit && !openFile.editing )
+    {
+        if ( !canAppend ( cachedDevice ) || mtpBeginEditObject ( device, openFile.id ) != 0 )
+            return 0;
+
+        openFile.editing = true;
+    }
+
+    return device;
+}
+
+void MTPSlave::open ( const KUrl& url, QIODevice::OpenMode mode )
+{
+    TraceSpan span ( "open", "kio", url.path() );
+    CommandScope commandScope ( this );
+
+    int check = checkUrl( url );
+    switch ( check )
+    {
+        case 0:
+            break;
+        default:
+            error( ERR_MALFORMED_URL, url.path() );
+            return;
+    }
+
+    QStringList pathItems = url.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+    // Only files can be opened
+    if ( pathItems.size() < 3 )
+    {
+        error ( ERR_IS_DIRECTORY, url.path() );
+        return;
+    }
+
+    if ( mode & QIODevice::WriteOnly )
+        storageTrees.clear();
 
-        // Can't copy to root or device, needs storage
-        if ( destItems.size() < 2 )
-        {
-            error ( ERR_UNSUPPORTED_ACTION, dest.path() );
-            return;
-        }
+    LIBMTP_file_t *file = ( LIBMTP_file_t* ) getPath ( url.path() ).first;
+    if ( !file )
+    {
+        error ( ERR_DOES_NOT_EXIST, url.path() );
+        return;
+    }
+    if ( file->filetype == LIBMTP_FILETYPE_FOLDER )
+    {
+        error ( ERR_IS_DIRECTORY, url.path() );
+        return;
+    }
 
-        kDebug ( KIO_MTP ) << "Copy file " << src.fileName() << "from filesystem to device" << src.directory ( KUrl::AppendTrailingSlash ) << dest.directory ( KUrl::AppendTrailingSlash );
+    CachedDevice *cachedDevice = deviceCache->get ( pathItems.at ( 0 ) );
+    const QString key = deviceKey ( cachedDevice );
 
-        if ( !(flags & KIO::Overwrite) && getPath( dest.path() ).first )
-        {
-            error( ERR_FILE_ALREADY_EXIST, dest.path() );
-            return;
-        }
+    // reads come from the cached content if there is any, writes change the object
+    if ( mode & QIODevice::WriteOnly )
+    {
+        hashIndex.remove ( key, file->item_id );
+        contentCache.remove ( key, file->item_id );
+        openFile.cached.clear();
+    }
+    else
+    {
+        openFile.cached = contentCache.lookup ( key, file->item_id, file->filesize, file->modificationdate );
+    }
 
-        destItems.takeLast();
+    // reads and writes go to any position of the object
+    if ( openFile.cached.isEmpty() && !cachedDevice->getProfile().hasCapability ( LIBMTP_DEVICECAP_GetPartialObject ) )
+    {
+        error ( ERR_CANNOT_OPEN_FOR_READING, url.path() );
+        return;
+    }
+    if ( ( mode & QIODevice::WriteOnly ) && !canAppend ( cachedDevice ) )
+    {
+        error ( ERR_CANNOT_OPEN_FOR_WRITING, url.path() );
+        return;
+    }
 
-        QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( dest.directory() );
+    openFile.device = pathItems.at ( 0 );
+    openFile.id = file->item_id;
+    openFile.size = file->filesize;
+    openFile.position = 0;
+    openFile.editing = false;
 
-        if ( !pair.first )
+    if ( mode & QIODevice::Truncate )
+    {
+        LIBMTP_mtpdevice_t *device = openFileDevice ( true );
+        if ( !device || mtpTruncateObject ( device, openFile.id, 0 ) != 0 )
         {
-            error ( ERR_DOES_NOT_EXIST, dest.directory ( KUrl::AppendTrailingSlash ) );
+            openFile.id = 0;
+            error ( ERR_CANNOT_OPEN_FOR_WRITING, url.path() );
             return;
         }
 
-        LIBMTP_mtpdevice_t *device = pair.second;
+        openFile.size = 0;
+    }
+    else if ( mode & QIODevice::Append )
+    {
+        openFile.position = openFile.size;
+    }
 
-        uint32_t parent_id = 0xFFFFFFFF, storage_id = 0;
+    // keep the session, an edit would be lost with it
+    cachedDevice->ref();
 
-        if ( destItems.size() == 2 )
-        {
-            LIBMTP_devicestorage_t *storage = ( LIBMTP_devicestorage_t*) pair.first;
+    mimeType ( getMimetype ( QString::fromUtf8 ( file->filename ), file->filetype ) );
+    totalSize ( openFile.size );
+    position ( openFile.position );
+    opened();
+}
 
-            storage_id = storage->id;
-        }
-        else
-        {
-            LIBMTP_file_t *parent = ( LIBMTP_file_t* ) pair.first;
+void MTPSlave::read ( KIO::filesize_t size )
+{
+    TraceSpan span ( "read", "kio" );
 
-            storage_id = parent->storage_id;
-            parent_id = parent->item_id;
+    size = qMin<KIO::filesize_t> ( size, openFile.size - qMin ( openFile.size, openFile.position ) );
 
-            if ( parent->filetype != LIBMTP_FILETYPE_FOLDER )
+    // an empty block marks the end of the file
+    if ( size == 0 )
+    {
+        data ( QByteArray() );
+        return;
+    }
+
+    if ( !openFile.cached.isEmpty() )
+    {
+        // the file may have been evicted since, but an open one stays readable
+        QFile content ( openFile.cached );
+        if ( content.open ( QIODevice::ReadOnly ) && content.seek ( openFile.position ) )
+        {
+            const QByteArray block = content.read ( size );
+            if ( !block.isEmpty() )
             {
-                error ( ERR_IS_FILE, dest.directory() );
+                data ( block );
+                openFile.position += block.size();
                 return;
             }
         }
 
-        QFileInfo source ( src.path() );
+        kDebug ( KIO_MTP ) << "Content of the opened file is gone from the cache";
+        openFile.cached.clear();
+    }
 
-        LIBMTP_file_t *file = LIBMTP_new_file_t();
-        file->parent_id = parent_id;
-        file->filename = strdup ( dest.fileName().toUtf8().data() );
-        file->filetype = getFiletype ( dest.fileName() );
-        file->filesize = source.size();
-        file->modificationdate = source.lastModified().toTime_t();
-        file->storage_id = storage_id;
+    LIBMTP_mtpdevice_t *device = openFileDevice();
+    if ( !device )
+    {
+        error ( ERR_COULD_NOT_READ, openFile.device );
+        return;
+    }
 
-        kDebug ( KIO_MTP ) << "Sending file" << file->filename << "with size" << file->filesize;
+    unsigned char *buffer = 0;
+    unsigned int length = 0;
 
-        totalSize ( source.size() );
+    if ( mtpGetPartialObject ( device, openFile.id, openFile.position, size, &buffer, &length ) != 0 )
+    {
+        free ( buffer );
+        error ( ERR_COULD_NOT_READ, openFile.device );
+        return;
+    }
 
-        int ret = LIBMTP_Send_File_From_File ( device, src.path().toUtf8().data(), file, ( LIBMTP_progressfunc_t ) &dataProgress, this );
-        if ( ret != 0 )
-        {
-            error ( KIO::ERR_COULD_NOT_WRITE, dest.fileName() );
-            LIBMTP_Dump_Errorstack ( device );
-            LIBMTP_Clear_Errorstack ( device );
-            return;
-        }
+    data ( QByteArray ( ( char* ) buffer, length ) );
+    free ( buffer );
 
-        kDebug ( KIO_MTP ) << "Sent file";
-    }
-    // mtp:/// to file:///
-    if ( src.protocol() == QLatin1String ( "mtp" ) && dest.protocol() == QLatin1String ( "file" ) )
-    {
-        int check = checkUrl( src );
-        switch ( check )
-        {
-            case 0:
-                break;
-            default:
-                error( ERR_MALFORMED_URL, src.path() );
-                return;
-        }
+    openFile.position += length;
+}
 
-        kDebug ( KIO_MTP ) << "Copy file " << src.fileName() << "from device to filesystem" << dest.directory ( KUrl::AppendTrailingSlash ) << dest.directory ( KUrl::AppendTrailingSlash );
+void MTPSlave::write ( const QByteArray& data )
+{
+    TraceSpan span ( "write", "kio" );
 
-        QFileInfo destination ( dest.path() );
+    LIBMTP_mtpdevice_t *device = openFileDevice ( true );
+    if ( !device || mtpSendPartialObject ( device, openFile.id, openFile.position, ( unsigned char* ) data.data(), data.size() ) != 0 )
+    {
+        error ( ERR_COULD_NOT_WRITE, openFile.device );
+        return;
+    }
 
-        if ( !(flags & KIO::Overwrite) && destination.exists() )
-        {
-            error( ERR_FILE_ALREADY_EXIST, dest.path() );
-            return;
-        }
+    openFile.position += data.size();
+    openFile.size = qMax ( openFile.size, openFile.position );
 
-        QStringList srcItems = src.path().split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+    written ( data.size() );
+}
 
-        // Can't copy to root or device, needs storage
-        if ( srcItems.size() < 2 )
-        {
-            error ( ERR_UNSUPPORTED_ACTION, src.path() );
-            return;
-        }
+void MTPSlave::seek ( KIO::filesize_t offset )
+{
+    TraceSpan span ( "seek", "kio" );
 
-        QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( src.path() );
+    if ( offset > openFile.size )
+    {
+        error ( ERR_COULD_NOT_SEEK, openFile.device );
+        return;
+    }
 
-        LIBMTP_mtpdevice_t *device = pair.second;
-        LIBMTP_file_t *source = ( LIBMTP_file_t* ) pair.first;
-        if ( source->filetype == LIBMTP_FILETYPE_FOLDER )
-        {
-            error ( ERR_IS_DIRECTORY, src.directory() );
-            return;
-        }
+    openFile.position = offset;
+    position ( offset );
+}
 
-        kDebug ( KIO_MTP ) << "Getting file" << source->filename << dest.fileName() << source->filesize;
+void MTPSlave::close()
+{
+    TraceSpan span ( "close", "kio" );
+    CommandScope commandScope ( this );
 
-        totalSize ( source->filesize );
+    int ret = 0;
 
-        int ret = LIBMTP_Get_File_To_File ( device, source->item_id, dest.path().toUtf8().data(), ( LIBMTP_progressfunc_t ) &dataProgress, this );
-        if ( ret != 0 )
-        {
-            error ( KIO::ERR_COULD_NOT_WRITE, dest.fileName() );
-            LIBMTP_Dump_Errorstack ( device );
-            LIBMTP_Clear_Errorstack ( device );
-            return;
-        }
-        
-        struct utimbuf *times = (utimbuf*) malloc( sizeof( utimbuf ) );
-        times->actime = QDateTime::currentDateTime().toTime_t();
-        times->modtime = source->modificationdate;
-        
-        int result = utime( dest.path().toUtf8().data(), times  );
-        
-        free( times );
+    if ( openFile.editing )
+    {
+        LIBMTP_mtpdevice_t *device = openFileDevice();
+        ret = device ? mtpEndEditObject ( device, openFile.id ) : -1;
+    }
 
-        kDebug ( KIO_MTP ) << "Sent file";
+    CachedDevice *cachedDevice = deviceCache->get ( openFile.device );
+    if ( cachedDevice )
+        cachedDevice->deref();
+
+    openFile.id = 0;
+    openFile.editing = false;
+    openFile.cached.clear();
 
+    if ( ret != 0 )
+    {
+        error ( ERR_COULD_NOT_WRITE, openFile.device );
+        return;
     }
+
     finished();
 }
 
 void MTPSlave::mkdir ( const KUrl& url, int )
 {
+    TraceSpan span ( "mkdir", "kio", url.path() );
+    CommandScope commandScope ( this );
+    storageTrees.clear();
+
     int check = checkUrl( url );
     switch ( check )
     {
@@ -822,51 +2123,16 @@ void MTPSlave::mkdir ( const KUrl& url, int )
     kDebug ( KIO_MTP ) << url.path();
 
     QStringList pathItems = url.path().split ( QLatin1Char ( '/' ) , QString::SkipEmptyParts );
-	int pathDepth= pathItems.size();
 
     if ( pathItems.size() > 2 && !getPath ( url.path() ).first )
     {
-        char *dirName = strdup ( pathItems.takeLast().toUtf8().data() );
-
-        LIBMTP_mtpdevice_t *device;
-        LIBMTP_file_t *file;
-		LIBMTP_devicestorage_t *storage;
-		int ret;
-
-        QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.directory() );
-
-		if (pathDepth == 3)
-		{//the folder need to be created straight to a storage device 
-			storage= ( LIBMTP_devicestorage_t* ) pair.first;
-			device = pair.second;
-			ret = LIBMTP_Create_Folder ( device, dirName, 0xFFFFFFFF, storage->id );
-		}
-		else
-        if ( pair.first )
+        // missing parents are created as well
+        uint32_t storage_id;
+        if ( makePath ( url.path(), storage_id ) != 0 )
         {
-            file = ( LIBMTP_file_t* ) pair.first;
-            device = pair.second;
-
-            if ( file && file->filetype == LIBMTP_FILETYPE_FOLDER )
-            {
-                kDebug ( KIO_MTP ) << "Found parent" << file->item_id << file->filename;
-                kDebug ( KIO_MTP ) << "Attempting to create folder" << dirName;
-
-                ret = LIBMTP_Create_Folder ( device, dirName, file->item_id, file->storage_id );
-               
-            }
+            finished();
+            return;
         }
-		if ( ret != 0 )
-			{
-				fileCache->addPath( url.path(), ret );
-				finished();
-				return;
-			}
-			else
-			{
-				LIBMTP_Dump_Errorstack ( device );
-				LIBMTP_Clear_Errorstack ( device );
-			}
     }
     else
     {
@@ -877,8 +2143,93 @@ void MTPSlave::mkdir ( const KUrl& url, int )
     error ( ERR_COULD_NOT_MKDIR, url.path() );
 }
 
+uint32_t MTPSlave::makePath ( const QString &path, uint32_t &storageId )
+{
+    TraceSpan span ( "makePath", "kio", path );
+
+    QStringList pathItems = path.split ( QLatin1Char ( '/' ), QString::SkipEmptyParts );
+
+    if ( pathItems.size() < 2 || !deviceCache->contains ( pathItems.at ( 0 ) ) )
+        return 0;
+
+    CachedDevice *cachedDevice = deviceCache->get ( pathItems.at ( 0 ) );
+    LIBMTP_mtpdevice_t *device = cachedDevice->getDevice();
+    if ( !device )
+        return 0;
+
+    QMap<QString, LIBMTP_devicestorage_t*> storages = getDevicestorages ( device );
+    if ( !storages.contains ( pathItems.at ( 1 ) ) )
+        return 0;
+
+    storageId = storages.value ( pathItems.at ( 1 ) )->id;
+
+    uint32_t parentId = 0xFFFFFFFF;
+    int level = 2;
+
+    // start below the deepest ancestor known to the cache
+    for ( int depth = pathItems.size(); depth > 2; depth-- )
+    {
+        const uint32_t id = fileCache->queryPath ( convertToPath ( pathItems, depth ) );
+        if ( id == 0 )
+            continue;
+
+        LIBMTP_file_t *folder = objectPool.adopt ( mtpGetFilemetadata ( device, id ) );
+        if ( folder && folder->filetype == LIBMTP_FILETYPE_FOLDER && folder->storage_id == storageId )
+        {
+            parentId = id;
+            level = depth;
+        }
+        break;
+    }
+
+    // walk down to the first missing level
+    for ( ; level < pathItems.size(); level++ )
+    {
+        // a failed listing must not end up in duplicates of existing folders
+        const FileListing files = getFiles ( cachedDevice, device, storageId, parentId );
+        const int index = files.indexOf ( pathItems.at ( level ) );
+        if ( index < 0 )
+            break;
+
+        if ( !files.isFolder ( index ) )
+            return 0;
+
+        parentId = files.itemId ( index );
+        fileCache->addPath ( convertToPath ( pathItems, level + 1 ), parentId );
+    }
+
+    // the session broke while listing and couldn't be reopened
+    if ( !device )
+        return 0;
+
+    // every new folder is the parent of the next one
+    for ( ; level < pathItems.size(); level++ )
+    {
+        MTPStringPointer name ( strdup ( pathItems.at ( level ).toUtf8().data() ) );
+
+        kDebug ( KIO_MTP ) << "Creating folder" << name.data() << "in" << parentId;
+
+        const uint32_t id = mtpCreateFolder ( device, name.data(), parentId, storageId );
+        if ( id == 0 )
+        {
+            LIBMTP_Dump_Errorstack ( device );
+            LIBMTP_Clear_Errorstack ( device );
+            return 0;
+        }
+
+        parentId = id;
+        fileCache->addPath ( convertToPath ( pathItems, level + 1 ), id );
+    }
+
+    return parentId;
+}
+
 void MTPSlave::del ( const KUrl& url, bool )
 {
+    TraceSpan span ( "del", "kio", url.path() );
+    CommandScope commandScope ( this );
+    storageTrees.clear();
+
     int check = checkUrl( url );
     switch ( check )
     {
@@ -902,23 +2253,143 @@ void MTPSlave::del ( const KUrl& url, bool )
     QPair<void*, LIBMTP_mtpdevice_t*> pair = getPath ( url.path() );
 
     LIBMTP_file_t *file = ( LIBMTP_file_t* ) pair.first;
+    LIBMTP_mtpdevice_t *device = pair.second;
+
+    if ( !file || pathItems.size() < 3 )
+    {
+        error ( ERR_CANNOT_DELETE, url.path() );
+        return;
+    }
+
+    CachedDevice *cachedDevice = deviceCache->get ( pathItems.at ( 0 ) );
+    const QString key = deviceKey ( cachedDevice );
+
+    // a device deleting a folder at once takes everything below with it, look at what that is
+    // first if hashes or content of it may be known
+    QVector<uint32_t> handles;
+    QSet<uint32_t> folders;
+    if ( file->filetype == LIBMTP_FILETYPE_FOLDER && ( hashIndex.contains ( key ) || contentCache.contains ( key ) ) )
+    {
+        listTree ( cachedDevice, device, file->storage_id, file->item_id, handles, folders );
+        if ( !device )
+        {
+            error ( ERR_CANNOT_DELETE, url.path() );
+            return;
+        }
+    }
+
+    int ret = mtpDeleteObject ( device, file->item_id );
 
-    int ret = LIBMTP_Delete_Object ( pair.second, file->item_id );
+    if ( ret == 0 )
+    {
+        foreach ( uint32_t handle, handles )
+        {
+            if ( !folders.contains ( handle ) )
+            {
+                hashIndex.remove ( key, handle );
+                contentCache.remove ( key, handle );
+            }
+        }
+    }
+    // most devices refuse to delete folders that aren't empty
+    else if ( file->filetype == LIBMTP_FILETYPE_FOLDER )
+    {
+        LIBMTP_Clear_Errorstack ( device );
+
+        if ( handles.isEmpty() )
+            listTree ( cachedDevice, device, file->storage_id, file->item_id, handles, folders );
 
-    LIBMTP_destroy_file_t ( file );
+        // the session broke while listing and couldn't be reopened
+        ret = device ? deleteTree ( cachedDevice, device, handles, folders ) : -1;
+    }
 
     if ( ret != 0 )
     {
+        if ( device )
+        {
+            LIBMTP_Dump_Errorstack ( device );
+            LIBMTP_Clear_Errorstack ( device );
+        }
+
+        // part of the tree may be gone already
+        if ( file->filetype == LIBMTP_FILETYPE_FOLDER )
+            fileCache->removeTree ( url.path() );
+
         error ( ERR_CANNOT_DELETE, url.path() );
         return;
     }
 
-    fileCache->removePath( url.path() );
+    if ( file->filetype != LIBMTP_FILETYPE_FOLDER )
+    {
+        hashIndex.remove ( key, file->item_id );
+        contentCache.remove ( key, file->item_id );
+    }
+
+    fileCache->removeTree ( url.path() );
     finished();
 }
 
+void MTPSlave::listTree ( CachedDevice *cachedDevice, LIBMTP_mtpdevice_t *&device, uint32_t storageId, uint32_t folderId,
+                          QVector<uint32_t> &handles, QSet<uint32_t> &folders )
+{
+    TraceSpan span ( "listTree", "kio", QString::number ( folderId ) );
+
+    handles.clear();
+    handles.append ( folderId );
+
+    folders.clear();
+    folders.insert ( folderId );
+
+    for ( int i = 0; i < handles.size(); i++ )
+    {
+        if ( !folders.contains ( handles.at ( i ) ) )
+            continue;
+
+        const FileListing children = getFiles ( cachedDevice, device, storageId, handles.at ( i ) );
+        for ( int j = 0; j < children.size(); j++ )
+        {
+            handles.append ( children.itemId ( j ) );
+            if ( children.isFolder ( j ) )
+                folders.insert ( children.itemId ( j ) );
+        }
+    }
+}
+
+int MTPSlave::deleteTree ( CachedDevice *cachedDevice, LIBMTP_mtpdevice_t *device, const QVector<uint32_t> &handles,
+                           const QSet<uint32_t> &folders )
+{
+    TraceSpan span ( "deleteTree", "kio", QString::number ( handles.first() ) );
+
+    kDebug ( KIO_MTP ) << "Deleting" << handles.size() << "objects below" << handles.first();
+
+    totalSize ( handles.size() );
+
+    const QString key = deviceKey ( cachedDevice );
+
+    // children go before their parents
+    for ( int i = handles.size() - 1; i >= 0; i-- )
+    {
+        if ( isCancelled() || mtpDeleteObject ( device, handles.at ( i ) ) != 0 )
+            return -1;
+
+        if ( !folders.contains ( handles.at ( i ) ) )
+        {
+            hashIndex.remove ( key, handles.at ( i ) );
+            contentCache.remove ( key, handles.at ( i ) );
+        }
+
+        processedSize ( handles.size() - i );
+    }
+
+    return 0;
+}
+
 void MTPSlave::rename ( const KUrl& src, const KUrl& dest, JobFlags flags )
 {
+    TraceSpan span ( "rename", "kio", src.path() + QLatin1String ( " -> " ) + dest.path() );
+    CommandScope commandScope ( this );
+    storageTrees.clear();
+
     int check = checkUrl( src );
     switch ( check )
     {
@@ -949,7 +2420,10 @@ void MTPSlave::rename ( const KUrl& src, const KUrl& dest, JobFlags flags )
         // Rename Device
         if ( srcItems.size() == 1 )
         {
-            LIBMTP_Set_Friendlyname ( pair.second, dest.fileName().toUtf8().data() );
+            if ( mtpSetFriendlyname ( pair.second, dest.fileName().toUtf8().data() ) == 0 )
+            {
+                deviceCache->get ( srcItems.at ( 0 ) )->setFriendlyName ( dest.fileName() );
+            }
         }
         // Rename Storage
         else if ( srcItems.size() == 2 )
@@ -975,7 +2449,8 @@ void MTPSlave::rename ( const KUrl& src, const KUrl& dest, JobFlags flags )
                 return;
             }
 
-            int ret = LIBMTP_Set_File_Name ( pair.second, source, dest.fileName().toUtf8().data() );
+            // the lookup of the destination may have reopened the session
+            int ret = mtpSetFileName ( deviceCache->get ( srcItems.at ( 0 ) )->getDevice(), source, dest.fileName().toUtf8().data() );
 
             if ( ret != 0 )
             {
@@ -987,8 +2462,6 @@ void MTPSlave::rename ( const KUrl& src, const KUrl& dest, JobFlags flags )
                 fileCache->addPath( dest.path(), source->item_id );
                 fileCache->removePath( src.path() );
             }
-
-            LIBMTP_destroy_file_t ( source );
         }
 
         finished();
@@ -34,15 +34,49 @@
 
 #include <libmtp.h>
 
+#include <QCache>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QSet>
+#include <QVector>
+
 // #include <QtCore/QCache>
+#include "contentcache.h"
 #include "filecache.h"
+#include "hashindex.h"
+#include "filelisting.h"
 #include "devicecache.h"
+#include "mtpobjects.h"
+#include "storagesnapshot.h"
+#include "storagetree.h"
 
 #define MAX_XFER_BUF_SIZE           16348
+#define MIMETYPE_SNIFF_SIZE         4096
+#define MIMETYPE_CACHE_SIZE         1024    // sniffed mimetypes kept
+#define MEDIADETAILS_CACHE_SIZE     1024    // media details kept
+#define CONTENTCACHE_CHUNK_SIZE     ( 1024 * 1024 )
 #define KIO_MTP                     7000
 
 using namespace KIO;
 
+/**
+ * What the device indexes about a media file, see getMediaDetails()
+ */
+struct MediaDetails
+{
+    MediaDetails() : duration ( 0 ), bitrate ( 0 ), width ( 0 ), height ( 0 ) {}
+
+    QString artist;
+    QString album;
+    QString title;
+    /// In ms
+    uint32_t duration;
+    /// In bit/s
+    uint32_t bitrate;
+    uint32_t width;
+    uint32_t height;
+};
+
 
 class MTPSlave : public QObject, public KIO::SlaveBase
 {
@@ -59,13 +93,211 @@ private:
     int checkUrl( const KUrl& url, bool redirect = true );
     FileCache *fileCache;
     DeviceCache *deviceCache;
+    /// Owns the libmtp objects of the running command
+    MTPObjectPool objectPool;
+    /// Recursive sizes by device name, dropped by every command that modifies a device
+    QHash<QString, StorageTree> storageTrees;
+    /// Content hashes computed during transfers
+    HashIndex hashIndex;
+    /// Content of recently downloaded objects
+    ContentCache contentCache;
+    /// Mimetypes sniffed from the most recently seen objects, see objectKey()
+    QCache<QString, QString> sniffedMimetypes;
+    /// Media details of the most recently listed objects, see objectKey()
+    QCache<QString, MediaDetails> mediaDetails;
+    /// Started when a transfer noticed that the job was killed
+    QElapsedTimer cancellation;
+
+    /**
+     * The file opened with open(), libmtp objects and devices don't outlive a command so only
+     * their names are kept.
+     */
+    struct OpenFile
+    {
+        QString device;
+        uint32_t id;
+        uint64_t size;
+        uint64_t position;
+        bool editing;
+        /// The content of the file in the ContentCache, read instead of the object if set
+        QString cached;
+    } openFile;
+
+    /**
+     * Returns the device of the opened file and starts editing the file if @p edit is set.
+     *
+     * @return The device or 0 if it is gone or can't be edited
+     */
+    LIBMTP_mtpdevice_t* openFileDevice ( bool edit = false );
     QPair<void*, LIBMTP_mtpdevice_t*> getPath( const QString& path );
+
+    /**
+     * A destination folder of uploadFiles(), resolved once for all of its files
+     */
+    struct BatchFolder
+    {
+        uint32_t id;
+        uint32_t storageId;
+        FileListing children;
+    };
+
+    /**
+     * Creates the folder at path with all of its missing parents, like mkdir -p.
+     *
+     * @param storageId Set to the storage of the folder
+     * @return The id of the folder, 0xFFFFFFFF for the storage itself or 0 on failure
+     */
+    uint32_t makePath ( const QString &path, uint32_t &storageId );
+
+    /**
+     * Looks up a destination folder, creating it and its missing parents.
+     */
+    bool resolveBatchFolder ( const QString &path, QHash<QString, BatchFolder> &folders, BatchFolder &folder );
+
+    /**
+     * Sends local files to the given paths on the devices, see SpecialCommand.
+     */
+    void uploadFiles ( const QStringList &sources, const QStringList &destinations, bool overwrite );
+
+    /**
+     * Collects a folder and everything below it, breadth first so every object comes after its
+     * parent.
+     *
+     * @param device Set to the new device if the session had to be reopened while listing, 0 if
+     * it couldn't be
+     * @param folders Set to the folders among the handles
+     */
+    void listTree ( CachedDevice *cachedDevice, LIBMTP_mtpdevice_t *&device, uint32_t storageId, uint32_t folderId,
+                    QVector<uint32_t> &handles, QSet<uint32_t> &folders );
+
+    /**
+     * Deletes a tree collected by listTree() bottom-up by handle. Reports the deleted objects as
+     * progress and forgets the hashes and cached content of the deleted files.
+     *
+     * @return 0 on success
+     */
+    int deleteTree ( CachedDevice *cachedDevice, LIBMTP_mtpdevice_t *device, const QVector<uint32_t> &handles,
+                     const QSet<uint32_t> &folders );
+
+    /**
+     * Sums up everything below a folder or storage, see SpecialCommand.
+     */
+    void folderSize ( const QString &path );
+
+    /**
+     * Sends the changes on a storage since a snapshot, see SpecialCommand.
+     */
+    void listChanges ( const QString &path, const QString &token );
+
+    /**
+     * Whether an object on the device has the same content as a local file, judged by size and
+     * date or, if the date differs, by the known hash of the object.
+     *
+     * @param device The name of the device
+     */
+    bool isIdentical ( const QString &device, uint32_t handle, uint64_t size, qint64 modified, const QFileInfo &local );
+
+    /**
+     * Remembers the hash of a completely transferred object and reports it in the contentHash
+     * metadata.
+     */
+    void reportHash ( const QString &device, uint32_t handle, uint64_t size, qint64 modified, uint64_t hash );
+
+    /**
+     * Determines the mimetype of an object from its first bytes if neither its format nor its
+     * name tell, so KIO doesn't fall back to downloading it.
+     */
+    QString sniffMimetype ( CachedDevice *cachedDevice, const LIBMTP_file_t *file );
+
+    /**
+     * Answers get() with the content of an object from the ContentCache, mapping the file a
+     * chunk at a time instead of reading it.
+     *
+     * @return false if the file couldn't be read, nothing was sent then
+     */
+    bool sendCachedContent ( const QString &path, uint64_t offset );
+
+    /**
+     * Adds the tags and dimensions the device knows of a media file to its entry, if the job asks
+     * for them with the MediaDetails metadata. They cost a request or two per file, but no
+     * download.
+     */
+    void addMediaDetails ( UDSEntry &entry, CachedDevice *cachedDevice, uint32_t id, LIBMTP_filetype_t filetype,
+                           uint64_t size, qint64 modified );
+
+    /**
+     * Sends a new file. A resumable file is created empty and filled with SendPartialObject, so
+     * after an interrupted upload its size is what the device actually received. A file sent as
+     * a whole claims its full size from the start.
+     *
+     * @param device Set to the device after the transfer, the session may have been reopened
+     * @return 0 on success, file->item_id is set if the object was created
+     */
+    int sendFile ( CachedDevice *cachedDevice, LIBMTP_mtpdevice_t *&device, LIBMTP_file_t *file, bool resumable,
+                   MTPDataGetFunc get, void *priv );
+
+    /**
+     * Gives a completed name.part upload its final name, replacing the existing file.
+     *
+     * @param id The uploaded object
+     * @param existing The file to replace, may be 0
+     * @param url The final URL
+     */
+    bool finishPartial ( LIBMTP_mtpdevice_t *device, uint32_t id, const LIBMTP_file_t *existing, const KUrl &url );
+
+    /**
+     * Deletes the object of a failed upload that went straight to its final name, a truncated
+     * file must not pass for the complete one. Uploads into name.part are kept to be resumed.
+     *
+     * @param id The object created by the upload, 0 if there is none
+     * @param path The final path of the file
+     */
+    void discardUpload ( LIBMTP_mtpdevice_t *device, uint32_t id, const QString &path );
+
+    /**
+     * Frees the objects of the finished command and hands devices over to waiting slaves.
+     */
+    void commandFinished();
+
+    /**
+     * @class CommandScope Calls commandFinished() when it goes out of scope, put one at the top of every KIO command.
+     */
+    class CommandScope
+    {
+    public:
+        explicit CommandScope ( MTPSlave *slave ) : m_slave ( slave ) {}
+        ~CommandScope() { m_slave->commandFinished(); }
+
+    private:
+        Q_DISABLE_COPY ( CommandScope )
+        MTPSlave *m_slave;
+    };
     
 // private slots:
 //     
 //     void test();
 
 public:
+    enum SpecialCommand
+    {
+        /// Sent to ourselves while idle to notice slaves waiting for a device
+        PollDeviceRequests = 1,
+        /// Uploads local files, followed by the local paths (QStringList), the paths on the
+        /// devices (QStringList) and whether to overwrite existing files (bool)
+        UploadFiles = 2,
+        /// Uploads a local directory tree, followed by the local directory (QString), the path
+        /// on the device (QString) and whether to overwrite existing files (bool)
+        MirrorDirectory = 3,
+        /// Sums up everything below a folder or storage, followed by its path (QString). The
+        /// totals are returned in the folderSize, fileCount and folderCount metadata
+        FolderSize = 4,
+        /// Sends what changed on a storage since a snapshot, followed by the path of the storage
+        /// (QString) and the token of the snapshot (QString), empty to get every object. The changes
+        /// are sent as data, see StorageSnapshot::writeChanges(), the token of the new snapshot is
+        /// returned in the snapshotToken metadata
+        ListChanges = 5
+    };
+
     /*
      * Overwritten KIO-functions, see "kio_mtp.cpp"
      */
@@ -81,6 +313,19 @@ public:
     virtual void mkdir ( const KUrl& url, int );
     virtual void del ( const KUrl& url, bool );
     virtual void rename ( const KUrl& src, const KUrl& dest, JobFlags flags );
+    virtual void special ( const QByteArray& data );
+
+    virtual void open ( const KUrl& url, QIODevice::OpenMode mode );
+    virtual void read ( KIO::filesize_t size );
+    virtual void write ( const QByteArray& data );
+    virtual void seek ( KIO::filesize_t offset );
+    virtual void close();
+
+    /**
+     * Whether the job was killed, checked by the transfer callbacks between chunks to abort the
+     * transfer right away.
+     */
+    bool isCancelled();
 };
 
 #endif  //#endif KIO_MTP_H
@@ -18,13 +18,32 @@
  */
 
 #include "kio_mtp_helpers.h"
+#include "localfile.h"
+#include "mtpcalls.h"
+#include "tracer.h"
 
+#include <KMimeType>
+
+#include <QTime>
+
+#include <string.h>
+
+
+int batchProgress ( uint64_t const sent, uint64_t const, void const *const priv )
+{
+    const BatchProgress *progress = ( const BatchProgress* ) priv;
+
+    progress->slave->processedSize ( progress->base + sent );
+
+    // anything but 0 makes libmtp cancel the transaction on the device
+    return progress->slave->isCancelled() ? 1 : 0;
+}
 
 int dataProgress ( uint64_t const sent, uint64_t const, void const *const priv )
 {
     ( ( MTPSlave* ) priv )->processedSize ( sent );
 
-    return 0;
+    return ( ( MTPSlave* ) priv )->isCancelled() ? 1 : 0;
 }
 
 /**
@@ -32,7 +51,10 @@ int dataProgress ( uint64_t const sent, uint64_t const, void const *const priv )
  */
 uint16_t dataPut ( void*, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen )
 {
-    kDebug(KIO_MTP) << "transferring" << sendlen << "bytes to data()";
+    TraceSpan span ( "data", "data" );
+
+    if ( ( ( MTPSlave* ) priv )->isCancelled() )
+        return LIBMTP_HANDLER_RETURN_CANCEL;
 
     ( ( MTPSlave* ) priv )->data ( QByteArray ( ( char* ) data, ( int ) sendlen ) );
     *putlen = sendlen;
@@ -40,23 +62,151 @@ uint16_t dataPut ( void*, void *priv, uint32_t sendlen, unsigned char *data, uin
     return LIBMTP_HANDLER_RETURN_OK;
 }
 
+/**
+ * MTPDataPutFunc callback function, writes data to the LocalFile passed as priv
+ */
+uint16_t dataWrite ( void*, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen )
+{
+    TraceSpan span ( "write", "data" );
+
+    if ( !( ( LocalFile* ) priv )->write ( ( char* ) data, sendlen ) )
+        return LIBMTP_HANDLER_RETURN_ERROR;
+
+    *putlen = sendlen;
+
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
 /**
  * MTPDataGetFunc callback function, "gets" data and puts it on the device
  */
-uint16_t dataGet ( void*, void *priv, uint32_t, unsigned char *data, uint32_t *gotlen )
+uint16_t dataGet ( void*, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen )
 {
-    ( ( MTPSlave* ) priv )->dataReq();
+    TraceSpan span ( "dataReq", "data" );
+
+    JobData *job = ( JobData* ) priv;
+
+    if ( job->slave->isCancelled() )
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+
+    // the application sends chunks of its own size, keep what libmtp didn't ask for yet
+    if ( job->pending.isEmpty() && !job->finished )
+    {
+        job->slave->dataReq();
+        if ( job->slave->readData ( job->pending ) <= 0 )
+            job->finished = true;
+    }
 
-    QByteArray buffer;
-    *gotlen = ( ( MTPSlave* ) priv )->readData ( buffer );
+    *gotlen = qMin<uint32_t> ( wantlen, job->pending.size() );
+    memcpy ( data, job->pending.constData(), *gotlen );
+    job->pending.remove ( 0, *gotlen );
+
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+/**
+ * MTPDataGetFunc callback function, reads data from the LocalFile passed as priv
+ */
+uint16_t dataRead ( void*, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen )
+{
+    TraceSpan span ( "read", "data" );
 
-    kDebug(KIO_MTP) << "transferring" << *gotlen << "bytes to data()";
+    const qint64 read = ( ( LocalFile* ) priv )->read ( ( char* ) data, wantlen );
+    if ( read < 0 )
+        return LIBMTP_HANDLER_RETURN_ERROR;
 
-    data = ( unsigned char* ) buffer.data();
+    *gotlen = read;
 
     return LIBMTP_HANDLER_RETURN_OK;
 }
 
+/**
+ * MTPDataGetFunc callback function, has no data at all, for creating empty objects
+ */
+uint16_t dataNone ( void*, void*, uint32_t, unsigned char*, uint32_t *gotlen )
+{
+    *gotlen = 0;
+
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+/**
+ * MTPDataPutFunc callback function, passes the data on to the callback of the TeeData passed as
+ * priv and writes it to its copy
+ */
+uint16_t teeData ( void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen )
+{
+    TeeData *tee = ( TeeData* ) priv;
+
+    const uint16_t ret = tee->callback ( params, tee->priv, sendlen, data, putlen );
+    if ( ret == LIBMTP_HANDLER_RETURN_OK && tee->copy && !tee->copy->write ( ( char* ) data, *putlen ) )
+    {
+        kDebug ( KIO_MTP ) << "Could not write" << tee->copy->path();
+        tee->copy = 0;
+    }
+
+    return ret;
+}
+
+/**
+ * MTPDataPutFunc and MTPDataGetFunc callback function, hashes the data of the callback in the
+ * HashingData passed as priv
+ */
+uint16_t hashData ( void *params, void *priv, uint32_t length, unsigned char *data, uint32_t *done )
+{
+    HashingData *hashing = ( HashingData* ) priv;
+
+    const uint16_t ret = hashing->callback ( params, hashing->priv, length, data, done );
+    if ( ret == LIBMTP_HANDLER_RETURN_OK )
+        hashing->hash.update ( data, *done );
+
+    return ret;
+}
+
+bool hashFile ( const QString &path, uint64_t &hash )
+{
+    TraceSpan span ( "hashFile", "data", path );
+
+    LocalFile file ( path );
+    if ( !file.openForReading() )
+        return false;
+
+    ContentHash content;
+    QByteArray buffer ( 1024 * 1024, Qt::Uninitialized );
+
+    qint64 read;
+    while ( ( read = file.read ( buffer.data(), buffer.size() ) ) > 0 )
+    {
+        content.update ( buffer.constData(), read );
+    }
+
+    if ( read < 0 )
+        return false;
+
+    hash = content.result();
+    return true;
+}
+
+QString deviceKey ( CachedDevice *device )
+{
+    const QString key = device->getProfile().key();
+
+    // unknown until the device was opened once
+    return key.isEmpty() ? device->getUdi() : key;
+}
+
+QString objectKey ( CachedDevice *device, uint32_t handle, uint64_t size, qint64 modified )
+{
+    return QString::fromLatin1 ( "%1/%2/%3/%4" ).arg ( deviceKey ( device ) ).arg ( handle ).arg ( size ).arg ( modified );
+}
+
+bool canAppend ( CachedDevice *device )
+{
+    const DeviceProfile profile = device->getProfile();
+
+    return profile.hasCapability ( LIBMTP_DEVICECAP_SendPartialObject ) && profile.hasCapability ( LIBMTP_DEVICECAP_EditObjects );
+}
+
 QString convertToPath( const QStringList& pathItems, const int elements )
 {
     QString path;
@@ -167,6 +317,23 @@ QString getMimetype ( LIBMTP_filetype_t filetype )
     }
 }
 
+QString getMimetype ( const QString &filename, LIBMTP_filetype_t filetype )
+{
+    const QString mimetype = getMimetype ( filetype );
+    if ( !mimetype.isEmpty() )
+        return mimetype;
+
+    // devices report most formats they don't know as undefined, the extension often tells
+    KUrl url;
+    url.setPath ( QLatin1Char ( '/' ) + filename );
+
+    const KMimeType::Ptr byName = KMimeType::findByUrl ( url, 0, false, true );
+    if ( !byName || byName->isDefault() )
+        return QString();
+
+    return byName->name();
+}
+
 LIBMTP_filetype_t getFiletype ( const QString &filename )
 {
     LIBMTP_filetype_t filetype;
@@ -357,37 +524,44 @@ QMap<QString, LIBMTP_devicestorage_t*> getDevicestorages ( LIBMTP_mtpdevice_t *&
     return storages;
 }
 
-QMap<QString, LIBMTP_file_t*> getFiles ( LIBMTP_mtpdevice_t *&device, uint32_t storage_id, uint32_t parent_id )
+FileListing getFiles ( LIBMTP_mtpdevice_t *&device, uint32_t storage_id, uint32_t parent_id )
 {
     kDebug ( KIO_MTP ) << "getFiles() for parent" << parent_id;
     
-    QMap<QString, LIBMTP_file_t*> fileMap;
-    
-    LIBMTP_file_t *files = LIBMTP_Get_Files_And_Folders ( device, storage_id, parent_id ), *file;
-    for ( file = files; file != NULL; file = file->next )
-    {
-        fileMap.insert ( QString::fromUtf8 ( file->filename ), file );
-        //         kDebug(KIO_MTP) << "found file" << file->filename;
-    }
+    MTPFileListPointer files ( mtpGetFilesAndFolders ( device, storage_id, parent_id ) );
+    FileListing listing ( files.data() );
     
-    kDebug ( KIO_MTP ) << "[EXIT]";
+    kDebug ( KIO_MTP ) << "[EXIT]" << listing.size();
     
-    return fileMap;
+    return listing;
 }
 
-void getEntry ( UDSEntry &entry, LIBMTP_mtpdevice_t* device )
+FileListing getFiles ( CachedDevice *cachedDevice, LIBMTP_mtpdevice_t *&device, uint32_t storage_id, uint32_t parent_id )
 {
-    char *charName = LIBMTP_Get_Friendlyname ( device );
-    char *charModel = LIBMTP_Get_Modelname ( device );
+    // an earlier listing lost the session
+    if ( !device )
+        return FileListing();
 
-    // prefer friendly devicename over model
-    QString deviceName;
-    if ( !charName )
-        deviceName = QString::fromUtf8 ( charModel );
-    else
-        deviceName = QString::fromUtf8 ( charName );
+    // only errors of this listing count
+    LIBMTP_Clear_Errorstack ( device );
+
+    FileListing listing = getFiles ( device, storage_id, parent_id );
+
+    // an empty folder and a failed listing look the same
+    if ( listing.isEmpty() && cachedDevice->recover ( device ) )
+    {
+        device = cachedDevice->getDevice();
+        if ( device )
+            listing = getFiles ( device, storage_id, parent_id );
+    }
+
+    return listing;
+}
 
-    entry.insert ( UDSEntry::UDS_NAME, deviceName );
+void getEntry ( UDSEntry &entry, CachedDevice* device )
+{
+    // the name is known from the profile, no need to ask the device
+    entry.insert ( UDSEntry::UDS_NAME, device->getName() );
     entry.insert ( UDSEntry::UDS_ICON_NAME, QLatin1String ( "multimedia-player" ) );
     entry.insert ( UDSEntry::UDS_FILE_TYPE, S_IFDIR );
     entry.insert ( UDSEntry::UDS_ACCESS, S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR | S_IXGRP | S_IXOTH );
@@ -410,6 +584,10 @@ void getEntry ( UDSEntry &entry, const LIBMTP_devicestorage_t* storage )
     entry.insert ( UDSEntry::UDS_FILE_TYPE, S_IFDIR );
     entry.insert ( UDSEntry::UDS_ACCESS, S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR | S_IXGRP | S_IXOTH );
     entry.insert ( UDSEntry::UDS_MIME_TYPE, QLatin1String ( "inode/directory" ) );
+
+    // see ExtraNames in mtp.protocol
+    entry.insert ( UDSEntry::UDS_EXTRA, KIO::convertSize ( storage->MaxCapacity ) );
+    entry.insert ( UDSEntry::UDS_EXTRA + 1, KIO::convertSize ( storage->FreeSpaceInBytes ) );
 }
 
 void getEntry ( UDSEntry &entry, const LIBMTP_file_t* file )
@@ -426,10 +604,76 @@ void getEntry ( UDSEntry &entry, const LIBMTP_file_t* file )
         entry.insert ( UDSEntry::UDS_FILE_TYPE, S_IFREG );
         entry.insert ( UDSEntry::UDS_ACCESS, S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR | S_IXGRP | S_IXOTH );
         entry.insert ( UDSEntry::UDS_SIZE, file->filesize );
-        entry.insert ( UDSEntry::UDS_MIME_TYPE, getMimetype( file->filetype ) );
+        entry.insert ( UDSEntry::UDS_MIME_TYPE, getMimetype ( QString::fromUtf8 ( file->filename ), file->filetype ) );
     }
     entry.insert ( UDSEntry::UDS_INODE, file->item_id );
     entry.insert ( UDSEntry::UDS_ACCESS_TIME, file->modificationdate );
     entry.insert ( UDSEntry::UDS_MODIFICATION_TIME, file->modificationdate );
     entry.insert ( UDSEntry::UDS_CREATION_TIME, file->modificationdate );
 }
+
+void getEntry ( UDSEntry &entry, const FileListing &files, int index )
+{
+    entry.insert ( UDSEntry::UDS_NAME, files.name ( index ) );
+    if ( files.isFolder ( index ) )
+    {
+        entry.insert ( UDSEntry::UDS_FILE_TYPE, S_IFDIR );
+        entry.insert ( UDSEntry::UDS_ACCESS, S_IRWXU | S_IRWXG | S_IRWXO );
+        entry.insert ( UDSEntry::UDS_MIME_TYPE, QLatin1String ( "inode/directory" ) );
+    }
+    else
+    {
+        entry.insert ( UDSEntry::UDS_FILE_TYPE, S_IFREG );
+        entry.insert ( UDSEntry::UDS_ACCESS, S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR | S_IXGRP | S_IXOTH );
+        entry.insert ( UDSEntry::UDS_SIZE, files.fileSize ( index ) );
+        entry.insert ( UDSEntry::UDS_MIME_TYPE, getMimetype ( files.name ( index ), files.filetype ( index ) ) );
+    }
+    entry.insert ( UDSEntry::UDS_INODE, files.itemId ( index ) );
+    entry.insert ( UDSEntry::UDS_ACCESS_TIME, files.modificationDate ( index ) );
+    entry.insert ( UDSEntry::UDS_MODIFICATION_TIME, files.modificationDate ( index ) );
+    entry.insert ( UDSEntry::UDS_CREATION_TIME, files.modificationDate ( index ) );
+}
+
+MediaDetails getMediaDetails ( LIBMTP_mtpdevice_t *device, uint32_t id, LIBMTP_filetype_t filetype )
+{
+    MediaDetails details;
+
+    if ( LIBMTP_FILETYPE_IS_TRACK ( filetype ) )
+    {
+        MTPTrackPointer track ( mtpGetTrackmetadata ( device, id ) );
+        if ( track )
+        {
+            details.artist = QString::fromUtf8 ( track->artist );
+            details.album = QString::fromUtf8 ( track->album );
+            details.title = QString::fromUtf8 ( track->title );
+            details.duration = track->duration;
+            details.bitrate = track->bitrate;
+        }
+    }
+
+    if ( LIBMTP_FILETYPE_IS_IMAGE ( filetype ) || LIBMTP_FILETYPE_IS_VIDEO ( filetype ) )
+    {
+        details.width = mtpGetU32FromObject ( device, id, LIBMTP_PROPERTY_Width, 0 );
+        details.height = mtpGetU32FromObject ( device, id, LIBMTP_PROPERTY_Height, 0 );
+    }
+
+    return details;
+}
+
+void getEntry ( UDSEntry &entry, const MediaDetails &details )
+{
+    // see ExtraNames in mtp.protocol, the first two are used by storages
+    if ( !details.artist.isEmpty() )
+        entry.insert ( UDSEntry::UDS_EXTRA + 2, details.artist );
+    if ( !details.album.isEmpty() )
+        entry.insert ( UDSEntry::UDS_EXTRA + 3, details.album );
+    if ( !details.title.isEmpty() )
+        entry.insert ( UDSEntry::UDS_EXTRA + 4, details.title );
+    if ( details.duration > 0 )
+        entry.insert ( UDSEntry::UDS_EXTRA + 5, QTime ( 0, 0 ).addMSecs ( details.duration ).toString (
+                           details.duration >= 3600000 ? QLatin1String ( "h:mm:ss" ) : QLatin1String ( "m:ss" ) ) );
+    if ( details.bitrate > 0 )
+        entry.insert ( UDSEntry::UDS_EXTRA + 6, i18n ( "%1 kbit/s", details.bitrate / 1000 ) );
+    if ( details.width > 0 && details.height > 0 )
+        entry.insert ( UDSEntry::UDS_EXTRA + 7, i18nc ( "width x height", "%1 x %2", details.width, details.height ) );
+}
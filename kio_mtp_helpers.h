@@ -23,25 +23,132 @@
 
 
 #include "kio_mtp.h"
+#include "contenthash.h"
+#include "filelisting.h"
 
 #include <libmtp.h>
 
+class LocalFile;
 
+
+/**
+ * Data the application sends for put(), passed as priv to dataGet()
+ */
+struct JobData
+{
+    explicit JobData ( MTPSlave *slave ) : slave ( slave ), finished ( false ) {}
+
+    MTPSlave *slave;
+    QByteArray pending;
+    bool finished;
+};
+
+/**
+ * Progress of a batch transfer, passed as priv to batchProgress()
+ */
+struct BatchProgress
+{
+    explicit BatchProgress ( MTPSlave *slave ) : slave ( slave ), base ( 0 ) {}
+
+    MTPSlave *slave;
+    /// Bytes of the files already transferred
+    uint64_t base;
+};
+
+/**
+ * Wraps a data callback and hashes everything passing through it, passed as priv to hashData()
+ */
+struct HashingData
+{
+    HashingData ( MTPDataPutFunc callback, void *priv ) : callback ( callback ), priv ( priv ) {}
+
+    /// MTPDataPutFunc and MTPDataGetFunc are the same type, any data callback works
+    MTPDataPutFunc callback;
+    void *priv;
+    ContentHash hash;
+};
+
+/**
+ * Wraps a data callback and writes everything it took to a LocalFile as well, passed as priv to
+ * teeData()
+ */
+struct TeeData
+{
+    TeeData ( MTPDataPutFunc callback, void *priv, LocalFile *copy ) : callback ( callback ), priv ( priv ), copy ( copy ) {}
+
+    MTPDataPutFunc callback;
+    void *priv;
+    /// Set to 0 if writing the copy failed, the data still goes to the callback then
+    LocalFile *copy;
+};
+
+int batchProgress ( uint64_t const sent, uint64_t const, void const *const priv );
 int dataProgress ( uint64_t const sent, uint64_t const, void const *const priv );
 uint16_t dataPut ( void*, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen );
-uint16_t dataGet ( void*, void *priv, uint32_t, unsigned char *data, uint32_t *gotlen );
+uint16_t dataWrite ( void*, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen );
+uint16_t dataGet ( void*, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen );
+uint16_t dataRead ( void*, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen );
+uint16_t dataNone ( void*, void*, uint32_t, unsigned char*, uint32_t *gotlen );
+uint16_t teeData ( void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen );
+uint16_t hashData ( void *params, void *priv, uint32_t length, unsigned char *data, uint32_t *done );
+
+/**
+ * Hashes a local file like ContentHash does for transfers.
+ */
+bool hashFile ( const QString &path, uint64_t &hash );
+
+/**
+ * Identifies a device across sessions for the indexes kept on disk.
+ */
+QString deviceKey ( CachedDevice *device );
+
+/**
+ * Identifies a version of an object across sessions for the caches of what was read from it.
+ */
+QString objectKey ( CachedDevice *device, uint32_t handle, uint64_t size, qint64 modified );
+
+/**
+ * Whether existing objects on the device can be written to, see TransferScheduler::upload().
+ */
+bool canAppend ( CachedDevice *device );
 
 QString convertToPath( const QStringList& pathItems, const int elements );
 
 QString getMimetype ( LIBMTP_filetype_t filetype );
+
+/**
+ * Guesses the mimetype from the format of an object and, for unknown formats, from its name.
+ *
+ * @return An empty string if both are ambiguous
+ */
+QString getMimetype ( const QString &filename, LIBMTP_filetype_t filetype );
 LIBMTP_filetype_t getFiletype ( const QString &filename );
 
 QMap<QString, LIBMTP_devicestorage_t*> getDevicestorages ( LIBMTP_mtpdevice_t *&device );
-QMap<QString, LIBMTP_file_t*> getFiles ( LIBMTP_mtpdevice_t *&device, uint32_t storage_id, uint32_t parent_id = 0xFFFFFFFF );
+FileListing getFiles ( LIBMTP_mtpdevice_t *&device, uint32_t storage_id, uint32_t parent_id = 0xFFFFFFFF );
+
+/**
+ * Lists a folder like getFiles(), once more in a new session if the listing failed because the
+ * session broke. @p device is set to the new device then, or to 0 if the session couldn't be
+ * reopened. Pointers into the old device are invalid in both cases.
+ */
+FileListing getFiles ( CachedDevice *cachedDevice, LIBMTP_mtpdevice_t *&device, uint32_t storage_id, uint32_t parent_id = 0xFFFFFFFF );
 
-void getEntry ( UDSEntry &entry, LIBMTP_mtpdevice_t* device );
+void getEntry ( UDSEntry &entry, CachedDevice* device );
 void getEntry ( UDSEntry &entry, const LIBMTP_devicestorage_t* storage );
 void getEntry ( UDSEntry &entry, const LIBMTP_file_t* file );
+void getEntry ( UDSEntry &entry, const FileListing &files, int index );
+
+/**
+ * Asks the device for the tags of a track and the dimensions of an image or video, without
+ * reading the file itself.
+ */
+MediaDetails getMediaDetails ( LIBMTP_mtpdevice_t *device, uint32_t id, LIBMTP_filetype_t filetype );
+
+/**
+ * Adds the known media details as extra fields, see ExtraNames in mtp.protocol.
+ */
+void getEntry ( UDSEntry &entry, const MediaDetails &details );
 
 
 #endif
@@ -0,0 +1,303 @@
+/*
+ *  Local file access for KIO-MTP transfers
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "localfile.h"
+#include "tracer.h"
+
+#include <KDebug>
+
+#include <QFile>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define KIO_MTP                     7000
+
+#define LOCALFILE_BUFFER_SIZE       ( 1024 * 1024 )
+#define LOCALFILE_ALIGNMENT         4096
+#define LOCALFILE_DROP_WINDOW       ( 16 * 1024 * 1024 )
+
+LocalFile::LocalFile ( const QString &path )
+    : m_path ( path ), fd ( -1 ), writing ( false ), position ( 0 ), dropped ( 0 ), synced ( 0 ), buffer ( 0 ), buffered ( 0 ), ioTime ( 0 )
+{
+}
+
+LocalFile::~LocalFile()
+{
+    close();
+}
+
+bool LocalFile::openForReading ( uint64_t offset )
+{
+    fd = ::open ( QFile::encodeName ( m_path ).constData(), O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 )
+        return false;
+
+    if ( offset > 0 && lseek ( fd, offset, SEEK_SET ) == ( off_t ) -1 )
+    {
+        close();
+        return false;
+    }
+
+    position = dropped = synced = offset;
+    opened.start();
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise ( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+    return true;
+}
+
+bool LocalFile::openForWriting ( uint64_t offset, uint64_t size )
+{
+    const int flags = O_WRONLY | O_CREAT | O_CLOEXEC | ( offset > 0 ? 0 : O_TRUNC );
+
+    fd = ::open ( QFile::encodeName ( m_path ).constData(), flags, 0666 );
+    if ( fd < 0 )
+        return false;
+
+    if ( ( offset > 0 && ftruncate ( fd, offset ) != 0 ) || lseek ( fd, offset, SEEK_SET ) == ( off_t ) -1 )
+    {
+        close();
+        return false;
+    }
+
+    writing = true;
+    position = dropped = synced = offset;
+    opened.start();
+
+    // fail early if the disk is too full and keep the file in one piece
+    if ( size > offset )
+    {
+        const int ret = posix_fallocate ( fd, offset, size - offset );
+        if ( ret == ENOSPC )
+        {
+            close();
+            errno = ENOSPC;
+            return false;
+        }
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise ( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+    if ( posix_memalign ( ( void** ) &buffer, LOCALFILE_ALIGNMENT, LOCALFILE_BUFFER_SIZE ) != 0 )
+        buffer = 0;
+
+    return true;
+}
+
+qint64 LocalFile::read ( char *data, qint64 length )
+{
+    TraceSpan span ( "LocalFile::read", "data" );
+    QElapsedTimer timer;
+    timer.start();
+
+    ssize_t ret;
+    do
+    {
+        ret = ::read ( fd, data, length );
+    }
+    while ( ret < 0 && errno == EINTR );
+
+    if ( ret > 0 )
+    {
+        position += ret;
+        dropCache();
+    }
+
+    ioTime += timer.nsecsElapsed();
+
+    return ret;
+}
+
+bool LocalFile::write ( const char *data, qint64 length )
+{
+    // large chunks don't need the buffer
+    if ( !buffer || ( buffered == 0 && length >= LOCALFILE_BUFFER_SIZE ) )
+    {
+        buffered = 0;
+
+        TraceSpan span ( "LocalFile::write", "data" );
+        QElapsedTimer timer;
+        timer.start();
+
+        while ( length > 0 )
+        {
+            const ssize_t ret = ::write ( fd, data, length );
+            if ( ret < 0 && errno == EINTR )
+                continue;
+            if ( ret <= 0 )
+                return false;
+
+            data += ret;
+            length -= ret;
+            position += ret;
+        }
+
+        dropCache();
+        ioTime += timer.nsecsElapsed();
+
+        return true;
+    }
+
+    while ( length > 0 )
+    {
+        const uint32_t chunk = qMin<qint64> ( length, LOCALFILE_BUFFER_SIZE - buffered );
+
+        memcpy ( buffer + buffered, data, chunk );
+        buffered += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if ( buffered == LOCALFILE_BUFFER_SIZE && !flush() )
+            return false;
+    }
+
+    return true;
+}
+
+bool LocalFile::flush()
+{
+    if ( buffered == 0 )
+        return true;
+
+    TraceSpan span ( "LocalFile::write", "data" );
+    QElapsedTimer timer;
+    timer.start();
+
+    const char *data = buffer;
+    uint32_t length = buffered;
+
+    while ( length > 0 )
+    {
+        const ssize_t ret = ::write ( fd, data, length );
+        if ( ret < 0 && errno == EINTR )
+            continue;
+        if ( ret <= 0 )
+            return false;
+
+        data += ret;
+        length -= ret;
+        position += ret;
+    }
+
+    buffered = 0;
+
+    dropCache();
+    ioTime += timer.nsecsElapsed();
+
+    return true;
+}
+
+bool LocalFile::trim()
+{
+    if ( !flush() )
+        return false;
+
+    // don't leave the preallocated space behind an interrupted transfer, resuming relies on the size
+    return ftruncate ( fd, position ) == 0;
+}
+
+void LocalFile::dropCache()
+{
+    if ( position - synced < LOCALFILE_DROP_WINDOW )
+        return;
+
+    // dirty pages can't be dropped, have each window written back while the next one is filled
+#ifdef SYNC_FILE_RANGE_WRITE
+    if ( writing )
+        sync_file_range ( fd, synced, position - synced, SYNC_FILE_RANGE_WRITE );
+#endif
+
+    // a length of 0 would mean up to the end of the file
+    if ( synced > dropped )
+    {
+        if ( writing )
+        {
+#ifdef SYNC_FILE_RANGE_WRITE
+            sync_file_range ( fd, dropped, synced - dropped, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER );
+#else
+            fdatasync ( fd );
+#endif
+        }
+
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise ( fd, dropped, synced - dropped, POSIX_FADV_DONTNEED );
+#endif
+    }
+
+    dropped = synced;
+    synced = position;
+}
+
+bool LocalFile::setModificationTime ( time_t modified )
+{
+    if ( fd < 0 )
+        return false;
+
+    // cutting the file would touch it again
+    if ( writing )
+    {
+        const bool ok = trim();
+        writing = false;
+
+        if ( !ok )
+            return false;
+    }
+
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_sec = modified;
+    times[1].tv_nsec = 0;
+
+    return futimens ( fd, times ) == 0;
+}
+
+bool LocalFile::close()
+{
+    if ( fd < 0 )
+        return true;
+
+    bool ok = true;
+
+    if ( writing )
+        ok = trim();
+
+    kDebug ( KIO_MTP ) << "Local I/O took" << ioTime / 1000000 << "ms of" << opened.elapsed() << "ms for" << m_path;
+
+    if ( ::close ( fd ) != 0 )
+        ok = false;
+
+    fd = -1;
+    writing = false;
+
+    free ( buffer );
+    buffer = 0;
+
+    return ok;
+}
@@ -0,0 +1,99 @@
+/*
+ *  Local file access for KIO-MTP transfers
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef LOCALFILE_H
+#define LOCALFILE_H
+
+#include <QElapsedTimer>
+#include <QString>
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @class LocalFile The local side of copies between the device and the file system.
+ *
+ * Files being written are preallocated to their final size and collected in large aligned
+ * blocks, so the small chunks libmtp hands over don't turn into as many system calls. Both
+ * directions tell the kernel they read or write sequentially and drop what they are done with
+ * from the page cache, a copy of several GB shouldn't push everything else out of it.
+ *
+ * The time spent in local I/O is written to the debug output on close(), compare it with the
+ * total time of a replayed session to see the local overhead at a given USB rate.
+ */
+class LocalFile
+{
+public:
+    explicit LocalFile ( const QString &path );
+    ~LocalFile();
+
+    bool openForReading ( uint64_t offset = 0 );
+
+    /**
+     * @param offset Where to continue writing, everything after it is discarded
+     * @param size The expected size of the complete file, used to preallocate it
+     */
+    bool openForWriting ( uint64_t offset, uint64_t size );
+
+    /**
+     * @return The bytes read, 0 at the end of the file and -1 on errors
+     */
+    qint64 read ( char *data, qint64 length );
+    bool write ( const char *data, qint64 length );
+
+    /**
+     * Sets the modification time of the file, nothing must be written afterwards.
+     */
+    bool setModificationTime ( time_t modified );
+
+    /**
+     * Writes buffered data and cuts a preallocated file to the data written so far.
+     */
+    bool close();
+
+    QString path() const
+    {
+        return m_path;
+    }
+
+private:
+    bool flush();
+    bool trim();
+    void dropCache();
+
+    QString m_path;
+    int fd;
+    bool writing;
+
+    /// Position of the next byte read or written to the file, excluding the buffer
+    uint64_t position;
+    /// Everything before this was dropped from the page cache
+    uint64_t dropped;
+    /// Everything before this is being written back, or was read, and is dropped next
+    uint64_t synced;
+
+    char *buffer;
+    uint32_t buffered;
+
+    QElapsedTimer opened;
+    qint64 ioTime;
+};
+
+#endif // LOCALFILE_H
@@ -0,0 +1,977 @@
+/*
+ *  Recordable wrappers around the libmtp calls used by KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "mtpcalls.h"
+#include "sessionrecorder.h"
+#include "tracer.h"
+
+#include <QFile>
+#include <QFileInfo>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define REPLAY_CHUNK_SIZE           0x8000
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////// Conversion of recorded results //////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+static char* duplicate ( const QVariant &variant )
+{
+    if ( !variant.isValid() )
+        return 0;
+
+    return strdup ( variant.toByteArray().constData() );
+}
+
+static QVariant toVariant ( const char *string )
+{
+    if ( !string )
+        return QVariant();
+
+    return QByteArray ( string );
+}
+
+static QVariant storagesToVariant ( LIBMTP_mtpdevice_t *device )
+{
+    if ( !device )
+        return QVariant();
+
+    QVariantList storages;
+    for ( LIBMTP_devicestorage_t *storage = device->storage; storage != NULL; storage = storage->next )
+    {
+        QVariantList fields;
+        fields << storage->id << storage->StorageType << storage->FilesystemType << storage->AccessCapability
+               << ( qulonglong ) storage->MaxCapacity << ( qulonglong ) storage->FreeSpaceInBytes
+               << ( qulonglong ) storage->FreeSpaceInObjects
+               << toVariant ( storage->StorageDescription ) << toVariant ( storage->VolumeIdentifier );
+        storages << QVariant ( fields );
+    }
+    return storages;
+}
+
+static LIBMTP_devicestorage_t* storagesFromVariant ( const QVariant &variant )
+{
+    LIBMTP_devicestorage_t *first = 0, *last = 0;
+
+    foreach ( const QVariant &storageVariant, variant.toList() )
+    {
+        const QVariantList fields = storageVariant.toList();
+
+        LIBMTP_devicestorage_t *storage = ( LIBMTP_devicestorage_t* ) calloc ( 1, sizeof ( LIBMTP_devicestorage_t ) );
+        storage->id = fields.value ( 0 ).toUInt();
+        storage->StorageType = fields.value ( 1 ).toUInt();
+        storage->FilesystemType = fields.value ( 2 ).toUInt();
+        storage->AccessCapability = fields.value ( 3 ).toUInt();
+        storage->MaxCapacity = fields.value ( 4 ).toULongLong();
+        storage->FreeSpaceInBytes = fields.value ( 5 ).toULongLong();
+        storage->FreeSpaceInObjects = fields.value ( 6 ).toULongLong();
+        storage->StorageDescription = duplicate ( fields.value ( 7 ) );
+        storage->VolumeIdentifier = duplicate ( fields.value ( 8 ) );
+
+        storage->prev = last;
+        if ( last )
+            last->next = storage;
+        else
+            first = storage;
+        last = storage;
+    }
+
+    return first;
+}
+
+static void destroyReplayedStorages ( LIBMTP_devicestorage_t *storage )
+{
+    while ( storage )
+    {
+        LIBMTP_devicestorage_t *next = storage->next;
+        free ( storage->StorageDescription );
+        free ( storage->VolumeIdentifier );
+        free ( storage );
+        storage = next;
+    }
+}
+
+static LIBMTP_mtpdevice_t* deviceFromVariant ( const QVariant &variant )
+{
+    if ( !variant.isValid() )
+        return 0;
+
+    LIBMTP_mtpdevice_t *device = ( LIBMTP_mtpdevice_t* ) calloc ( 1, sizeof ( LIBMTP_mtpdevice_t ) );
+    device->storage = storagesFromVariant ( variant );
+
+    return device;
+}
+
+static void destroyReplayedDevice ( LIBMTP_mtpdevice_t *device )
+{
+    destroyReplayedStorages ( device->storage );
+    free ( device );
+}
+
+static QVariant fileToVariant ( const LIBMTP_file_t *file )
+{
+    QVariantList fields;
+    fields << file->item_id << file->parent_id << file->storage_id << toVariant ( file->filename )
+           << ( qulonglong ) file->filesize << ( qlonglong ) file->modificationdate << ( int ) file->filetype;
+    return fields;
+}
+
+static LIBMTP_file_t* fileFromVariant ( const QVariant &variant )
+{
+    const QVariantList fields = variant.toList();
+
+    LIBMTP_file_t *file = LIBMTP_new_file_t();
+    file->item_id = fields.value ( 0 ).toUInt();
+    file->parent_id = fields.value ( 1 ).toUInt();
+    file->storage_id = fields.value ( 2 ).toUInt();
+    file->filename = duplicate ( fields.value ( 3 ) );
+    file->filesize = fields.value ( 4 ).toULongLong();
+    file->modificationdate = ( time_t ) fields.value ( 5 ).toLongLong();
+    file->filetype = ( LIBMTP_filetype_t ) fields.value ( 6 ).toInt();
+    return file;
+}
+
+static QVariant fileListToVariant ( const LIBMTP_file_t *files )
+{
+    QVariantList list;
+    for ( const LIBMTP_file_t *file = files; file != NULL; file = file->next )
+    {
+        list << fileToVariant ( file );
+    }
+    return list;
+}
+
+static LIBMTP_file_t* fileListFromVariant ( const QVariant &variant )
+{
+    LIBMTP_file_t *first = 0, *last = 0;
+    foreach ( const QVariant &fileVariant, variant.toList() )
+    {
+        LIBMTP_file_t *file = fileFromVariant ( fileVariant );
+        if ( last )
+            last->next = file;
+        else
+            first = file;
+        last = file;
+    }
+    return first;
+}
+
+static QVariant trackToVariant ( const LIBMTP_track_t *track )
+{
+    QVariantList fields;
+    fields << toVariant ( track->title ) << toVariant ( track->artist ) << toVariant ( track->album )
+           << toVariant ( track->genre ) << track->tracknumber << track->duration << track->bitrate
+           << track->samplerate << track->nochannels;
+    return fields;
+}
+
+static LIBMTP_track_t* trackFromVariant ( uint32_t id, const QVariant &variant )
+{
+    const QVariantList fields = variant.toList();
+
+    LIBMTP_track_t *track = LIBMTP_new_track_t();
+    track->item_id = id;
+    track->title = duplicate ( fields.value ( 0 ) );
+    track->artist = duplicate ( fields.value ( 1 ) );
+    track->album = duplicate ( fields.value ( 2 ) );
+    track->genre = duplicate ( fields.value ( 3 ) );
+    track->tracknumber = fields.value ( 4 ).toUInt();
+    track->duration = fields.value ( 5 ).toUInt();
+    track->bitrate = fields.value ( 6 ).toUInt();
+    track->samplerate = fields.value ( 7 ).toUInt();
+    track->nochannels = fields.value ( 8 ).toUInt();
+    return track;
+}
+
+static QVariantList deviceArguments ( LIBMTP_mtpdevice_t *device )
+{
+    QVariantList arguments;
+    arguments << SessionRecorder::instance()->deviceKey ( device );
+    return arguments;
+}
+
+static QVariant uploadResult ( int ret, const LIBMTP_file_t *file )
+{
+    QVariantList result;
+    result << ret << file->item_id << file->parent_id << file->storage_id;
+    return result;
+}
+
+static int replayUpload ( const SessionRecorder::Transaction *transaction, LIBMTP_file_t *file )
+{
+    if ( !transaction )
+        return -1;
+
+    const QVariantList result = transaction->result.toList();
+    file->item_id = result.value ( 1 ).toUInt();
+    file->parent_id = result.value ( 2 ).toUInt();
+    file->storage_id = result.value ( 3 ).toUInt();
+    return result.value ( 0 ).toInt();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// Data handlers //////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+struct RecordingHandler
+{
+    MTPDataPutFunc put;
+    MTPDataGetFunc get;
+    void *priv;
+    quint64 bytes;
+    quint32 chunks;
+};
+
+static uint16_t recordingPut ( void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen )
+{
+    RecordingHandler *handler = ( RecordingHandler* ) priv;
+
+    uint16_t ret = handler->put ( params, handler->priv, sendlen, data, putlen );
+    handler->bytes += *putlen;
+    handler->chunks++;
+
+    return ret;
+}
+
+static uint16_t recordingGet ( void *params, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen )
+{
+    RecordingHandler *handler = ( RecordingHandler* ) priv;
+
+    uint16_t ret = handler->get ( params, handler->priv, wantlen, data, gotlen );
+    handler->bytes += *gotlen;
+    handler->chunks++;
+
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////// Wrappers /////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+LIBMTP_mtpdevice_t* mtpOpenRawDevice ( LIBMTP_raw_device_t *rawdevice, const QString &udi )
+{
+    TraceSpan span ( "LIBMTP_Open_Raw_Device_Uncached", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+
+    QVariantList arguments;
+    arguments << udi;
+
+    LIBMTP_mtpdevice_t *device;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::OpenDevice, arguments );
+        device = transaction ? deviceFromVariant ( transaction->result ) : 0;
+    }
+    else
+    {
+        qint64 started = recorder->begin();
+        device = LIBMTP_Open_Raw_Device_Uncached ( rawdevice );
+
+        if ( recorder->isRecording() )
+            recorder->record ( SessionRecorder::OpenDevice, started, arguments, storagesToVariant ( device ) );
+    }
+
+    if ( device )
+        recorder->registerDevice ( device, udi );
+
+    return device;
+}
+
+void mtpReleaseDevice ( LIBMTP_mtpdevice_t *device )
+{
+    TraceSpan span ( "LIBMTP_Release_Device", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+
+    QVariantList arguments = deviceArguments ( device );
+    recorder->unregisterDevice ( device );
+
+    if ( recorder->isReplaying() )
+    {
+        recorder->replay ( SessionRecorder::ReleaseDevice, arguments );
+        destroyReplayedDevice ( device );
+        return;
+    }
+
+    qint64 started = recorder->begin();
+    LIBMTP_Release_Device ( device );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::ReleaseDevice, started, arguments, QVariant() );
+}
+
+char* mtpGetFriendlyname ( LIBMTP_mtpdevice_t *device )
+{
+    TraceSpan span ( "LIBMTP_Get_Friendlyname", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetFriendlyname, arguments );
+        return transaction ? duplicate ( transaction->result ) : 0;
+    }
+
+    qint64 started = recorder->begin();
+    char *name = LIBMTP_Get_Friendlyname ( device );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::GetFriendlyname, started, arguments, toVariant ( name ) );
+
+    return name;
+}
+
+char* mtpGetModelname ( LIBMTP_mtpdevice_t *device )
+{
+    TraceSpan span ( "LIBMTP_Get_Modelname", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetModelname, arguments );
+        return transaction ? duplicate ( transaction->result ) : 0;
+    }
+
+    qint64 started = recorder->begin();
+    char *name = LIBMTP_Get_Modelname ( device );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::GetModelname, started, arguments, toVariant ( name ) );
+
+    return name;
+}
+
+char* mtpGetSerialnumber ( LIBMTP_mtpdevice_t *device )
+{
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetSerialnumber, arguments, false );
+        return transaction ? duplicate ( transaction->result ) : 0;
+    }
+
+    // read from the cached device info, not worth a span
+    qint64 started = recorder->begin();
+    char *serial = LIBMTP_Get_Serialnumber ( device );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::GetSerialnumber, started, arguments, toVariant ( serial ) );
+
+    return serial;
+}
+
+char* mtpGetDeviceversion ( LIBMTP_mtpdevice_t *device )
+{
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetDeviceversion, arguments, false );
+        return transaction ? duplicate ( transaction->result ) : 0;
+    }
+
+    // read from the cached device info, not worth a span
+    qint64 started = recorder->begin();
+    char *version = LIBMTP_Get_Deviceversion ( device );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::GetDeviceversion, started, arguments, toVariant ( version ) );
+
+    return version;
+}
+
+int mtpSetFriendlyname ( LIBMTP_mtpdevice_t *device, const char *name )
+{
+    TraceSpan span ( "LIBMTP_Set_Friendlyname", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << QByteArray ( name );
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::SetFriendlyname, arguments );
+        return transaction ? transaction->result.toInt() : -1;
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_Set_Friendlyname ( device, name );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::SetFriendlyname, started, arguments, ret );
+
+    return ret;
+}
+
+int mtpGetStorage ( LIBMTP_mtpdevice_t *device, int sortby )
+{
+    TraceSpan span ( "LIBMTP_Get_Storage", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << sortby;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetStorage, arguments );
+        if ( !transaction )
+            return -1;
+
+        const QVariantList result = transaction->result.toList();
+        destroyReplayedStorages ( device->storage );
+        device->storage = storagesFromVariant ( result.value ( 1 ) );
+
+        return result.value ( 0 ).toInt();
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_Get_Storage ( device, sortby );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::GetStorage, started, arguments, QVariantList() << ret << storagesToVariant ( device ) );
+
+    return ret;
+}
+
+int mtpCheckCapability ( LIBMTP_mtpdevice_t *device, LIBMTP_devicecap_t capability )
+{
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << ( int ) capability;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::CheckCapability, arguments, false );
+        return transaction ? transaction->result.toInt() : 0;
+    }
+
+    // no device access, not worth a span
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_Check_Capability ( device, capability );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::CheckCapability, started, arguments, ret );
+
+    return ret;
+}
+
+LIBMTP_file_t* mtpGetFilesAndFolders ( LIBMTP_mtpdevice_t *device, uint32_t storage_id, uint32_t parent_id )
+{
+    TraceSpan span ( "LIBMTP_Get_Files_And_Folders", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << storage_id << parent_id;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetFilesAndFolders, arguments );
+        return transaction ? fileListFromVariant ( transaction->result ) : 0;
+    }
+
+    qint64 started = recorder->begin();
+    LIBMTP_file_t *files = LIBMTP_Get_Files_And_Folders ( device, storage_id, parent_id );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::GetFilesAndFolders, started, arguments, fileListToVariant ( files ) );
+
+    return files;
+}
+
+LIBMTP_file_t* mtpGetFilelisting ( LIBMTP_mtpdevice_t *device )
+{
+    TraceSpan span ( "LIBMTP_Get_Filelisting_With_Callback", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetFilelisting, arguments );
+        return transaction ? fileListFromVariant ( transaction->result ) : 0;
+    }
+
+    qint64 started = recorder->begin();
+    LIBMTP_file_t *files = LIBMTP_Get_Filelisting_With_Callback ( device, NULL, NULL );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::GetFilelisting, started, arguments, fileListToVariant ( files ) );
+
+    return files;
+}
+
+LIBMTP_track_t* mtpGetTrackmetadata ( LIBMTP_mtpdevice_t *device, uint32_t id )
+{
+    TraceSpan span ( "LIBMTP_Get_Trackmetadata", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << id;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetTrackmetadata, arguments );
+        return transaction && transaction->result.isValid() ? trackFromVariant ( id, transaction->result ) : 0;
+    }
+
+    qint64 started = recorder->begin();
+    LIBMTP_track_t *track = LIBMTP_Get_Trackmetadata ( device, id );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::GetTrackmetadata, started, arguments, track ? trackToVariant ( track ) : QVariant() );
+
+    return track;
+}
+
+uint32_t mtpGetU32FromObject ( LIBMTP_mtpdevice_t *device, uint32_t id, LIBMTP_property_t property, uint32_t fallback )
+{
+    TraceSpan span ( "LIBMTP_Get_u32_From_Object", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << id << ( int ) property << fallback;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetU32FromObject, arguments );
+        return transaction ? transaction->result.toUInt() : fallback;
+    }
+
+    qint64 started = recorder->begin();
+    uint32_t value = LIBMTP_Get_u32_From_Object ( device, id, property, fallback );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::GetU32FromObject, started, arguments, value );
+
+    return value;
+}
+
+LIBMTP_file_t* mtpGetFilemetadata ( LIBMTP_mtpdevice_t *device, uint32_t id )
+{
+    TraceSpan span ( "LIBMTP_Get_Filemetadata", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << id;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetFilemetadata, arguments );
+        return transaction && transaction->result.isValid() ? fileFromVariant ( transaction->result ) : 0;
+    }
+
+    qint64 started = recorder->begin();
+    LIBMTP_file_t *file = LIBMTP_Get_Filemetadata ( device, id );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::GetFilemetadata, started, arguments, file ? fileToVariant ( file ) : QVariant() );
+
+    return file;
+}
+
+int mtpGetFileToHandler ( LIBMTP_mtpdevice_t *device, uint32_t id, MTPDataPutFunc put, void *priv,
+                          LIBMTP_progressfunc_t progress, void const *const data )
+{
+    TraceSpan span ( "LIBMTP_Get_File_To_Handler", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << id;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetFileToHandler, arguments, false );
+        if ( !transaction )
+            return -1;
+
+        const QVariantList result = transaction->result.toList();
+        const quint64 total = result.value ( 1 ).toULongLong();
+        const quint32 chunks = qMax ( result.value ( 2 ).toUInt(), 1u );
+        const quint32 chunkSize = qMax<quint64> ( total / chunks, 1 );
+
+        QByteArray buffer ( chunkSize, '\0' );
+
+        for ( quint64 sent = 0; sent < total; )
+        {
+            uint32_t putlen = 0;
+            uint32_t length = qMin<quint64> ( chunkSize, total - sent );
+
+            recorder->delay ( transaction->duration / chunks );
+
+            if ( put ( 0, priv, length, ( unsigned char* ) buffer.data(), &putlen ) != LIBMTP_HANDLER_RETURN_OK )
+                return -1;
+
+            sent += length;
+            if ( progress && progress ( sent, total, data ) != 0 )
+                return -1;
+        }
+
+        return result.value ( 0 ).toInt();
+    }
+
+    RecordingHandler handler = { put, 0, priv, 0, 0 };
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_Get_File_To_Handler ( device, id, &recordingPut, &handler, progress, data );
+
+    if ( recorder->isRecording() )
+    {
+        QVariantList result;
+        result << ret << handler.bytes << handler.chunks;
+        recorder->record ( SessionRecorder::GetFileToHandler, started, arguments, result );
+    }
+
+    return ret;
+}
+
+int mtpGetPartialObject ( LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset, uint32_t maxbytes,
+                         unsigned char **data, unsigned int *size )
+{
+    TraceSpan span ( "LIBMTP_GetPartialObject", "libmtp" );
+
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << id << ( qulonglong ) offset << maxbytes;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetPartialObject, arguments );
+        if ( !transaction )
+            return -1;
+
+        const QVariantList result = transaction->result.toList();
+        *size = result.value ( 1 ).toUInt();
+        *data = ( unsigned char* ) calloc ( qMax ( *size, 1u ), 1 );
+        return result.value ( 0 ).toInt();
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_GetPartialObject ( device, id, offset, maxbytes, data, size );
+
+    if ( recorder->isRecording() )
+    {
+        QVariantList result;
+        result << ret << ( ret == 0 ? *size : 0u );
+        recorder->record ( SessionRecorder::GetPartialObject, started, arguments, result );
+    }
+
+    return ret;
+}
+
+int mtpGetFileToFile ( LIBMTP_mtpdevice_t *device, uint32_t id, const char *path,
+                       LIBMTP_progressfunc_t progress, void const *const data )
+{
+    TraceSpan span ( "LIBMTP_Get_File_To_File", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << id;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::GetFileToFile, arguments );
+        if ( !transaction )
+            return -1;
+
+        const QVariantList result = transaction->result.toList();
+        const quint64 total = result.value ( 1 ).toULongLong();
+
+        QFile file ( QFile::decodeName ( path ) );
+        if ( !file.open ( QIODevice::WriteOnly | QIODevice::Truncate ) || !file.resize ( total ) )
+            return -1;
+
+        if ( progress )
+            progress ( total, total, data );
+
+        return result.value ( 0 ).toInt();
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_Get_File_To_File ( device, id, path, progress, data );
+
+    if ( recorder->isRecording() )
+    {
+        QVariantList result;
+        result << ret << ( qulonglong ) QFileInfo ( QFile::decodeName ( path ) ).size();
+        recorder->record ( SessionRecorder::GetFileToFile, started, arguments, result );
+    }
+
+    return ret;
+}
+
+int mtpSendFileFromHandler ( LIBMTP_mtpdevice_t *device, MTPDataGetFunc get, void *priv, LIBMTP_file_t *file,
+                             LIBMTP_progressfunc_t progress, void const *const data )
+{
+    TraceSpan span ( "LIBMTP_Send_File_From_Handler", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << QByteArray ( file->filename ) << file->parent_id << file->storage_id << ( qulonglong ) file->filesize;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::SendFileFromHandler, arguments, false );
+        if ( !transaction )
+            return -1;
+
+        // drain the data source like libmtp would, so the job sees its data being consumed
+        const quint64 total = file->filesize;
+        const quint32 chunks = qMax<quint64> ( total / REPLAY_CHUNK_SIZE, 1 );
+
+        QByteArray buffer ( REPLAY_CHUNK_SIZE, '\0' );
+
+        for ( quint64 sent = 0; sent < total; )
+        {
+            uint32_t gotlen = 0;
+            uint32_t length = qMin<quint64> ( REPLAY_CHUNK_SIZE, total - sent );
+
+            recorder->delay ( transaction->duration / chunks );
+
+            if ( get ( 0, priv, length, ( unsigned char* ) buffer.data(), &gotlen ) != LIBMTP_HANDLER_RETURN_OK || gotlen == 0 )
+                break;
+
+            sent += gotlen;
+            if ( progress && progress ( sent, total, data ) != 0 )
+                return -1;
+        }
+
+        return replayUpload ( transaction, file );
+    }
+
+    RecordingHandler handler = { 0, get, priv, 0, 0 };
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_Send_File_From_Handler ( device, &recordingGet, &handler, file, progress, data );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::SendFileFromHandler, started, arguments, uploadResult ( ret, file ) );
+
+    return ret;
+}
+
+int mtpSendFileFromFile ( LIBMTP_mtpdevice_t *device, const char *path, LIBMTP_file_t *file,
+                          LIBMTP_progressfunc_t progress, void const *const data )
+{
+    TraceSpan span ( "LIBMTP_Send_File_From_File", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << QByteArray ( file->filename ) << file->parent_id << file->storage_id << ( qulonglong ) file->filesize;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::SendFileFromFile, arguments );
+        if ( transaction && progress )
+            progress ( file->filesize, file->filesize, data );
+
+        return replayUpload ( transaction, file );
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_Send_File_From_File ( device, path, file, progress, data );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::SendFileFromFile, started, arguments, uploadResult ( ret, file ) );
+
+    return ret;
+}
+
+int mtpSendFileFromFileDescriptor ( LIBMTP_mtpdevice_t *device, int fd, LIBMTP_file_t *file,
+                                    LIBMTP_progressfunc_t progress, void const *const data )
+{
+    TraceSpan span ( "LIBMTP_Send_File_From_File_Descriptor", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << QByteArray ( file->filename ) << file->parent_id << file->storage_id << ( qulonglong ) file->filesize;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::SendFileFromFileDescriptor, arguments );
+        if ( transaction && progress )
+            progress ( file->filesize, file->filesize, data );
+
+        return replayUpload ( transaction, file );
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_Send_File_From_File_Descriptor ( device, fd, file, progress, data );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::SendFileFromFileDescriptor, started, arguments, uploadResult ( ret, file ) );
+
+    return ret;
+}
+
+int mtpSendPartialObject ( LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset, unsigned char *data, unsigned int size )
+{
+    TraceSpan span ( "LIBMTP_SendPartialObject", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << id << ( qulonglong ) offset << size;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::SendPartialObject, arguments );
+        return transaction ? transaction->result.toInt() : -1;
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_SendPartialObject ( device, id, offset, data, size );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::SendPartialObject, started, arguments, ret );
+
+    return ret;
+}
+
+int mtpBeginEditObject ( LIBMTP_mtpdevice_t *device, uint32_t id )
+{
+    TraceSpan span ( "LIBMTP_BeginEditObject", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << id;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::BeginEditObject, arguments );
+        return transaction ? transaction->result.toInt() : -1;
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_BeginEditObject ( device, id );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::BeginEditObject, started, arguments, ret );
+
+    return ret;
+}
+
+int mtpEndEditObject ( LIBMTP_mtpdevice_t *device, uint32_t id )
+{
+    TraceSpan span ( "LIBMTP_EndEditObject", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << id;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::EndEditObject, arguments );
+        return transaction ? transaction->result.toInt() : -1;
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_EndEditObject ( device, id );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::EndEditObject, started, arguments, ret );
+
+    return ret;
+}
+
+int mtpTruncateObject ( LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset )
+{
+    TraceSpan span ( "LIBMTP_TruncateObject", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << id << ( qulonglong ) offset;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::TruncateObject, arguments );
+        return transaction ? transaction->result.toInt() : -1;
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_TruncateObject ( device, id, offset );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::TruncateObject, started, arguments, ret );
+
+    return ret;
+}
+
+uint32_t mtpCreateFolder ( LIBMTP_mtpdevice_t *device, char *name, uint32_t parent_id, uint32_t storage_id )
+{
+    TraceSpan span ( "LIBMTP_Create_Folder", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << QByteArray ( name ) << parent_id << storage_id;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::CreateFolder, arguments );
+        return transaction ? transaction->result.toUInt() : 0;
+    }
+
+    qint64 started = recorder->begin();
+    uint32_t ret = LIBMTP_Create_Folder ( device, name, parent_id, storage_id );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::CreateFolder, started, arguments, ret );
+
+    return ret;
+}
+
+int mtpDeleteObject ( LIBMTP_mtpdevice_t *device, uint32_t id )
+{
+    TraceSpan span ( "LIBMTP_Delete_Object", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << id;
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::DeleteObject, arguments );
+        return transaction ? transaction->result.toInt() : -1;
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_Delete_Object ( device, id );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::DeleteObject, started, arguments, ret );
+
+    return ret;
+}
+
+int mtpSetFileName ( LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file, const char *name )
+{
+    TraceSpan span ( "LIBMTP_Set_File_Name", "libmtp" );
+    SessionRecorder *recorder = SessionRecorder::instance();
+    QVariantList arguments = deviceArguments ( device );
+    arguments << file->item_id << QByteArray ( name );
+
+    if ( recorder->isReplaying() )
+    {
+        const SessionRecorder::Transaction *transaction = recorder->replay ( SessionRecorder::SetFileName, arguments );
+        if ( !transaction )
+            return -1;
+
+        int ret = transaction->result.toInt();
+        if ( ret == 0 )
+        {
+            free ( file->filename );
+            file->filename = strdup ( name );
+        }
+        return ret;
+    }
+
+    qint64 started = recorder->begin();
+    int ret = LIBMTP_Set_File_Name ( device, file, name );
+
+    if ( recorder->isRecording() )
+        recorder->record ( SessionRecorder::SetFileName, started, arguments, ret );
+
+    return ret;
+}
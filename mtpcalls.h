@@ -0,0 +1,72 @@
+/*
+ *  Recordable wrappers around the libmtp calls used by KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef MTPCALLS_H
+#define MTPCALLS_H
+
+#include <QString>
+
+#include <libmtp.h>
+
+/*
+ * Every libmtp call that talks to a device goes through these wrappers, so a session can be
+ * recorded and replayed by the SessionRecorder. They behave exactly like their LIBMTP_
+ * counterparts.
+ */
+
+LIBMTP_mtpdevice_t* mtpOpenRawDevice ( LIBMTP_raw_device_t *rawdevice, const QString &udi );
+void mtpReleaseDevice ( LIBMTP_mtpdevice_t *device );
+
+char* mtpGetFriendlyname ( LIBMTP_mtpdevice_t *device );
+char* mtpGetModelname ( LIBMTP_mtpdevice_t *device );
+char* mtpGetSerialnumber ( LIBMTP_mtpdevice_t *device );
+char* mtpGetDeviceversion ( LIBMTP_mtpdevice_t *device );
+int mtpSetFriendlyname ( LIBMTP_mtpdevice_t *device, const char *name );
+int mtpGetStorage ( LIBMTP_mtpdevice_t *device, int sortby );
+int mtpCheckCapability ( LIBMTP_mtpdevice_t *device, LIBMTP_devicecap_t capability );
+
+LIBMTP_file_t* mtpGetFilesAndFolders ( LIBMTP_mtpdevice_t *device, uint32_t storage_id, uint32_t parent_id );
+LIBMTP_file_t* mtpGetFilemetadata ( LIBMTP_mtpdevice_t *device, uint32_t id );
+LIBMTP_file_t* mtpGetFilelisting ( LIBMTP_mtpdevice_t *device );
+LIBMTP_track_t* mtpGetTrackmetadata ( LIBMTP_mtpdevice_t *device, uint32_t id );
+uint32_t mtpGetU32FromObject ( LIBMTP_mtpdevice_t *device, uint32_t id, LIBMTP_property_t property, uint32_t fallback );
+
+int mtpGetFileToHandler ( LIBMTP_mtpdevice_t *device, uint32_t id, MTPDataPutFunc put, void *priv,
+                          LIBMTP_progressfunc_t progress, void const *const data );
+int mtpGetPartialObject ( LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset, uint32_t maxbytes,
+                         unsigned char **data, unsigned int *size );
+int mtpSendPartialObject ( LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset, unsigned char *data, unsigned int size );
+int mtpBeginEditObject ( LIBMTP_mtpdevice_t *device, uint32_t id );
+int mtpEndEditObject ( LIBMTP_mtpdevice_t *device, uint32_t id );
+int mtpTruncateObject ( LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset );
+int mtpGetFileToFile ( LIBMTP_mtpdevice_t *device, uint32_t id, const char *path,
+                       LIBMTP_progressfunc_t progress, void const *const data );
+int mtpSendFileFromHandler ( LIBMTP_mtpdevice_t *device, MTPDataGetFunc get, void *priv, LIBMTP_file_t *file,
+                             LIBMTP_progressfunc_t progress, void const *const data );
+int mtpSendFileFromFile ( LIBMTP_mtpdevice_t *device, const char *path, LIBMTP_file_t *file,
+                          LIBMTP_progressfunc_t progress, void const *const data );
+int mtpSendFileFromFileDescriptor ( LIBMTP_mtpdevice_t *device, int fd, LIBMTP_file_t *file,
+                                    LIBMTP_progressfunc_t progress, void const *const data );
+
+uint32_t mtpCreateFolder ( LIBMTP_mtpdevice_t *device, char *name, uint32_t parent_id, uint32_t storage_id );
+int mtpDeleteObject ( LIBMTP_mtpdevice_t *device, uint32_t id );
+int mtpSetFileName ( LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file, const char *name );
+
+#endif // MTPCALLS_H
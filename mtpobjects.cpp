@@ -0,0 +1,75 @@
+/*
+ *  Ownership of libmtp objects for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "mtpobjects.h"
+#include "mtpcalls.h"
+
+void MTPFileDeleter::cleanup ( LIBMTP_file_t *file )
+{
+    if ( file )
+        LIBMTP_destroy_file_t ( file );
+}
+
+void MTPFileListDeleter::cleanup ( LIBMTP_file_t *files )
+{
+    while ( files )
+    {
+        LIBMTP_file_t *next = files->next;
+        LIBMTP_destroy_file_t ( files );
+        files = next;
+    }
+}
+
+void MTPDeviceDeleter::cleanup ( LIBMTP_mtpdevice_t *device )
+{
+    if ( device )
+        mtpReleaseDevice ( device );
+}
+
+void MTPTrackDeleter::cleanup ( LIBMTP_track_t *track )
+{
+    if ( track )
+        LIBMTP_destroy_track_t ( track );
+}
+
+MTPObjectPool::MTPObjectPool()
+{
+}
+
+MTPObjectPool::~MTPObjectPool()
+{
+    clear();
+}
+
+LIBMTP_file_t* MTPObjectPool::adopt ( LIBMTP_file_t *files )
+{
+    if ( files )
+        lists.append ( files );
+
+    return files;
+}
+
+void MTPObjectPool::clear()
+{
+    foreach ( LIBMTP_file_t *files, lists )
+    {
+        MTPFileListDeleter::cleanup ( files );
+    }
+    lists.clear();
+}
@@ -0,0 +1,96 @@
+/*
+ *  Ownership of libmtp objects for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef MTPOBJECTS_H
+#define MTPOBJECTS_H
+
+#include <QScopedPointer>
+#include <QVector>
+
+#include <libmtp.h>
+
+/*
+ * Cleanup handlers to hold libmtp objects in a QScopedPointer
+ */
+
+struct MTPFileDeleter
+{
+    static void cleanup ( LIBMTP_file_t *file );
+};
+
+struct MTPFileListDeleter
+{
+    static void cleanup ( LIBMTP_file_t *files );
+};
+
+struct MTPDeviceDeleter
+{
+    static void cleanup ( LIBMTP_mtpdevice_t *device );
+};
+
+struct MTPTrackDeleter
+{
+    static void cleanup ( LIBMTP_track_t *track );
+};
+
+/// A single file, i.e. from LIBMTP_new_file_t() or LIBMTP_Get_Filemetadata()
+typedef QScopedPointer<LIBMTP_file_t, MTPFileDeleter> MTPFilePointer;
+/// A linked list of files, i.e. from LIBMTP_Get_Files_And_Folders()
+typedef QScopedPointer<LIBMTP_file_t, MTPFileListDeleter> MTPFileListPointer;
+/// An opened device, released when the pointer goes out of scope
+typedef QScopedPointer<LIBMTP_mtpdevice_t, MTPDeviceDeleter> MTPDevicePointer;
+/// The tags of a track, i.e. from LIBMTP_Get_Trackmetadata()
+typedef QScopedPointer<LIBMTP_track_t, MTPTrackDeleter> MTPTrackPointer;
+/// Strings returned by libmtp, i.e. LIBMTP_Get_Friendlyname()
+typedef QScopedPointer<char, QScopedPointerPodDeleter> MTPStringPointer;
+
+/**
+ * @class MTPObjectPool Owns the libmtp objects handed out while a KIO command runs and frees them
+ * all at once when the command is done.
+ *
+ * Objects returned by getPath() and the listings from getFiles() are adopted by the pool, so
+ * callers never free them themselves.
+ */
+class MTPObjectPool
+{
+public:
+    MTPObjectPool();
+    ~MTPObjectPool();
+
+    /**
+     * Takes ownership of a file or a list of files.
+     *
+     * @param files The file or the head of the list to adopt, may be 0
+     * @return files
+     */
+    LIBMTP_file_t* adopt ( LIBMTP_file_t *files );
+
+    /**
+     * Frees every adopted object.
+     */
+    void clear();
+
+private:
+    Q_DISABLE_COPY ( MTPObjectPool )
+
+    QVector<LIBMTP_file_t*> lists;
+};
+
+#endif // MTPOBJECTS_H
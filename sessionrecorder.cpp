@@ -0,0 +1,258 @@
+/*
+ *  Record and replay of libmtp sessions for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "sessionrecorder.h"
+
+#include <KDebug>
+#include <KGlobal>
+
+#include <unistd.h>
+
+#define KIO_MTP                     7000
+
+// "KMTR", bumped whenever the record layout changes
+static const quint32 s_traceMagic = 0x4b4d5452;
+static const quint16 s_traceVersion = 1;
+
+K_GLOBAL_STATIC ( SessionRecorder, s_recorder )
+
+SessionRecorder* SessionRecorder::instance()
+{
+    return s_recorder;
+}
+
+SessionRecorder::SessionRecorder()
+    : replaying ( false ), matched ( 0 ), missed ( 0 ), recordedTime ( 0 )
+{
+    clock.start();
+
+    const QByteArray replayPath = qgetenv ( "KIO_MTP_REPLAY" );
+    if ( !replayPath.isEmpty() )
+    {
+        replaying = load ( QString::fromLocal8Bit ( replayPath ) );
+    }
+
+    const QByteArray recordPath = qgetenv ( "KIO_MTP_RECORD" );
+    if ( !recordPath.isEmpty() )
+    {
+        recordFile.setFileName ( QString::fromLocal8Bit ( recordPath ) );
+        if ( recordFile.open ( QIODevice::WriteOnly | QIODevice::Truncate ) )
+        {
+            recordStream.setDevice ( &recordFile );
+            recordStream.setVersion ( QDataStream::Qt_4_6 );
+            recordStream << s_traceMagic << s_traceVersion;
+
+            kDebug ( KIO_MTP ) << "Recording session to" << recordFile.fileName();
+        }
+        else
+        {
+            kError ( KIO_MTP ) << "Could not open" << recordFile.fileName() << "for recording";
+        }
+    }
+}
+
+SessionRecorder::~SessionRecorder()
+{
+    if ( replaying )
+    {
+        kDebug ( KIO_MTP ) << "Replay finished:" << matched << "transactions matched," << missed << "missing,"
+                           << transactions.size() - matched << "recorded but not issued";
+        kDebug ( KIO_MTP ) << "Recorded device time" << recordedTime / 1000 << "ms, replayed session took"
+                           << clock.elapsed() << "ms";
+    }
+
+    if ( recordFile.isOpen() )
+    {
+        recordFile.close();
+    }
+}
+
+bool SessionRecorder::load ( const QString &path )
+{
+    QFile file ( path );
+    if ( !file.open ( QIODevice::ReadOnly ) )
+    {
+        kError ( KIO_MTP ) << "Could not open trace" << path;
+        return false;
+    }
+
+    QDataStream stream ( &file );
+    stream.setVersion ( QDataStream::Qt_4_6 );
+
+    quint32 magic;
+    quint16 version;
+    stream >> magic >> version;
+
+    if ( magic != s_traceMagic || version != s_traceVersion )
+    {
+        kError ( KIO_MTP ) << path << "is not a KIO-MTP trace of version" << s_traceVersion;
+        return false;
+    }
+
+    while ( !stream.atEnd() )
+    {
+        Transaction transaction;
+        stream >> transaction.operation >> transaction.start >> transaction.duration
+               >> transaction.arguments >> transaction.result;
+
+        if ( stream.status() != QDataStream::Ok )
+        {
+            kWarning ( KIO_MTP ) << "Trace" << path << "is truncated, replaying" << transactions.size() << "transactions";
+            break;
+        }
+
+        transaction.replayed = false;
+
+        byOperation[transaction.operation].append ( transactions.size() );
+        transactions.append ( transaction );
+    }
+
+    kDebug ( KIO_MTP ) << "Replaying" << transactions.size() << "transactions from" << path;
+
+    return true;
+}
+
+bool SessionRecorder::isRecording() const
+{
+    return recordFile.isOpen();
+}
+
+bool SessionRecorder::isReplaying() const
+{
+    return replaying;
+}
+
+qint64 SessionRecorder::begin() const
+{
+    return clock.nsecsElapsed() / 1000;
+}
+
+void SessionRecorder::record ( Operation operation, qint64 started, const QVariantList &arguments, const QVariant &result )
+{
+    const quint32 duration = begin() - started;
+
+    QMutexLocker locker ( &mutex );
+
+    if ( !recordFile.isOpen() )
+    {
+        return;
+    }
+
+    recordStream << ( quint8 ) operation << started << duration << arguments << result;
+
+    // keep the trace usable if the slave gets killed
+    recordFile.flush();
+}
+
+const SessionRecorder::Transaction* SessionRecorder::replay ( Operation operation, const QVariantList &arguments, bool delay )
+{
+    const Transaction *found = 0;
+
+    {
+        QMutexLocker locker ( &mutex );
+
+        const QList<int> &indices = byOperation[operation];
+        int &cursor = cursors[operation];
+
+        for ( int i = cursor; i < indices.size(); i++ )
+        {
+            Transaction &transaction = transactions[indices.at ( i )];
+            if ( !transaction.replayed && transaction.arguments == arguments )
+            {
+                transaction.replayed = true;
+                found = &transaction;
+                matched++;
+                break;
+            }
+        }
+
+        while ( cursor < indices.size() && transactions.at ( indices.at ( cursor ) ).replayed )
+        {
+            cursor++;
+        }
+
+        // the modified slave may repeat a query, answer it like the last time
+        for ( int i = cursor - 1; !found && i >= 0; i-- )
+        {
+            const Transaction &transaction = transactions.at ( indices.at ( i ) );
+            if ( transaction.arguments == arguments )
+            {
+                found = &transaction;
+            }
+        }
+
+        if ( !found )
+        {
+            missed++;
+            kWarning ( KIO_MTP ) << "No recorded transaction for operation" << operation << arguments;
+            return 0;
+        }
+
+        recordedTime += found->duration;
+    }
+
+    if ( delay )
+    {
+        this->delay ( found->duration );
+    }
+
+    return found;
+}
+
+void SessionRecorder::delay ( quint32 usecs ) const
+{
+    if ( usecs > 0 )
+    {
+        usleep ( usecs );
+    }
+}
+
+QStringList SessionRecorder::recordedDevices() const
+{
+    QMutexLocker locker ( &mutex );
+
+    QStringList udis;
+    foreach ( int index, byOperation.value ( OpenDevice ) )
+    {
+        const QString udi = transactions.at ( index ).arguments.value ( 0 ).toString();
+        if ( !udis.contains ( udi ) )
+        {
+            udis.append ( udi );
+        }
+    }
+    return udis;
+}
+
+void SessionRecorder::registerDevice ( LIBMTP_mtpdevice_t *device, const QString &udi )
+{
+    QMutexLocker locker ( &mutex );
+    deviceKeys.insert ( device, udi );
+}
+
+void SessionRecorder::unregisterDevice ( LIBMTP_mtpdevice_t *device )
+{
+    QMutexLocker locker ( &mutex );
+    deviceKeys.remove ( device );
+}
+
+QString SessionRecorder::deviceKey ( LIBMTP_mtpdevice_t *device ) const
+{
+    QMutexLocker locker ( &mutex );
+    return deviceKeys.value ( device );
+}
@@ -0,0 +1,158 @@
+/*
+ *  Record and replay of libmtp sessions for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef SESSIONRECORDER_H
+#define SESSIONRECORDER_H
+
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QStringList>
+#include <QVariant>
+
+#include <libmtp.h>
+
+/**
+ * @class SessionRecorder Captures every libmtp transaction of a session into a trace file and
+ * serves recorded transactions back in place of a real device.
+ *
+ * Recording is enabled by setting KIO_MTP_RECORD to the path of the trace file, replaying by
+ * setting KIO_MTP_REPLAY. Both may be set at once, which captures the replayed session of a
+ * modified slave so both traces can be compared transaction by transaction.
+ *
+ * Only use it through instance(), the wrappers in mtpcalls.h are the only callers.
+ */
+class SessionRecorder
+{
+public:
+    enum Operation
+    {
+        OpenDevice = 1,
+        ReleaseDevice,
+        GetFriendlyname,
+        GetModelname,
+        SetFriendlyname,
+        GetFilesAndFolders,
+        GetFilemetadata,
+        GetFileToHandler,
+        GetFileToFile,
+        SendFileFromHandler,
+        SendFileFromFile,
+        SendFileFromFileDescriptor,
+        CreateFolder,
+        DeleteObject,
+        SetFileName,
+        CheckCapability,
+        GetPartialObject,
+        GetSerialnumber,
+        GetDeviceversion,
+        GetStorage,
+        SendPartialObject,
+        BeginEditObject,
+        EndEditObject,
+        TruncateObject,
+        GetFilelisting,
+        GetTrackmetadata,
+        GetU32FromObject
+    };
+
+    struct Transaction
+    {
+        quint8 operation;
+        qint64 start;
+        quint32 duration;
+        QVariantList arguments;
+        QVariant result;
+        bool replayed;
+    };
+
+    SessionRecorder();
+    ~SessionRecorder();
+
+    static SessionRecorder* instance();
+
+    bool isRecording() const;
+    bool isReplaying() const;
+
+    /**
+     * Returns the timestamp to pass to record() once the transaction finished.
+     */
+    qint64 begin() const;
+
+    /**
+     * Appends a finished transaction to the trace file.
+     *
+     * @param operation The libmtp operation that was executed
+     * @param started The value returned by begin() before the operation was executed
+     * @param arguments The arguments identifying the transaction
+     * @param result Everything needed to reproduce the result of the transaction
+     */
+    void record( Operation operation, qint64 started, const QVariantList &arguments, const QVariant &result );
+
+    /**
+     * Looks up the next recorded transaction matching operation and arguments and waits for its
+     * recorded latency, unless @p delay is false.
+     *
+     * @return The matching transaction or 0 if the recorded session never issued it
+     */
+    const Transaction* replay( Operation operation, const QVariantList &arguments, bool delay = true );
+
+    /**
+     * Waits for the given part of a recorded latency, used to spread transfers over their chunks.
+     */
+    void delay( quint32 usecs ) const;
+
+    /**
+     * Returns the UDIs of all devices opened during the recorded session.
+     */
+    QStringList recordedDevices() const;
+
+    /**
+     * Associates a device pointer with the UDI it was opened for, every transaction on a device
+     * is recorded with that UDI as first argument.
+     */
+    void registerDevice( LIBMTP_mtpdevice_t *device, const QString &udi );
+    void unregisterDevice( LIBMTP_mtpdevice_t *device );
+    QString deviceKey( LIBMTP_mtpdevice_t *device ) const;
+
+private:
+    bool load( const QString &path );
+
+    mutable QMutex mutex;
+    QElapsedTimer clock;
+
+    QFile recordFile;
+    QDataStream recordStream;
+
+    bool replaying;
+    QList<Transaction> transactions;
+    QHash<quint8, QList<int> > byOperation;
+    QHash<quint8, int> cursors;
+
+    QHash<LIBMTP_mtpdevice_t*, QString> deviceKeys;
+
+    quint32 matched, missed;
+    qint64 recordedTime;
+};
+
+#endif // SESSIONRECORDER_H
@@ -0,0 +1,207 @@
+/*
+ *  Snapshots of storages for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "storagesnapshot.h"
+#include "tracer.h"
+
+#include <KDebug>
+#include <KStandardDirs>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QStringList>
+
+#define KIO_MTP                     7000
+
+#define SNAPSHOT_MAGIC              0x4d545053  // "MTPS"
+#define SNAPSHOT_VERSION            1
+#define SNAPSHOT_KEEP               3
+// guards against broken devices reporting a folder as its own ancestor
+#define SNAPSHOT_MAX_DEPTH          256
+
+static QString snapshotPrefix ( const QString &device, uint32_t storageId )
+{
+    // device keys contain serial numbers with arbitrary characters
+    const QByteArray hash = QCryptographicHash::hash ( device.toUtf8(), QCryptographicHash::Md5 ).toHex();
+
+    return QString::fromLatin1 ( hash ) + QLatin1Char ( '-' ) + QString::number ( storageId, 16 ) + QLatin1Char ( '-' );
+}
+
+static QString snapshotDirectory()
+{
+    return KStandardDirs::locateLocal ( "data", QLatin1String ( "kio_mtp/snapshots/" ), true );
+}
+
+StorageSnapshot::StorageSnapshot()
+{
+}
+
+StorageSnapshot::StorageSnapshot ( const LIBMTP_file_t *files, uint32_t storageId )
+{
+    for ( const LIBMTP_file_t *file = files; file != NULL; file = file->next )
+    {
+        if ( file->storage_id != storageId )
+            continue;
+
+        Entry entry;
+        entry.parent = file->parent_id;
+        entry.name = QString::fromUtf8 ( file->filename );
+        entry.size = file->filesize;
+        entry.modified = file->modificationdate;
+
+        entries.insert ( file->item_id, entry );
+    }
+}
+
+StorageSnapshot StorageSnapshot::load ( const QString &device, uint32_t storageId, const QString &token )
+{
+    TraceSpan span ( "StorageSnapshot::load", "cache", token );
+
+    StorageSnapshot snapshot;
+
+    // tokens come from clients, don't let them point anywhere else
+    if ( token.isEmpty() || token.contains ( QLatin1Char ( '/' ) ) )
+        return snapshot;
+
+    QFile file ( snapshotDirectory() + snapshotPrefix ( device, storageId ) + token );
+    if ( !file.open ( QIODevice::ReadOnly ) )
+    {
+        kDebug ( KIO_MTP ) << "Unknown snapshot" << token;
+        return snapshot;
+    }
+
+    QDataStream stream ( &file );
+
+    quint32 magic, version, count;
+    stream >> magic >> version >> count;
+
+    if ( magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION )
+        return snapshot;
+
+    for ( quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++ )
+    {
+        quint32 handle;
+        Entry entry;
+        stream >> handle >> entry.parent >> entry.name >> entry.size >> entry.modified;
+
+        snapshot.entries.insert ( handle, entry );
+    }
+
+    if ( stream.status() != QDataStream::Ok )
+    {
+        kDebug ( KIO_MTP ) << "Broken snapshot" << token;
+        return StorageSnapshot();
+    }
+
+    return snapshot;
+}
+
+QString StorageSnapshot::save ( const QString &device, uint32_t storageId ) const
+{
+    TraceSpan span ( "StorageSnapshot::save", "cache" );
+
+    const QString directory = snapshotDirectory();
+    const QString prefix = snapshotPrefix ( device, storageId );
+
+    // fixed width, so newer tokens also sort after older ones
+    const QString token = QString::fromLatin1 ( "%1" ).arg ( QDateTime::currentMSecsSinceEpoch(), 12, 36, QLatin1Char ( '0' ) );
+
+    QFile file ( directory + prefix + token );
+    if ( !file.open ( QIODevice::WriteOnly ) )
+    {
+        kWarning ( KIO_MTP ) << "Can't store snapshot" << file.fileName();
+        return QString();
+    }
+
+    QDataStream stream ( &file );
+    stream << ( quint32 ) SNAPSHOT_MAGIC << ( quint32 ) SNAPSHOT_VERSION << ( quint32 ) entries.size();
+
+    for ( QHash<quint32, Entry>::const_iterator it = entries.constBegin(); it != entries.constEnd(); ++it )
+    {
+        stream << it.key() << it.value().parent << it.value().name << it.value().size << it.value().modified;
+    }
+
+    file.close();
+
+    QStringList snapshots = QDir ( directory ).entryList ( QStringList() << prefix + QLatin1Char ( '*' ), QDir::Files, QDir::Name );
+    while ( snapshots.size() > SNAPSHOT_KEEP )
+    {
+        QFile::remove ( directory + snapshots.takeFirst() );
+    }
+
+    return token;
+}
+
+quint32 StorageSnapshot::writeChanges ( const StorageSnapshot &previous, QDataStream &stream ) const
+{
+    TraceSpan span ( "StorageSnapshot::writeChanges", "cache" );
+
+    quint32 count = 0;
+
+    for ( QHash<quint32, Entry>::const_iterator it = entries.constBegin(); it != entries.constEnd(); ++it )
+    {
+        const Entry &entry = it.value();
+
+        qint8 change;
+        if ( !previous.entries.contains ( it.key() ) )
+        {
+            change = Added;
+        }
+        else
+        {
+            const Entry &old = previous.entries[it.key()];
+            if ( old.parent == entry.parent && old.name == entry.name && old.size == entry.size && old.modified == entry.modified )
+                continue;
+
+            change = Changed;
+        }
+
+        stream << change << path ( it.key() ) << it.key() << entry.size << entry.modified;
+        count++;
+    }
+
+    for ( QHash<quint32, Entry>::const_iterator it = previous.entries.constBegin(); it != previous.entries.constEnd(); ++it )
+    {
+        if ( entries.contains ( it.key() ) )
+            continue;
+
+        stream << ( qint8 ) Removed << previous.path ( it.key() ) << it.key() << it.value().size << it.value().modified;
+        count++;
+    }
+
+    return count;
+}
+
+QString StorageSnapshot::path ( quint32 handle ) const
+{
+    QStringList items;
+
+    for ( int depth = 0; entries.contains ( handle ) && depth < SNAPSHOT_MAX_DEPTH; depth++ )
+    {
+        const Entry &entry = entries[handle];
+
+        items.prepend ( entry.name );
+        handle = entry.parent;
+    }
+
+    return QLatin1Char ( '/' ) + items.join ( QLatin1String ( "/" ) );
+}
@@ -0,0 +1,100 @@
+/*
+ *  Snapshots of storages for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#ifndef STORAGESNAPSHOT_H
+#define STORAGESNAPSHOT_H
+
+#include <QDataStream>
+#include <QHash>
+#include <QString>
+
+#include <libmtp.h>
+
+/**
+ * @class StorageSnapshot The state of every object on a storage at one point in time, so the
+ * changes since then can be found without fetching the metadata of unchanged objects twice.
+ *
+ * Snapshots are stored in the data directory of the user and identified by a token, which clients
+ * pass back to get the changes since that snapshot. Only the latest few snapshots of a storage
+ * are kept.
+ */
+class StorageSnapshot
+{
+public:
+    enum Change
+    {
+        Added = 0,
+        Removed = 1,
+        Changed = 2
+    };
+
+    StorageSnapshot();
+
+    /**
+     * Takes the objects of one storage from a listing of the whole device, the list itself is not
+     * taken over.
+     */
+    StorageSnapshot ( const LIBMTP_file_t *files, uint32_t storageId );
+
+    /**
+     * Loads a stored snapshot.
+     *
+     * @param device Identifies the device, see DeviceProfile::key()
+     * @return An empty snapshot if the token is unknown
+     */
+    static StorageSnapshot load ( const QString &device, uint32_t storageId, const QString &token );
+
+    /**
+     * Stores the snapshot and drops older ones of the same storage.
+     *
+     * @return The token to load it with or an empty string if it couldn't be stored
+     */
+    QString save ( const QString &device, uint32_t storageId ) const;
+
+    bool isEmpty() const
+    {
+        return entries.isEmpty();
+    }
+
+    /**
+     * Writes every object added, removed or changed since @p previous, as the kind of change
+     * (qint8), the path below the storage (QString), the handle (quint32), the size (quint64) and
+     * the modification time (qint64). Removed objects carry their last known state.
+     *
+     * @return The number of changes
+     */
+    quint32 writeChanges ( const StorageSnapshot &previous, QDataStream &stream ) const;
+
+private:
+    struct Entry
+    {
+        quint32 parent;
+        QString name;
+        quint64 size;
+        qint64 modified;
+    };
+
+    QString path ( quint32 handle ) const;
+
+    QHash<quint32, Entry> entries;
+};
+
+#endif // STORAGESNAPSHOT_H
@@ -0,0 +1,92 @@
+/*
+ *  Folder trees of whole storages for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "storagetree.h"
+#include "tracer.h"
+
+#include <KDebug>
+
+#define KIO_MTP                     7000
+
+// guards against broken devices reporting a folder as its own ancestor
+#define STORAGETREE_MAX_DEPTH       256
+
+static void add ( StorageTree::Totals &totals, const LIBMTP_file_t *file )
+{
+    if ( file->filetype == LIBMTP_FILETYPE_FOLDER )
+    {
+        totals.folders++;
+    }
+    else
+    {
+        totals.files++;
+        totals.size += file->filesize;
+    }
+}
+
+StorageTree::StorageTree()
+{
+}
+
+StorageTree::StorageTree ( const LIBMTP_file_t *files )
+{
+    TraceSpan span ( "StorageTree::StorageTree", "cache" );
+
+    QHash<uint32_t, uint32_t> parents;
+    int count = 0;
+
+    for ( const LIBMTP_file_t *file = files; file != NULL; file = file->next )
+    {
+        if ( file->filetype == LIBMTP_FILETYPE_FOLDER )
+            parents.insert ( file->item_id, file->parent_id );
+
+        count++;
+    }
+
+    for ( const LIBMTP_file_t *file = files; file != NULL; file = file->next )
+    {
+        // every object counts for its storage and all of its ancestors
+        add ( storageTotals[file->storage_id], file );
+
+        uint32_t parent = file->parent_id;
+        for ( int depth = 0; parents.contains ( parent ) && depth < STORAGETREE_MAX_DEPTH; depth++ )
+        {
+            add ( folderTotals[parent], file );
+            parent = parents.value ( parent );
+        }
+    }
+
+    kDebug ( KIO_MTP ) << "Built tree of" << count << "objects in" << storageTotals.size() << "storages";
+
+    age.start();
+}
+
+bool StorageTree::isValid ( int timeToLive ) const
+{
+    return age.isValid() && age.elapsed() < timeToLive * 1000;
+}
+
+StorageTree::Totals StorageTree::totals ( uint32_t storageId, uint32_t folderId ) const
+{
+    if ( folderId == 0xFFFFFFFF )
+        return storageTotals.value ( storageId );
+
+    return folderTotals.value ( folderId );
+}
@@ -0,0 +1,72 @@
+/*
+ *  Folder trees of whole storages for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#ifndef STORAGETREE_H
+#define STORAGETREE_H
+
+#include <QElapsedTimer>
+#include <QHash>
+
+#include <libmtp.h>
+
+/**
+ * @class StorageTree Sums up the sizes and item counts below every folder of a device, built
+ * from a single listing of the whole device.
+ *
+ * Answers the recursive size of any folder without listing its subtree, the tree is thrown away
+ * once it is too old or the device was modified.
+ */
+class StorageTree
+{
+public:
+    struct Totals
+    {
+        Totals() : size ( 0 ), files ( 0 ), folders ( 0 ) {}
+
+        quint64 size;
+        quint32 files;
+        quint32 folders;
+    };
+
+    StorageTree();
+
+    /**
+     * Sums up a listing of all files and folders of the device, the list itself is not taken over.
+     */
+    explicit StorageTree ( const LIBMTP_file_t *files );
+
+    /**
+     * Whether the tree was built less than @p timeToLive seconds ago.
+     */
+    bool isValid ( int timeToLive = 60 ) const;
+
+    /**
+     * Returns everything below a folder, or below the storage itself for the folder 0xFFFFFFFF.
+     */
+    Totals totals ( uint32_t storageId, uint32_t folderId ) const;
+
+private:
+    QHash<uint32_t, Totals> storageTotals;
+    QHash<uint32_t, Totals> folderTotals;
+    QElapsedTimer age;
+};
+
+#endif // STORAGETREE_H
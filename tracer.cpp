@@ -0,0 +1,148 @@
+/*
+ *  Trace event export for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "tracer.h"
+
+#include <KDebug>
+#include <KGlobal>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define KIO_MTP                     7000
+#define TRACE_BUFFER_SIZE           0x10000
+
+K_GLOBAL_STATIC ( Tracer, s_tracer )
+
+bool Tracer::s_enabled = !qgetenv ( "KIO_MTP_TRACE" ).isEmpty();
+
+Tracer* Tracer::instance()
+{
+    return s_tracer;
+}
+
+Tracer::Tracer()
+    : pid ( getpid() )
+{
+    clock.start();
+
+    if ( !s_enabled )
+        return;
+
+    // one file per slave, several slaves may run at once
+    QString path = QString::fromLocal8Bit ( qgetenv ( "KIO_MTP_TRACE" ) );
+    path.replace ( QLatin1String ( "%p" ), QString::number ( pid ) );
+
+    file.setFileName ( path );
+    if ( !file.open ( QIODevice::WriteOnly | QIODevice::Truncate ) )
+    {
+        kError ( KIO_MTP ) << "Could not open" << path << "for tracing";
+        s_enabled = false;
+        return;
+    }
+
+    kDebug ( KIO_MTP ) << "Writing trace events to" << path;
+
+    buffer.reserve ( TRACE_BUFFER_SIZE * 2 );
+    buffer.append ( "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+    buffer.append ( "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" );
+    buffer.append ( QByteArray::number ( pid ) );
+    buffer.append ( ",\"args\":{\"name\":\"kio_mtp\"}}" );
+}
+
+Tracer::~Tracer()
+{
+    if ( !file.isOpen() )
+        return;
+
+    QMutexLocker locker ( &mutex );
+
+    buffer.append ( "\n]}\n" );
+    flush();
+    file.close();
+}
+
+qint64 Tracer::now() const
+{
+    return clock.nsecsElapsed() / 1000;
+}
+
+static void appendEscaped ( QByteArray &buffer, const QByteArray &string )
+{
+    for ( int i = 0; i < string.size(); i++ )
+    {
+        const char c = string.at ( i );
+        if ( c == '"' || c == '\\' )
+        {
+            buffer.append ( '\\' );
+            buffer.append ( c );
+        }
+        else if ( ( unsigned char ) c < 0x20 )
+        {
+            buffer.append ( ' ' );
+        }
+        else
+        {
+            buffer.append ( c );
+        }
+    }
+}
+
+void Tracer::complete ( const char *name, const char *category, qint64 start, const QString &detail )
+{
+    const qint64 end = now();
+    const long tid = syscall ( SYS_gettid );
+
+    QMutexLocker locker ( &mutex );
+
+    if ( !file.isOpen() )
+        return;
+
+    buffer.append ( ",\n{\"name\":\"" );
+    buffer.append ( name );
+    buffer.append ( "\",\"cat\":\"" );
+    buffer.append ( category );
+    buffer.append ( "\",\"ph\":\"X\",\"ts\":" );
+    buffer.append ( QByteArray::number ( start ) );
+    buffer.append ( ",\"dur\":" );
+    buffer.append ( QByteArray::number ( end - start ) );
+    buffer.append ( ",\"pid\":" );
+    buffer.append ( QByteArray::number ( pid ) );
+    buffer.append ( ",\"tid\":" );
+    buffer.append ( QByteArray::number ( ( qlonglong ) tid ) );
+
+    if ( !detail.isEmpty() )
+    {
+        buffer.append ( ",\"args\":{\"detail\":\"" );
+        appendEscaped ( buffer, detail.toUtf8() );
+        buffer.append ( "\"}" );
+    }
+
+    buffer.append ( '}' );
+
+    if ( buffer.size() > TRACE_BUFFER_SIZE )
+        flush();
+}
+
+void Tracer::flush()
+{
+    file.write ( buffer );
+    file.flush();
+    buffer.clear();
+}
@@ -0,0 +1,119 @@
+/*
+ *  Trace event export for KIO-MTP
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QString>
+
+/**
+ * @class Tracer Writes spans in the Chrome trace event format, which can be loaded into
+ * chrome://tracing or the Perfetto UI.
+ *
+ * Tracing is enabled by setting KIO_MTP_TRACE to the path of the JSON file to write. When it is
+ * not set, a TraceSpan costs a single branch.
+ */
+class Tracer
+{
+public:
+    Tracer();
+    ~Tracer();
+
+    static Tracer* instance();
+
+    /**
+     * Whether tracing is enabled, cheap enough to be checked per data chunk.
+     */
+    static bool isEnabled()
+    {
+        return s_enabled;
+    }
+
+    qint64 now() const;
+
+    /**
+     * Appends a complete event.
+     *
+     * @param name Name of the span, i.e. the KIO entry point or libmtp call
+     * @param category Category to filter spans by, i.e. "kio", "libmtp", "cache" or "data"
+     * @param start Start of the span as returned by now()
+     * @param detail Optional argument shown with the span, i.e. the path or size
+     */
+    void complete( const char *name, const char *category, qint64 start, const QString &detail );
+
+private:
+    void flush();
+
+    static bool s_enabled;
+
+    QMutex mutex;
+    QElapsedTimer clock;
+    QFile file;
+    QByteArray buffer;
+    qint64 pid;
+};
+
+/**
+ * @class TraceSpan Records the time from its construction to its destruction as a span.
+ */
+class TraceSpan
+{
+public:
+    TraceSpan( const char *name, const char *category )
+        : m_name ( name ), m_category ( category ), m_start ( Tracer::isEnabled() ? Tracer::instance()->now() : 0 )
+    {
+    }
+
+    TraceSpan( const char *name, const char *category, const QString &detail )
+        : m_name ( name ), m_category ( category ), m_start ( Tracer::isEnabled() ? Tracer::instance()->now() : 0 )
+    {
+        if ( Tracer::isEnabled() )
+            m_detail = detail;
+    }
+
+    ~TraceSpan()
+    {
+        if ( Tracer::isEnabled() )
+            Tracer::instance()->complete ( m_name, m_category, m_start, m_detail );
+    }
+
+    /**
+     * Attaches an argument that is only known at the end of the span.
+     */
+    void setDetail( const QString &detail )
+    {
+        if ( Tracer::isEnabled() )
+            m_detail = detail;
+    }
+
+private:
+    Q_DISABLE_COPY ( TraceSpan )
+
+    const char *m_name;
+    const char *m_category;
+    qint64 m_start;
+    QString m_detail;
+};
+
+#endif // TRACER_H
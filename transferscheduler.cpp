@@ -0,0 +1,255 @@
+/*
+ *  Chunked transfers that give way to interactive requests
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "transferscheduler.h"
+#include "devicecache.h"
+#include "mtpcalls.h"
+#include "tracer.h"
+
+#include <KDebug>
+
+#include <stdlib.h>
+
+#define KIO_MTP                     7000
+
+#define TRANSFER_CHUNK_SIZE         0x400000    // 4 MiB
+#define TRANSFER_MIN_CHUNK_SIZE     0x40000     // 256 KiB
+#define TRANSFER_CHUNK_TIME         100         // msec per chunk, bounds the reaction to cancellation
+#define TRANSFER_MIN_SLICE          500         // msec of bulk transfer between two yields
+#define TRANSFER_MAX_RECOVERIES     3           // new sessions per transfer before giving up
+
+TransferScheduler::TransferScheduler ( CachedDevice *device )
+    : device ( device ), chunkSize ( TRANSFER_MIN_CHUNK_SIZE ), recoveries ( 0 )
+{
+    // the session must not be closed as idle while transferring
+    device->ref();
+}
+
+TransferScheduler::~TransferScheduler()
+{
+    device->deref();
+}
+
+LIBMTP_mtpdevice_t* TransferScheduler::yieldIfRequested ( LIBMTP_mtpdevice_t *mtpdevice, uint32_t editedId )
+{
+    if ( slice.elapsed() < TRANSFER_MIN_SLICE || !device->isRequested ( DeviceArbiter::Interactive ) )
+        return mtpdevice;
+
+    TraceSpan span ( "TransferScheduler::yield", "scheduler" );
+
+    kDebug ( KIO_MTP ) << "Handing the device over to an interactive request";
+
+    // an edit doesn't survive the session
+    if ( editedId != 0 )
+        mtpEndEditObject ( mtpdevice, editedId );
+
+    device->releaseSession();
+    mtpdevice = device->getDevice ( DeviceArbiter::Bulk );
+
+    if ( mtpdevice && editedId != 0 && mtpBeginEditObject ( mtpdevice, editedId ) != 0 )
+        return 0;
+
+    slice.restart();
+
+    return mtpdevice;
+}
+
+void TransferScheduler::adaptChunkSize ( uint32_t length, qint64 msecs )
+{
+    const uint64_t size = ( uint64_t ) length * TRANSFER_CHUNK_TIME / qMax<qint64> ( msecs, 1 );
+
+    // grow at most fourfold per chunk, a single fast chunk may just have hit a cache
+    chunkSize = qBound<uint64_t> ( TRANSFER_MIN_CHUNK_SIZE, qMin<uint64_t> ( size, ( uint64_t ) chunkSize * 4 ), TRANSFER_CHUNK_SIZE );
+}
+
+LIBMTP_mtpdevice_t* TransferScheduler::recover ( LIBMTP_mtpdevice_t *mtpdevice, uint32_t editedId )
+{
+    if ( recoveries >= TRANSFER_MAX_RECOVERIES || !device->recover ( mtpdevice ) )
+    {
+        // the session may be gone with the device, and the edit with it
+        if ( mtpdevice )
+        {
+            LIBMTP_Dump_Errorstack ( mtpdevice );
+            LIBMTP_Clear_Errorstack ( mtpdevice );
+
+            if ( editedId != 0 )
+                mtpEndEditObject ( mtpdevice, editedId );
+        }
+
+        return 0;
+    }
+
+    recoveries++;
+
+    kDebug ( KIO_MTP ) << "Repeating the failed chunk in a new session";
+
+    mtpdevice = device->getDevice ( DeviceArbiter::Bulk );
+
+    // the edit was lost with the old session
+    if ( mtpdevice && editedId != 0 && mtpBeginEditObject ( mtpdevice, editedId ) != 0 )
+        return 0;
+
+    return mtpdevice;
+}
+
+int TransferScheduler::upload ( uint32_t id, uint64_t offset, uint64_t size, MTPDataGetFunc get, void *priv,
+                                LIBMTP_progressfunc_t progress, void const *const data )
+{
+    LIBMTP_mtpdevice_t *mtpdevice = device->getDevice ( DeviceArbiter::Bulk );
+    if ( !mtpdevice )
+        return -1;
+
+    // failures are judged by the errors of this transfer
+    LIBMTP_Clear_Errorstack ( mtpdevice );
+
+    const DeviceProfile profile = device->getProfile();
+    if ( !profile.hasCapability ( LIBMTP_DEVICECAP_SendPartialObject ) || !profile.hasCapability ( LIBMTP_DEVICECAP_EditObjects ) )
+    {
+        kDebug ( KIO_MTP ) << "No partial writes, can't append to" << id;
+        return -1;
+    }
+
+    if ( mtpBeginEditObject ( mtpdevice, id ) != 0 )
+    {
+        LIBMTP_Dump_Errorstack ( mtpdevice );
+        LIBMTP_Clear_Errorstack ( mtpdevice );
+        return -1;
+    }
+
+    QByteArray buffer ( TRANSFER_CHUNK_SIZE, 0 );
+    uint64_t position = offset;
+
+    slice.start();
+
+    forever
+    {
+        mtpdevice = yieldIfRequested ( mtpdevice, id );
+        if ( !mtpdevice )
+            return -1;
+
+        uint32_t length = 0;
+        if ( get ( 0, priv, chunkSize, ( unsigned char* ) buffer.data(), &length ) != LIBMTP_HANDLER_RETURN_OK )
+        {
+            mtpEndEditObject ( mtpdevice, id );
+            return -1;
+        }
+
+        // end of the source
+        if ( length == 0 )
+            break;
+
+        QElapsedTimer timer;
+        timer.start();
+
+        // writing the same chunk to the same offset again is harmless
+        while ( mtpSendPartialObject ( mtpdevice, id, position, ( unsigned char* ) buffer.data(), length ) != 0 )
+        {
+            mtpdevice = recover ( mtpdevice, id );
+            if ( !mtpdevice )
+                return -1;
+
+            timer.restart();
+        }
+
+        adaptChunkSize ( length, timer.elapsed() );
+        position += length;
+
+        if ( progress && progress ( position, size, data ) != 0 )
+        {
+            mtpEndEditObject ( mtpdevice, id );
+            return -1;
+        }
+    }
+
+    return mtpEndEditObject ( mtpdevice, id );
+}
+
+int TransferScheduler::download ( uint32_t id, uint64_t offset, uint64_t size, MTPDataPutFunc put, void *priv,
+                                  LIBMTP_progressfunc_t progress, void const *const data )
+{
+    LIBMTP_mtpdevice_t *mtpdevice = device->getDevice ( DeviceArbiter::Bulk );
+    if ( !mtpdevice )
+        return -1;
+
+    // failures are judged by the errors of this transfer
+    LIBMTP_Clear_Errorstack ( mtpdevice );
+
+    if ( !device->getProfile().hasCapability ( LIBMTP_DEVICECAP_GetPartialObject ) )
+    {
+        kDebug ( KIO_MTP ) << "No partial reads, transferring" << id << "in one go";
+
+        if ( offset != 0 )
+            return -1;
+
+        const int ret = mtpGetFileToHandler ( mtpdevice, id, put, priv, progress, data );
+
+        // part of the data is already passed on, only leave a working session for the next attempt
+        if ( ret != 0 && !device->recover ( mtpdevice ) && mtpdevice )
+        {
+            LIBMTP_Dump_Errorstack ( mtpdevice );
+            LIBMTP_Clear_Errorstack ( mtpdevice );
+        }
+        return ret;
+    }
+
+    slice.start();
+
+    for ( uint64_t position = offset; position < size; )
+    {
+        mtpdevice = yieldIfRequested ( mtpdevice, 0 );
+        if ( !mtpdevice )
+            return -1;
+
+        unsigned char *buffer = 0;
+        unsigned int length = 0;
+
+        const uint32_t wanted = qMin<uint64_t> ( chunkSize, size - position );
+
+        QElapsedTimer timer;
+        timer.start();
+
+        if ( mtpGetPartialObject ( mtpdevice, id, position, wanted, &buffer, &length ) != 0 || length == 0 )
+        {
+            free ( buffer );
+
+            // nothing of the chunk was passed on yet, just ask for it again
+            mtpdevice = recover ( mtpdevice, 0 );
+            if ( !mtpdevice )
+                return -1;
+
+            continue;
+        }
+
+        adaptChunkSize ( length, timer.elapsed() );
+
+        uint32_t putlen = 0;
+        const uint16_t ret = put ( 0, priv, length, buffer, &putlen );
+        free ( buffer );
+
+        if ( ret != LIBMTP_HANDLER_RETURN_OK )
+            return -1;
+
+        position += length;
+
+        if ( progress && progress ( position, size, data ) != 0 )
+            return -1;
+    }
+
+    return 0;
+}
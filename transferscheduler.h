@@ -0,0 +1,94 @@
+/*
+ *  Chunked transfers that give way to interactive requests
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef TRANSFERSCHEDULER_H
+#define TRANSFERSCHEDULER_H
+
+#include <QElapsedTimer>
+
+#include <libmtp.h>
+
+class CachedDevice;
+
+/**
+ * @class TransferScheduler Splits transfers into GetPartialObject and SendPartialObject chunks and hands the device
+ * over to waiting interactive requests of other slaves between chunks.
+ *
+ * To keep bulk transfers from starving, the device is given away at most once per time slice,
+ * so a transfer always keeps a fair share of the bus.
+ *
+ * Chunks are sized to take about 100 ms at the rate measured so far, a cancelled transfer
+ * frees the bus after its current chunk. A chunk that failed because the session broke is sent
+ * again in a new session.
+ */
+class TransferScheduler
+{
+public:
+    explicit TransferScheduler ( CachedDevice *device );
+    ~TransferScheduler();
+
+    /**
+     * Downloads an object, behaves like LIBMTP_Get_File_To_Handler().
+     *
+     * @param id The object to download
+     * @param offset Where to start in the object, must be 0 if the device can't do partial reads
+     * @param size The size of the object
+     * @return 0 on success
+     */
+    int download ( uint32_t id, uint64_t offset, uint64_t size, MTPDataPutFunc put, void *priv,
+                   LIBMTP_progressfunc_t progress, void const *const data );
+
+    /**
+     * Writes to an existing object from the given offset on, until get returns no more data.
+     * Needs the SendPartialObject and EditObjects extensions of Android devices.
+     *
+     * @param size The expected size of the object for progress reports
+     * @return 0 on success
+     */
+    int upload ( uint32_t id, uint64_t offset, uint64_t size, MTPDataGetFunc get, void *priv,
+                 LIBMTP_progressfunc_t progress, void const *const data );
+
+private:
+    /**
+     * @param editedId The object in edit, the edit is ended before the device is handed over and
+     * begun again afterwards
+     */
+    LIBMTP_mtpdevice_t* yieldIfRequested ( LIBMTP_mtpdevice_t *mtpdevice, uint32_t editedId );
+
+    /**
+     * Sizes the next chunk after the time the last one took.
+     */
+    void adaptChunkSize ( uint32_t length, qint64 msecs );
+
+    /**
+     * Opens a new session after a failed chunk if the old one broke, and begins the edit again.
+     * Otherwise dumps the errors and ends the edit.
+     *
+     * @return The new device or 0 if the chunk can't be repeated
+     */
+    LIBMTP_mtpdevice_t* recover ( LIBMTP_mtpdevice_t *mtpdevice, uint32_t editedId );
+
+    CachedDevice *device;
+    QElapsedTimer slice;
+    uint32_t chunkSize;
+    int recoveries;
+};
+
+#endif // TRANSFERSCHEDULER_H
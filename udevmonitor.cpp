@@ -0,0 +1,143 @@
+/*
+ *  Hotplug monitoring through libudev
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "udevmonitor.h"
+#include "devicecache.h"
+#include "tracer.h"
+
+#include <KDebug>
+
+#include <QSocketNotifier>
+
+#include <libudev.h>
+#include <stdlib.h>
+
+#define KIO_MTP                     7000
+
+UDevMonitor::UDevMonitor ( DeviceCache *cache )
+    : cache ( cache ), context ( 0 ), monitor ( 0 ), notifier ( 0 )
+{
+    context = udev_new();
+    if ( !context )
+        return;
+
+    monitor = udev_monitor_new_from_netlink ( context, "udev" );
+    if ( !monitor )
+        return;
+
+    udev_monitor_filter_add_match_subsystem_devtype ( monitor, "usb", "usb_device" );
+    if ( udev_monitor_enable_receiving ( monitor ) < 0 )
+    {
+        kWarning ( KIO_MTP ) << "Can't receive uevents, falling back to Solid";
+
+        udev_monitor_unref ( monitor );
+        monitor = 0;
+        return;
+    }
+
+    notifier = new QSocketNotifier ( udev_monitor_get_fd ( monitor ), QSocketNotifier::Read, this );
+    connect ( notifier, SIGNAL ( activated ( int ) ), this, SLOT ( processEvent() ) );
+
+    // devices connected before we started listening
+    struct udev_enumerate *enumerate = udev_enumerate_new ( context );
+    udev_enumerate_add_match_subsystem ( enumerate, "usb" );
+    udev_enumerate_add_match_property ( enumerate, "ID_MTP_DEVICE", "1" );
+    udev_enumerate_scan_devices ( enumerate );
+
+    struct udev_list_entry *entry;
+    udev_list_entry_foreach ( entry, udev_enumerate_get_list_entry ( enumerate ) )
+    {
+        struct udev_device *device = udev_device_new_from_syspath ( context, udev_list_entry_get_name ( entry ) );
+        if ( device )
+        {
+            addDevice ( device );
+            udev_device_unref ( device );
+        }
+    }
+
+    udev_enumerate_unref ( enumerate );
+}
+
+UDevMonitor::~UDevMonitor()
+{
+    delete notifier;
+
+    if ( monitor )
+        udev_monitor_unref ( monitor );
+    if ( context )
+        udev_unref ( context );
+}
+
+bool UDevMonitor::isValid() const
+{
+    return monitor != 0;
+}
+
+QString UDevMonitor::udi ( struct udev_device *device )
+{
+    return QLatin1String ( "/org/kde/solid/udev" ) + QString::fromLatin1 ( udev_device_get_syspath ( device ) );
+}
+
+void UDevMonitor::addDevice ( struct udev_device *device )
+{
+    if ( qstrcmp ( udev_device_get_devtype ( device ), "usb_device" ) != 0 )
+        return;
+
+    if ( qstrcmp ( udev_device_get_property_value ( device, "ID_MTP_DEVICE" ), "1" ) != 0 )
+        return;
+
+    const char *busNum = udev_device_get_property_value ( device, "BUSNUM" );
+    const char *devNum = udev_device_get_property_value ( device, "DEVNUM" );
+    if ( !busNum || !devNum )
+        return;
+
+    kDebug ( KIO_MTP ) << "UDEV: MTP device at" << busNum << devNum;
+
+    cache->checkDevice ( udi ( device ), atoi ( busNum ), atoi ( devNum ) );
+}
+
+void UDevMonitor::processEvent()
+{
+    struct udev_device *device = udev_monitor_receive_device ( monitor );
+    if ( !device )
+        return;
+
+    const char *action = udev_device_get_action ( device );
+
+    TraceSpan span ( "UDevMonitor::processEvent", "cache", QString::fromLatin1 ( action ) );
+
+    if ( qstrcmp ( action, "add" ) == 0 )
+    {
+        addDevice ( device );
+    }
+    else if ( qstrcmp ( action, "remove" ) == 0 )
+    {
+        const QString deviceUdi = udi ( device );
+        if ( cache->contains ( deviceUdi, true ) )
+        {
+            kDebug ( KIO_MTP ) << "UDEV: Device with udi=" << deviceUdi << "removed";
+
+            cache->removeDevice ( deviceUdi );
+        }
+    }
+
+    udev_device_unref ( device );
+}
+
+#include "udevmonitor.moc"
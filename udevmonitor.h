@@ -0,0 +1,72 @@
+/*
+ *  Hotplug monitoring through libudev
+ *  Copyright (C) 2013  Philipp Schmidt <philschmidt@gmx.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#ifndef UDEVMONITOR_H
+#define UDEVMONITOR_H
+
+#include <QObject>
+#include <QString>
+
+class DeviceCache;
+class QSocketNotifier;
+
+struct udev;
+struct udev_device;
+struct udev_monitor;
+
+/**
+ * @class UDevMonitor Feeds the DeviceCache from USB uevents without going through Solid.
+ *
+ * Only devices tagged with ID_MTP_DEVICE by the udev rules of libmtp are considered, their bus
+ * location is read straight from the event. The UDIs match the ones of the Solid udev backend,
+ * so mtp:udi= URLs keep working.
+ */
+class UDevMonitor : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Starts monitoring and adds the devices already connected.
+     */
+    explicit UDevMonitor ( DeviceCache *cache );
+    virtual ~UDevMonitor();
+
+    /**
+     * Whether uevents are received, fall back to Solid otherwise.
+     */
+    bool isValid() const;
+
+private slots:
+    void processEvent();
+
+private:
+    void addDevice ( struct udev_device *device );
+    static QString udi ( struct udev_device *device );
+
+    DeviceCache *cache;
+
+    struct udev *context;
+    struct udev_monitor *monitor;
+    QSocketNotifier *notifier;
+};
+
+#endif // UDEVMONITOR_H